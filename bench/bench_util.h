@@ -0,0 +1,132 @@
+#ifndef DNSPROXY_BENCH_UTIL_H
+#define DNSPROXY_BENCH_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static inline uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift64*, good enough for workload generation and reproducible by seed
+static inline uint64_t bench_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+static inline double bench_rand_unit(uint64_t *state) {
+    return (bench_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// log-linear histogram: values below 2^HIST_SUB_BITS get their own bucket, above that
+// every power of two is split into 2^HIST_SUB_BITS buckets (~6% relative error)
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} histogram_t;
+
+static inline void hist_init(histogram_t *hist) {
+    memset(hist, 0, sizeof(*hist));
+    hist->min = UINT64_MAX;
+}
+
+static inline int hist_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) {
+        return value;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    int sub = (value >> shift) & (HIST_SUB_COUNT - 1);
+    return (shift + 1) * HIST_SUB_COUNT + sub;
+}
+
+static inline uint64_t hist_bucket_low(int index) {
+    if (index < HIST_SUB_COUNT) {
+        return index;
+    }
+
+    int shift = index / HIST_SUB_COUNT - 1;
+    int sub = index % HIST_SUB_COUNT;
+    return ((uint64_t)(HIST_SUB_COUNT + sub)) << shift;
+}
+
+static inline void hist_add(histogram_t *hist, uint64_t value) {
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if (value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+static inline uint64_t hist_percentile(const histogram_t *hist, double percentile) {
+    if (hist->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist->total);
+    if (rank >= hist->total) {
+        rank = hist->total - 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen > rank) {
+            uint64_t low = hist_bucket_low(i);
+            return low > hist->max ? hist->max : low;
+        }
+    }
+
+    return hist->max;
+}
+
+static inline void hist_print(const histogram_t *hist, const char *unit) {
+    uint64_t peak = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (hist->counts[i] > peak) {
+            peak = hist->counts[i];
+        }
+    }
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (hist->counts[i] == 0) {
+            continue;
+        }
+
+        uint64_t low = hist_bucket_low(i);
+        uint64_t high = i + 1 < HIST_BUCKETS ? hist_bucket_low(i + 1) : UINT64_MAX;
+        int bar = (int)(hist->counts[i] * 50 / peak);
+
+        printf("  [%10llu, %10llu) %s %10llu ",
+               (unsigned long long)low,
+               (unsigned long long)high,
+               unit,
+               (unsigned long long)hist->counts[i]);
+        for (int j = 0; j < bar; j++) {
+            putchar('#');
+        }
+        putchar('\n');
+    }
+}
+
+#endif
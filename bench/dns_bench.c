@@ -0,0 +1,630 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "bench_util.h"
+
+#define MAX_MESSAGE_SIZE 4096
+#define MAX_NAME_LEN 253
+#define ID_SPACE 65536
+#define MAX_QTYPES 16
+
+typedef struct {
+    uint16_t qtype;
+    double weight;
+} qtype_weight_t;
+
+typedef struct {
+    const char *server;
+    uint16_t port;
+    double qps;
+    double duration;
+    int names_count;
+    double zipf_s;
+    double blocked_fraction;
+    const char *blocked_file;
+    const char *suffix;
+    int timeout_ms;
+    uint64_t seed;
+    qtype_weight_t qtypes[MAX_QTYPES];
+    int qtypes_count;
+} bench_config_t;
+
+typedef struct {
+    uint64_t sent_at;
+    char in_use;
+} inflight_t;
+
+typedef struct {
+    uint64_t sent;
+    uint64_t send_errors;
+    uint64_t received;
+    uint64_t unmatched;
+    uint64_t lost;
+    uint64_t rcodes[16];
+} bench_stats_t;
+
+static bench_config_t config;
+
+static double *zipf_cdf;
+static char **blocked_names;
+static int blocked_names_count;
+
+static inflight_t inflight[ID_SPACE];
+static bench_stats_t stats;
+static histogram_t latency;
+
+static void usage(const char *prog);
+static int parse_args(int argc, char **argv);
+static int parse_qtypes(const char *spec);
+static int qtype_from_name(const char *name);
+static int load_blocked_names();
+static void build_zipf_cdf();
+static int sample_zipf(uint64_t *rng);
+static uint16_t sample_qtype(uint64_t *rng);
+static size_t build_query(char *buffer, uint16_t id, const char *name, uint16_t qtype);
+static void drain_responses(int sock_fd, char *buffer);
+static void expire_inflight(uint64_t now);
+static void print_report(double elapsed_s);
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (load_blocked_names()) {
+        return -1;
+    }
+
+    build_zipf_cdf();
+    hist_init(&latency);
+
+    int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd == -1) {
+        fprintf(stderr, "socket creation failed with: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int rcvbuf = 8 * 1024 * 1024;
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.server, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid server address: %s\n", config.server);
+        return -1;
+    }
+
+    if (connect(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr))) {
+        fprintf(stderr, "connect failed with: %s\n", strerror(errno));
+        return -1;
+    }
+
+    printf("target %s:%d, %.0f qps for %.1f s, %d names (zipf s=%.2f), %.1f%% blocked\n",
+           config.server,
+           config.port,
+           config.qps,
+           config.duration,
+           config.names_count,
+           config.zipf_s,
+           config.blocked_fraction * 100);
+
+    uint64_t rng = config.seed;
+    char query[MAX_MESSAGE_SIZE];
+    char response[MAX_MESSAGE_SIZE];
+    char name[MAX_NAME_LEN + 1];
+
+    uint64_t interval_ns = (uint64_t)(1e9 / config.qps);
+    uint64_t start = bench_now_ns();
+    uint64_t end = start + (uint64_t)(config.duration * 1e9);
+    uint64_t next_send = start;
+    uint64_t next_expire = start;
+    uint16_t next_id = 0;
+
+    struct pollfd poll_fd;
+    poll_fd.fd = sock_fd;
+    poll_fd.events = POLLIN;
+
+    uint64_t now = start;
+    while (now < end) {
+        while (next_send <= now && next_send < end) {
+            if (bench_rand_unit(&rng) < config.blocked_fraction) {
+                const char *blocked = blocked_names[bench_rand(&rng) % blocked_names_count];
+                snprintf(name, sizeof(name), "%s", blocked);
+            } else {
+                snprintf(name, sizeof(name), "n%d.%s", sample_zipf(&rng), config.suffix);
+            }
+
+            uint16_t id = next_id++;
+            if (inflight[id].in_use) { // id space wrapped before the answer came back
+                stats.lost++;
+            }
+
+            size_t len = build_query(query, id, name, sample_qtype(&rng));
+            inflight[id].sent_at = bench_now_ns();
+            inflight[id].in_use = 1;
+
+            if (send(sock_fd, query, len, 0) < 0) {
+                inflight[id].in_use = 0;
+                stats.send_errors++;
+            } else {
+                stats.sent++;
+            }
+
+            next_send += interval_ns;
+        }
+
+        now = bench_now_ns();
+        int wait_ms = next_send > now ? (int)((next_send - now) / 1000000) : 0;
+        int ret = poll(&poll_fd, 1, wait_ms);
+        if (ret < 0 && errno != EINTR) {
+            fprintf(stderr, "poll failed with: %s\n", strerror(errno));
+            break;
+        }
+
+        if (ret > 0 && (poll_fd.revents & POLLIN)) {
+            drain_responses(sock_fd, response);
+        }
+
+        now = bench_now_ns();
+        if (now >= next_expire) {
+            expire_inflight(now);
+            next_expire = now + 100000000;
+        }
+    }
+
+    double elapsed_s = (bench_now_ns() - start) / 1e9;
+
+    uint64_t drain_end = bench_now_ns() + (uint64_t)config.timeout_ms * 1000000;
+    while ((now = bench_now_ns()) < drain_end && stats.received + stats.lost < stats.sent) {
+        int ret = poll(&poll_fd, 1, (int)((drain_end - now) / 1000000) + 1);
+        if (ret > 0 && (poll_fd.revents & POLLIN)) {
+            drain_responses(sock_fd, response);
+        }
+        expire_inflight(bench_now_ns());
+    }
+
+    for (int i = 0; i < ID_SPACE; i++) {
+        if (inflight[i].in_use) {
+            inflight[i].in_use = 0;
+            stats.lost++;
+        }
+    }
+
+    print_report(elapsed_s);
+
+    close(sock_fd);
+    free(zipf_cdf);
+    for (int i = 0; i < blocked_names_count; i++) {
+        free(blocked_names[i]);
+    }
+    free(blocked_names);
+
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -s, --server ADDR           proxy address (default 127.0.0.1)\n"
+            "  -p, --port PORT             proxy port (default 53)\n"
+            "  -q, --qps N                 target queries per second (default 10000)\n"
+            "  -d, --duration SEC          test duration (default 10)\n"
+            "  -n, --names N               number of distinct allowed names (default 10000)\n"
+            "  -z, --zipf S                zipf exponent of name popularity (default 1.0)\n"
+            "  -b, --blocked-fraction F    fraction of queries for blocked names (default 0)\n"
+            "  -B, --blocked-file FILE     blocked names, one per line (default: config.toml "
+            "example list)\n"
+            "  -t, --qtypes SPEC           qtype mix, e.g. A:70,AAAA:25,MX:5 (default A:100)\n"
+            "  -S, --suffix DOMAIN         suffix of generated names (default bench.test)\n"
+            "  -T, --timeout MS            time to wait for late answers (default 2000)\n"
+            "  -r, --seed N                random seed (default 1)\n",
+            prog);
+}
+
+static int parse_args(int argc, char **argv) {
+    config.server = "127.0.0.1";
+    config.port = 53;
+    config.qps = 10000;
+    config.duration = 10;
+    config.names_count = 10000;
+    config.zipf_s = 1.0;
+    config.blocked_fraction = 0;
+    config.blocked_file = 0;
+    config.suffix = "bench.test";
+    config.timeout_ms = 2000;
+    config.seed = 1;
+    config.qtypes_count = 0;
+
+    static const struct option options[] = {
+        {"server", required_argument, 0, 's'},
+        {"port", required_argument, 0, 'p'},
+        {"qps", required_argument, 0, 'q'},
+        {"duration", required_argument, 0, 'd'},
+        {"names", required_argument, 0, 'n'},
+        {"zipf", required_argument, 0, 'z'},
+        {"blocked-fraction", required_argument, 0, 'b'},
+        {"blocked-file", required_argument, 0, 'B'},
+        {"qtypes", required_argument, 0, 't'},
+        {"suffix", required_argument, 0, 'S'},
+        {"timeout", required_argument, 0, 'T'},
+        {"seed", required_argument, 0, 'r'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:p:q:d:n:z:b:B:t:S:T:r:h", options, 0)) != -1) {
+        switch (opt) {
+        case 's':
+            config.server = optarg;
+            break;
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'q':
+            config.qps = atof(optarg);
+            break;
+        case 'd':
+            config.duration = atof(optarg);
+            break;
+        case 'n':
+            config.names_count = atoi(optarg);
+            break;
+        case 'z':
+            config.zipf_s = atof(optarg);
+            break;
+        case 'b':
+            config.blocked_fraction = atof(optarg);
+            break;
+        case 'B':
+            config.blocked_file = optarg;
+            break;
+        case 't':
+            if (parse_qtypes(optarg)) {
+                fprintf(stderr, "invalid qtype mix: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'S':
+            config.suffix = optarg;
+            break;
+        case 'T':
+            config.timeout_ms = atoi(optarg);
+            break;
+        case 'r':
+            config.seed = strtoull(optarg, 0, 10);
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (config.qps <= 0 || config.duration <= 0 || config.names_count <= 0 ||
+        config.blocked_fraction < 0 || config.blocked_fraction > 1 || config.timeout_ms < 0) {
+        return -1;
+    }
+
+    if (config.qtypes_count == 0) {
+        config.qtypes[0].qtype = 1;
+        config.qtypes[0].weight = 1;
+        config.qtypes_count = 1;
+    }
+
+    if (config.seed == 0) { // xorshift state must not be zero
+        config.seed = 1;
+    }
+
+    return 0;
+}
+
+static int parse_qtypes(const char *spec) {
+    char *copy = strdup(spec);
+    if (!copy) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    double total = 0;
+    config.qtypes_count = 0;
+
+    char *save;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(0, ",", &save)) {
+        if (config.qtypes_count == MAX_QTYPES) {
+            free(copy);
+            return -1;
+        }
+
+        char *colon = strchr(item, ':');
+        double weight = 1;
+        if (colon) {
+            *colon = 0;
+            weight = atof(colon + 1);
+        }
+
+        int qtype = qtype_from_name(item);
+        if (qtype <= 0 || weight <= 0) {
+            free(copy);
+            return -1;
+        }
+
+        config.qtypes[config.qtypes_count].qtype = qtype;
+        config.qtypes[config.qtypes_count].weight = weight;
+        config.qtypes_count++;
+        total += weight;
+    }
+
+    free(copy);
+
+    if (config.qtypes_count == 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < config.qtypes_count; i++) {
+        config.qtypes[i].weight /= total;
+    }
+
+    return 0;
+}
+
+static int qtype_from_name(const char *name) {
+    static const struct {
+        const char *name;
+        int qtype;
+    } known[] = {
+        {"A", 1},
+        {"NS", 2},
+        {"CNAME", 5},
+        {"SOA", 6},
+        {"PTR", 12},
+        {"MX", 15},
+        {"TXT", 16},
+        {"AAAA", 28},
+        {"SRV", 33},
+        {"HTTPS", 65},
+        {"CAA", 257},
+    };
+
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+        if (strcasecmp(known[i].name, name) == 0) {
+            return known[i].qtype;
+        }
+    }
+
+    char *end;
+    long value = strtol(name, &end, 10);
+    if (*end != 0 || value <= 0 || value > 65535) {
+        return -1;
+    }
+
+    return value;
+}
+
+static int load_blocked_names() {
+    if (!config.blocked_file) {
+        static const char *defaults[] = {"youtube.com", "reddit.com"};
+        blocked_names_count = sizeof(defaults) / sizeof(defaults[0]);
+        blocked_names = malloc(sizeof(char *) * blocked_names_count);
+        if (!blocked_names) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+        for (int i = 0; i < blocked_names_count; i++) {
+            blocked_names[i] = strdup(defaults[i]);
+        }
+        return 0;
+    }
+
+    FILE *fp = fopen(config.blocked_file, "r");
+    if (!fp) {
+        fprintf(stderr, "failed to open %s: %s\n", config.blocked_file, strerror(errno));
+        return -1;
+    }
+
+    int capacity = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n# \t")] = 0;
+        if (line[0] == 0) {
+            continue;
+        }
+
+        if (blocked_names_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            blocked_names = realloc(blocked_names, sizeof(char *) * capacity);
+            if (!blocked_names) {
+                fprintf(stderr, "failed to allocate memory\n");
+                exit(-1);
+            }
+        }
+
+        blocked_names[blocked_names_count++] = strdup(line);
+    }
+
+    fclose(fp);
+
+    if (blocked_names_count == 0) {
+        fprintf(stderr, "%s contains no names\n", config.blocked_file);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void build_zipf_cdf() {
+    zipf_cdf = malloc(sizeof(double) * config.names_count);
+    if (!zipf_cdf) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    double sum = 0;
+    for (int i = 0; i < config.names_count; i++) {
+        sum += 1.0 / pow(i + 1, config.zipf_s);
+        zipf_cdf[i] = sum;
+    }
+
+    for (int i = 0; i < config.names_count; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+static int sample_zipf(uint64_t *rng) {
+    double u = bench_rand_unit(rng);
+
+    int low = 0;
+    int high = config.names_count - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static uint16_t sample_qtype(uint64_t *rng) {
+    double u = bench_rand_unit(rng);
+    for (int i = 0; i < config.qtypes_count; i++) {
+        if (u < config.qtypes[i].weight) {
+            return config.qtypes[i].qtype;
+        }
+        u -= config.qtypes[i].weight;
+    }
+
+    return config.qtypes[config.qtypes_count - 1].qtype;
+}
+
+static size_t build_query(char *buffer, uint16_t id, const char *name, uint16_t qtype) {
+    uint16_t header[6];
+    header[0] = htons(id);
+    header[1] = htons(0x0100); // RD
+    header[2] = htons(1);
+    header[3] = 0;
+    header[4] = 0;
+    header[5] = 0;
+    memcpy(buffer, header, sizeof(header));
+
+    size_t offset = sizeof(header);
+    const char *label = name;
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        size_t len = dot ? (size_t)(dot - label) : strlen(label);
+        if (len > 63) {
+            len = 63;
+        }
+
+        buffer[offset++] = len;
+        memcpy(buffer + offset, label, len);
+        offset += len;
+
+        if (!dot) {
+            break;
+        }
+        label = dot + 1;
+    }
+    buffer[offset++] = 0;
+
+    uint16_t tail[2] = {htons(qtype), htons(1)};
+    memcpy(buffer + offset, tail, sizeof(tail));
+    offset += sizeof(tail);
+
+    return offset;
+}
+
+static void drain_responses(int sock_fd, char *buffer) {
+    while (1) {
+        ssize_t len = recv(sock_fd, buffer, MAX_MESSAGE_SIZE, MSG_DONTWAIT);
+        if (len < 0) {
+            return;
+        }
+
+        uint64_t now = bench_now_ns();
+        if (len < 12) {
+            stats.unmatched++;
+            continue;
+        }
+
+        uint16_t id = ((uint8_t)buffer[0] << 8) | (uint8_t)buffer[1];
+        if (!inflight[id].in_use) {
+            stats.unmatched++;
+            continue;
+        }
+
+        inflight[id].in_use = 0;
+        stats.received++;
+        stats.rcodes[buffer[3] & 0x0f]++;
+        hist_add(&latency, (now - inflight[id].sent_at) / 1000);
+    }
+}
+
+static void expire_inflight(uint64_t now) {
+    uint64_t timeout_ns = (uint64_t)config.timeout_ms * 1000000;
+    for (int i = 0; i < ID_SPACE; i++) {
+        if (inflight[i].in_use && now - inflight[i].sent_at > timeout_ns) {
+            inflight[i].in_use = 0;
+            stats.lost++;
+        }
+    }
+}
+
+static void print_report(double elapsed_s) {
+    static const char *rcode_names[16] = {
+        "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+
+    printf("\n");
+    printf("duration:        %.2f s\n", elapsed_s);
+    printf("sent:            %llu (%.0f qps)\n",
+           (unsigned long long)stats.sent,
+           stats.sent / elapsed_s);
+    printf("received:        %llu (%.0f qps)\n",
+           (unsigned long long)stats.received,
+           stats.received / elapsed_s);
+    printf("lost/timed out:  %llu (%.2f%%)\n",
+           (unsigned long long)stats.lost,
+           stats.sent ? stats.lost * 100.0 / stats.sent : 0);
+    printf("send errors:     %llu\n", (unsigned long long)stats.send_errors);
+    printf("unmatched:       %llu\n", (unsigned long long)stats.unmatched);
+
+    printf("rcodes:\n");
+    for (int i = 0; i < 16; i++) {
+        if (stats.rcodes[i] == 0) {
+            continue;
+        }
+        if (rcode_names[i]) {
+            printf("  %-10s %llu\n", rcode_names[i], (unsigned long long)stats.rcodes[i]);
+        } else {
+            printf("  rcode %-4d %llu\n", i, (unsigned long long)stats.rcodes[i]);
+        }
+    }
+
+    if (latency.total == 0) {
+        return;
+    }
+
+    printf("latency (us):    min %llu, mean %.0f, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max "
+           "%llu\n",
+           (unsigned long long)latency.min,
+           latency.sum / latency.total,
+           (unsigned long long)hist_percentile(&latency, 50),
+           (unsigned long long)hist_percentile(&latency, 90),
+           (unsigned long long)hist_percentile(&latency, 99),
+           (unsigned long long)hist_percentile(&latency, 99.9),
+           (unsigned long long)latency.max);
+    printf("latency histogram:\n");
+    hist_print(&latency, "us");
+}
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "bench_util.h"
+
+#define MAX_MESSAGE_SIZE 4096
+#define HEADER_SIZE 12
+
+typedef struct {
+    const char *address;
+    uint16_t port;
+    double delay_ms;
+    double jitter_ms;
+    double loss;
+    int response_size;
+    uint32_t ttl;
+    uint64_t seed;
+} mock_config_t;
+
+typedef struct {
+    uint64_t send_at;
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    size_t len;
+    char *message;
+} delayed_reply_t;
+
+// min-heap on send_at, replies are released as soon as their delay has passed
+typedef struct {
+    delayed_reply_t *items;
+    int size;
+    int capacity;
+} reply_heap_t;
+
+static mock_config_t config;
+static volatile sig_atomic_t is_running = 1;
+
+static uint64_t received;
+static uint64_t dropped;
+static uint64_t answered;
+
+static void usage(const char *prog);
+static int parse_args(int argc, char **argv);
+static void handle_signal(int sig);
+static size_t build_response(const char *query, size_t query_len, char *buffer);
+static void heap_push(reply_heap_t *heap, delayed_reply_t *reply);
+static void heap_pop(reply_heap_t *heap);
+static void send_due(int sock_fd, reply_heap_t *heap, uint64_t now);
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd == -1) {
+        fprintf(stderr, "socket creation failed with: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int bufsize = 8 * 1024 * 1024;
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.address, &addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid listen address: %s\n", config.address);
+        return -1;
+    }
+
+    if (bind(sock_fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "bind failed with: %s\n", strerror(errno));
+        return -1;
+    }
+
+    printf("mock upstream on %s:%d, delay %.2f ms (+/- %.2f), loss %.1f%%, response size %d\n",
+           config.address,
+           config.port,
+           config.delay_ms,
+           config.jitter_ms,
+           config.loss * 100,
+           config.response_size);
+
+    uint64_t rng = config.seed;
+    reply_heap_t heap = {0, 0, 0};
+    char query[MAX_MESSAGE_SIZE];
+    char response[MAX_MESSAGE_SIZE];
+
+    struct pollfd poll_fd;
+    poll_fd.fd = sock_fd;
+    poll_fd.events = POLLIN;
+
+    while (is_running) {
+        uint64_t now = bench_now_ns();
+        int timeout = 100;
+        if (heap.size) {
+            uint64_t due = heap.items[0].send_at;
+            timeout = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+        }
+
+        int ret = poll(&poll_fd, 1, timeout);
+        if (ret < 0 && errno != EINTR) {
+            fprintf(stderr, "poll failed with: %s\n", strerror(errno));
+            break;
+        }
+
+        while (ret > 0 && (poll_fd.revents & POLLIN)) {
+            delayed_reply_t reply;
+            reply.addr_len = sizeof(reply.addr);
+            ssize_t len = recvfrom(sock_fd,
+                                   query,
+                                   sizeof(query),
+                                   MSG_DONTWAIT,
+                                   (struct sockaddr *)&reply.addr,
+                                   &reply.addr_len);
+            if (len < 0) {
+                break;
+            }
+
+            received++;
+            if (len < HEADER_SIZE || bench_rand_unit(&rng) < config.loss) {
+                dropped++;
+                continue;
+            }
+
+            reply.len = build_response(query, len, response);
+            if (reply.len == 0) {
+                dropped++;
+                continue;
+            }
+
+            double delay = config.delay_ms;
+            if (config.jitter_ms > 0) {
+                delay += (bench_rand_unit(&rng) * 2 - 1) * config.jitter_ms;
+            }
+
+            if (delay <= 0) {
+                sendto(sock_fd,
+                       response,
+                       reply.len,
+                       0,
+                       (const struct sockaddr *)&reply.addr,
+                       reply.addr_len);
+                answered++;
+                continue;
+            }
+
+            reply.send_at = bench_now_ns() + (uint64_t)(delay * 1e6);
+            reply.message = malloc(reply.len);
+            if (!reply.message) {
+                fprintf(stderr, "failed to allocate memory\n");
+                exit(-1);
+            }
+            memcpy(reply.message, response, reply.len);
+            heap_push(&heap, &reply);
+        }
+
+        send_due(sock_fd, &heap, bench_now_ns());
+    }
+
+    printf("received %llu, dropped %llu, answered %llu\n",
+           (unsigned long long)received,
+           (unsigned long long)dropped,
+           (unsigned long long)answered);
+
+    for (int i = 0; i < heap.size; i++) {
+        free(heap.items[i].message);
+    }
+    free(heap.items);
+    close(sock_fd);
+
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -a, --address ADDR          listen address (default 127.0.0.1)\n"
+            "  -p, --port PORT             listen port (default 5353)\n"
+            "  -d, --delay MS              answer delay (default 0)\n"
+            "  -j, --jitter MS             uniform jitter added to the delay (default 0)\n"
+            "  -l, --loss F                fraction of queries left unanswered (default 0)\n"
+            "  -s, --response-size BYTES   approximate size of each answer (default 64)\n"
+            "  -T, --ttl SEC               ttl of answer records (default 300)\n"
+            "  -r, --seed N                random seed (default 1)\n",
+            prog);
+}
+
+static int parse_args(int argc, char **argv) {
+    config.address = "127.0.0.1";
+    config.port = 5353;
+    config.delay_ms = 0;
+    config.jitter_ms = 0;
+    config.loss = 0;
+    config.response_size = 64;
+    config.ttl = 300;
+    config.seed = 1;
+
+    static const struct option options[] = {
+        {"address", required_argument, 0, 'a'},
+        {"port", required_argument, 0, 'p'},
+        {"delay", required_argument, 0, 'd'},
+        {"jitter", required_argument, 0, 'j'},
+        {"loss", required_argument, 0, 'l'},
+        {"response-size", required_argument, 0, 's'},
+        {"ttl", required_argument, 0, 'T'},
+        {"seed", required_argument, 0, 'r'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:p:d:j:l:s:T:r:h", options, 0)) != -1) {
+        switch (opt) {
+        case 'a':
+            config.address = optarg;
+            break;
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'd':
+            config.delay_ms = atof(optarg);
+            break;
+        case 'j':
+            config.jitter_ms = atof(optarg);
+            break;
+        case 'l':
+            config.loss = atof(optarg);
+            break;
+        case 's':
+            config.response_size = atoi(optarg);
+            break;
+        case 'T':
+            config.ttl = strtoul(optarg, 0, 10);
+            break;
+        case 'r':
+            config.seed = strtoull(optarg, 0, 10);
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (config.delay_ms < 0 || config.jitter_ms < 0 || config.loss < 0 || config.loss > 1 ||
+        config.response_size < 0 || config.response_size > MAX_MESSAGE_SIZE) {
+        return -1;
+    }
+
+    if (config.seed == 0) {
+        config.seed = 1;
+    }
+
+    return 0;
+}
+
+static void handle_signal(int sig) {
+    (void)sig;
+    is_running = 0;
+}
+
+static void put_u16(char *buffer, size_t offset, uint16_t value) {
+    buffer[offset] = value >> 8;
+    buffer[offset + 1] = value & 0xff;
+}
+
+static void put_u32(char *buffer, size_t offset, uint32_t value) {
+    put_u16(buffer, offset, value >> 16);
+    put_u16(buffer, offset + 2, value & 0xffff);
+}
+
+// Echoes the question and appends records of the asked type (A and AAAA) or one TXT record
+// until the message reaches the configured size. Every answer owner is a pointer to the question.
+static size_t build_response(const char *query, size_t query_len, char *buffer) {
+    size_t offset = HEADER_SIZE;
+    while (offset < query_len && query[offset] != 0) {
+        if ((query[offset] & 0xc0) != 0) {
+            return 0;
+        }
+        offset += (uint8_t)query[offset] + 1;
+    }
+
+    offset += 1 + 4;
+    if (offset > query_len) {
+        return 0;
+    }
+
+    uint16_t qtype = ((uint8_t)query[offset - 4] << 8) | (uint8_t)query[offset - 3];
+
+    memcpy(buffer, query, offset);
+    buffer[2] = (query[2] & 0x79) | 0x80; // QR, keep opcode and RD
+    buffer[3] = 0x80;                     // RA, NOERROR
+    put_u16(buffer, 4, 1);
+    put_u16(buffer, 8, 0);
+    put_u16(buffer, 10, 0);
+
+    size_t rdata_len = qtype == 28 ? 16 : 4;
+    if (qtype != 1 && qtype != 28) {
+        qtype = 16;
+    }
+
+    uint16_t answers = 0;
+    size_t target = config.response_size;
+    do {
+        size_t len = rdata_len;
+        if (qtype == 16) {
+            size_t left = target > offset + 12 ? target - offset - 12 : 1;
+            len = left;
+        }
+
+        if (offset + 12 + len + len / 255 + 1 > MAX_MESSAGE_SIZE) {
+            break;
+        }
+
+        put_u16(buffer, offset, 0xc000 | HEADER_SIZE);
+        put_u16(buffer, offset + 2, qtype);
+        put_u16(buffer, offset + 4, 1);
+        put_u32(buffer, offset + 6, config.ttl);
+        offset += 12;
+
+        size_t rdata_start = offset;
+        if (qtype == 16) {
+            // character strings are at most 255 bytes, each with a length prefix
+            size_t left = len;
+            while (left > 0) {
+                size_t chunk = left > 255 ? 255 : left;
+                buffer[offset++] = chunk;
+                memset(buffer + offset, 'x', chunk);
+                offset += chunk;
+                left -= chunk;
+            }
+        } else {
+            for (size_t i = 0; i < rdata_len; i++) {
+                buffer[offset++] = i == rdata_len - 1 ? answers + 1 : (i == 0 ? 10 : 0);
+            }
+        }
+
+        put_u16(buffer, rdata_start - 2, offset - rdata_start);
+        answers++;
+    } while (qtype != 16 && offset + 12 + rdata_len <= target);
+
+    put_u16(buffer, 6, answers);
+
+    return offset;
+}
+
+static void heap_push(reply_heap_t *heap, delayed_reply_t *reply) {
+    if (heap->size == heap->capacity) {
+        heap->capacity = heap->capacity ? heap->capacity * 2 : 1024;
+        heap->items = realloc(heap->items, sizeof(delayed_reply_t) * heap->capacity);
+        if (!heap->items) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    int i = heap->size++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap->items[parent].send_at <= reply->send_at) {
+            break;
+        }
+        heap->items[i] = heap->items[parent];
+        i = parent;
+    }
+    heap->items[i] = *reply;
+}
+
+static void heap_pop(reply_heap_t *heap) {
+    delayed_reply_t last = heap->items[--heap->size];
+
+    int i = 0;
+    while (1) {
+        int child = i * 2 + 1;
+        if (child >= heap->size) {
+            break;
+        }
+        if (child + 1 < heap->size && heap->items[child + 1].send_at < heap->items[child].send_at) {
+            child++;
+        }
+        if (last.send_at <= heap->items[child].send_at) {
+            break;
+        }
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+
+    if (heap->size) {
+        heap->items[i] = last;
+    }
+}
+
+static void send_due(int sock_fd, reply_heap_t *heap, uint64_t now) {
+    while (heap->size && heap->items[0].send_at <= now) {
+        delayed_reply_t *reply = &heap->items[0];
+        sendto(sock_fd,
+               reply->message,
+               reply->len,
+               0,
+               (const struct sockaddr *)&reply->addr,
+               reply->addr_len);
+        free(reply->message);
+        answered++;
+        heap_pop(heap);
+    }
+}
@@ -0,0 +1,607 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "bench_util.h"
+#include "../src/dns.h"
+#include "../src/blacklist.h"
+#include "../src/records.h"
+#include "../src/lpm.h"
+#include "../src/ipset.h"
+
+// allocation counting through the linker: -Wl,--wrap=malloc,--wrap=calloc,...
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static uint64_t alloc_count;
+
+void *__wrap_malloc(size_t size) {
+    alloc_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    alloc_count++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_count++;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    __real_free(ptr);
+}
+
+#define MESSAGE_SIZE 512
+#define MAX_RESULTS 64
+
+typedef struct {
+    const char *name;
+    char buffer[MESSAGE_SIZE];
+    size_t len;
+    size_t question_offset; // offset of the question the parsing kernels look at
+} packet_t;
+
+typedef struct {
+    char name[96];
+    uint64_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+} result_t;
+
+typedef void (*bench_fn_t)(void *arg);
+
+static double min_time_s = 0.2;
+static const char *filter;
+static result_t results[MAX_RESULTS];
+static int results_count;
+
+static volatile uintptr_t sink;
+
+static void run_bench(const char *name, bench_fn_t fn, void *arg);
+static int write_json(const char *path);
+
+static size_t put_name(char *buffer, size_t offset, const char *name);
+static void build_packet(packet_t *packet, const char *name, const char *qname);
+static void build_compressed_packet(packet_t *packet);
+static void build_blacklist(blacklist_t *blacklist, int len);
+
+static void bench_parse_domain(void *arg) {
+    const packet_t *packet = arg;
+    size_t offset = packet->question_offset;
+    domain_t domain = parse_domain(packet->buffer, &offset);
+    sink += domain.len;
+    free_domain(domain);
+}
+
+static void bench_domain_to_str(void *arg) {
+    const domain_t *domain = arg;
+    char *str = domain_to_str(domain);
+    sink += (uintptr_t)str;
+    free(str);
+}
+
+typedef struct {
+    blacklist_t *blacklist;
+    const domain_t *domain;
+} match_arg_t;
+
+static void bench_is_domain_allowed(void *arg) {
+    const match_arg_t *match = arg;
+    sink += is_domain_allowed(match->blacklist, match->domain);
+}
+
+// cycles through names that are not listed, so the lookup does not stay in cache
+#define SPREAD_NAMES 65536
+
+typedef struct {
+    const trie_t *trie;
+    uint8_t (*names)[DNS_MAX_NAME_LEN];
+    size_t *names_len;
+    uint32_t next;
+} spread_arg_t;
+
+static void bench_trie_match_spread(void *arg) {
+    spread_arg_t *spread = arg;
+    uint32_t i = spread->next++ % SPREAD_NAMES;
+    trie_match_t match;
+    trie_match(spread->trie, spread->names[i], spread->names_len[i], &match);
+    sink += match.blocked;
+}
+
+typedef struct {
+    blacklist_t *blacklist;
+    const packet_t *packet;
+} request_arg_t;
+
+static void bench_request_header(void *arg) {
+    const request_arg_t *request = arg;
+    const dns_header_t *header = (const dns_header_t *)request->packet->buffer;
+    if (DNS_GET_QR(ntohs(header->flags)) == 0) {
+        sink += is_request_allowed(
+            request->blacklist, request->packet->buffer, request->packet->len, 0);
+    }
+}
+
+typedef struct {
+    pattern_set_t *patterns;
+    uint8_t name[DNS_MAX_NAME_LEN];
+    size_t name_len;
+} pattern_arg_t;
+
+static void bench_pattern_set_match(void *arg) {
+    pattern_arg_t *pattern = arg;
+    sink += pattern_set_match(pattern->patterns, pattern->name, pattern->name_len);
+}
+
+typedef struct {
+    const local_records_t *records;
+    uint8_t name[DNS_MAX_NAME_LEN];
+    size_t name_len;
+} local_arg_t;
+
+static void bench_local_records_lookup(void *arg) {
+    const local_arg_t *local = arg;
+    sink += (uintptr_t)local_records_lookup(local->records, local->name, local->name_len, 1);
+}
+
+typedef struct {
+    const lpm_t *lpm;
+    uint32_t *addrs;
+    uint32_t next;
+} lpm_arg_t;
+
+static void bench_lpm_lookup(void *arg) {
+    lpm_arg_t *lookup = arg;
+    sink += lpm_lookup(lookup->lpm, lookup->addrs[lookup->next++ % SPREAD_NAMES]);
+}
+
+typedef struct {
+    const ipset_t *set;
+    uint32_t *addrs; // network order
+    uint32_t next;
+} ipset_arg_t;
+
+static void bench_ipset_contains(void *arg) {
+    ipset_arg_t *lookup = arg;
+    const uint32_t *addr = &lookup->addrs[lookup->next++ % SPREAD_NAMES];
+    sink += ipset_contains(lookup->set, (const uint8_t *)addr, 4);
+}
+
+int main(int argc, char **argv) {
+    const char *json_path = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:t:f:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            json_path = optarg;
+            break;
+        case 't':
+            min_time_s = atof(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-o results.json] [-t min seconds per case] [-f name filter]\n",
+                    argv[0]);
+            return -1;
+        }
+    }
+
+    char long_name[256];
+    snprintf(long_name,
+             sizeof(long_name),
+             "%.63s.%.63s.%.63s.%.61s",
+             "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+             "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb",
+             "ccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc",
+             "ddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddd");
+
+    char many_labels[256] = {0};
+    for (int i = 0; i < 127; i++) {
+        strcat(many_labels, i ? ".a" : "a");
+    }
+
+    static packet_t packets[4];
+    build_packet(&packets[0], "short", "www.Example.com");
+    build_packet(&packets[1], "long", long_name);
+    build_packet(&packets[2], "many_labels", many_labels);
+    build_compressed_packet(&packets[3]);
+    int packets_count = sizeof(packets) / sizeof(packets[0]);
+
+    char name[96];
+    domain_t domains[4];
+    for (int i = 0; i < packets_count; i++) {
+        size_t offset = packets[i].question_offset;
+        domains[i] = parse_domain(packets[i].buffer, &offset);
+    }
+
+    for (int i = 0; i < packets_count; i++) {
+        snprintf(name, sizeof(name), "parse_domain/%s", packets[i].name);
+        run_bench(name, bench_parse_domain, &packets[i]);
+    }
+
+    for (int i = 0; i < packets_count; i++) {
+        snprintf(name, sizeof(name), "domain_to_str/%s", packets[i].name);
+        run_bench(name, bench_domain_to_str, &domains[i]);
+    }
+
+    static const struct {
+        const char *name;
+        int len;
+    } sizes[] = {{"10", 10}, {"10k", 10000}, {"1m", 1000000}};
+
+    // a name in the middle of the list for hits, a name that is not listed for misses
+    packet_t hit_packet;
+    char hit_name[64];
+
+    spread_arg_t spread;
+    spread.names = malloc(sizeof(*spread.names) * SPREAD_NAMES);
+    spread.names_len = malloc(sizeof(size_t) * SPREAD_NAMES);
+    if (!spread.names || !spread.names_len) {
+        fprintf(stderr, "failed to allocate memory\n");
+        return -1;
+    }
+    for (int i = 0; i < SPREAD_NAMES; i++) {
+        char spread_name[64];
+        snprintf(spread_name, sizeof(spread_name), "unlisted%d.example.com", i * 7919);
+        dns_name_from_str(spread_name, spread.names[i], &spread.names_len[i]);
+    }
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        blacklist_t blacklist;
+        build_blacklist(&blacklist, sizes[i].len);
+
+        snprintf(hit_name, sizeof(hit_name), "blocked%d.example.com", sizes[i].len / 2);
+        build_packet(&hit_packet, "hit", hit_name);
+        size_t offset = hit_packet.question_offset;
+        domain_t hit_domain = parse_domain(hit_packet.buffer, &offset);
+
+        match_arg_t match = {&blacklist, &domains[0]};
+        snprintf(name, sizeof(name), "is_domain_allowed/%s/miss", sizes[i].name);
+        run_bench(name, bench_is_domain_allowed, &match);
+
+        match.domain = &hit_domain;
+        snprintf(name, sizeof(name), "is_domain_allowed/%s/hit", sizes[i].name);
+        run_bench(name, bench_is_domain_allowed, &match);
+
+        spread.trie = &blacklist.trie;
+        spread.next = 0;
+        snprintf(name, sizeof(name), "trie_match/%s/miss_spread", sizes[i].name);
+        run_bench(name, bench_trie_match_spread, &spread);
+
+        for (int j = 0; j < packets_count; j++) {
+            request_arg_t request = {&blacklist, &packets[j]};
+            snprintf(name,
+                     sizeof(name),
+                     "process_request/%s/%s",
+                     sizes[i].name,
+                     packets[j].name);
+            run_bench(name, bench_request_header, &request);
+        }
+
+        free_domain(hit_domain);
+        blacklist_free(&blacklist);
+    }
+
+    free(spread.names);
+    free(spread.names_len);
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        snprintf(name, sizeof(name), "local_records_lookup/%s/", sizes[i].name);
+        if (filter && !strstr(name, filter)) {
+            continue;
+        }
+
+        local_records_t records;
+        local_records_init(&records);
+        for (int j = 0; j < sizes[i].len; j++) {
+            snprintf(hit_name, sizeof(hit_name), "host%d.corp.internal", j);
+            local_records_add(&records, hit_name, "A", "10.0.0.1", 60);
+        }
+        local_records_compile(&records);
+
+        local_arg_t local;
+        local.records = &records;
+
+        snprintf(hit_name, sizeof(hit_name), "host%d.corp.internal", sizes[i].len / 2);
+        dns_name_from_str(hit_name, local.name, &local.name_len);
+        snprintf(name, sizeof(name), "local_records_lookup/%s/hit", sizes[i].name);
+        run_bench(name, bench_local_records_lookup, &local);
+
+        dns_name_from_str("www.example.com", local.name, &local.name_len);
+        snprintf(name, sizeof(name), "local_records_lookup/%s/miss", sizes[i].name);
+        run_bench(name, bench_local_records_lookup, &local);
+
+        local_records_free(&records);
+    }
+
+    // client prefixes of every length from /16 to /32, four nested in each /16, looked up with
+    // addresses spread over the same /16s
+    static const struct {
+        const char *name;
+        int len;
+    } lpm_sizes[] = {{"10", 10}, {"1k", 1000}, {"10k", 10000}};
+
+    for (size_t i = 0; i < sizeof(lpm_sizes) / sizeof(lpm_sizes[0]); i++) {
+        snprintf(name, sizeof(name), "lpm_lookup/%s/spread", lpm_sizes[i].name);
+        if (filter && !strstr(name, filter)) {
+            continue;
+        }
+
+        lpm_t lpm;
+        lpm_init(&lpm);
+        uint32_t seed = 1;
+        for (int j = 0; j < lpm_sizes[i].len; j++) {
+            seed = seed * 1103515245 + 12345;
+            uint32_t addr = (uint32_t)(j / 4) << 16 | (seed >> 8 & 0xffff);
+            snprintf(hit_name,
+                     sizeof(hit_name),
+                     "%u.%u.%u.%u/%d",
+                     addr >> 24,
+                     (addr >> 16) & 0xff,
+                     (addr >> 8) & 0xff,
+                     addr & 0xff,
+                     16 + j % 17);
+            lpm_add(&lpm, hit_name, j);
+        }
+        lpm_compile(&lpm);
+
+        lpm_arg_t lookup = {&lpm, malloc(sizeof(uint32_t) * SPREAD_NAMES), 0};
+        if (!lookup.addrs) {
+            fprintf(stderr, "failed to allocate memory\n");
+            return -1;
+        }
+        for (int j = 0; j < SPREAD_NAMES; j++) {
+            seed = seed * 1103515245 + 12345;
+            uint32_t top = (seed >> 8) % ((lpm_sizes[i].len + 3) / 4);
+            seed = seed * 1103515245 + 12345;
+            lookup.addrs[j] = top << 16 | (seed >> 8 & 0xffff);
+        }
+
+        run_bench(name, bench_lpm_lookup, &lookup);
+
+        free(lookup.addrs);
+        lpm_free(&lpm);
+    }
+
+    // blocked answer addresses, single addresses and /24s, with mostly unlisted addresses
+    snprintf(name, sizeof(name), "ipset_contains/10k/spread");
+    if (!filter || strstr(name, filter)) {
+        ipset_t set;
+        ipset_init(&set);
+        uint32_t seed = 1;
+        for (int j = 0; j < 10000; j++) {
+            seed = seed * 1103515245 + 12345;
+            snprintf(hit_name,
+                     sizeof(hit_name),
+                     "%u.%u.%u.%u/%d",
+                     seed >> 24,
+                     (seed >> 16) & 0xff,
+                     (seed >> 8) & 0xff,
+                     seed & 0xff,
+                     j % 4 ? 32 : 24);
+            ipset_add(&set, hit_name);
+        }
+        ipset_compile(&set);
+
+        ipset_arg_t lookup = {&set, malloc(sizeof(uint32_t) * SPREAD_NAMES), 0};
+        if (!lookup.addrs) {
+            fprintf(stderr, "failed to allocate memory\n");
+            return -1;
+        }
+        for (int j = 0; j < SPREAD_NAMES; j++) {
+            seed = seed * 1103515245 + 12345;
+            lookup.addrs[j] = seed;
+        }
+
+        run_bench(name, bench_ipset_contains, &lookup);
+
+        free(lookup.addrs);
+        ipset_free(&set);
+    }
+
+    // half wildcards, half regular expressions, 10k of them no longer fit a full dfa
+    static const struct {
+        const char *name;
+        int len;
+    } pattern_sizes[] = {{"10", 10}, {"100", 100}, {"10k", 10000}};
+
+    for (size_t i = 0; i < sizeof(pattern_sizes) / sizeof(pattern_sizes[0]); i++) {
+        snprintf(name, sizeof(name), "pattern_set_match/%s/", pattern_sizes[i].name);
+        if (filter && !strstr(name, filter)) {
+            continue;
+        }
+
+        pattern_arg_t pattern;
+        pattern_set_t patterns;
+        pattern_set_init(&patterns);
+        for (int j = 0; j < pattern_sizes[i].len; j++) {
+            snprintf(hit_name, sizeof(hit_name), "ads%d*.example.com", j);
+            pattern_set_add_glob(&patterns, hit_name);
+            snprintf(hit_name, sizeof(hit_name), "^track%d[0-9]+\\.", j);
+            pattern_set_add_regex(&patterns, hit_name);
+        }
+        pattern_set_compile(&patterns);
+        pattern.patterns = &patterns;
+
+        snprintf(hit_name, sizeof(hit_name), "track%d7.example.net", pattern_sizes[i].len / 2);
+        dns_name_from_str(hit_name, pattern.name, &pattern.name_len);
+        snprintf(name, sizeof(name), "pattern_set_match/%s/hit", pattern_sizes[i].name);
+        run_bench(name, bench_pattern_set_match, &pattern);
+
+        dns_name_from_str("www.example.com", pattern.name, &pattern.name_len);
+        snprintf(name, sizeof(name), "pattern_set_match/%s/miss", pattern_sizes[i].name);
+        run_bench(name, bench_pattern_set_match, &pattern);
+
+        pattern_set_free(&patterns);
+    }
+
+    for (int i = 0; i < packets_count; i++) {
+        free_domain(domains[i]);
+    }
+
+    if (json_path && write_json(json_path)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void run_bench(const char *name, bench_fn_t fn, void *arg) {
+    if (filter && !strstr(name, filter)) {
+        return;
+    }
+
+    if (results_count == MAX_RESULTS) {
+        fprintf(stderr, "too many benchmark cases\n");
+        exit(-1);
+    }
+
+    // grow the batch until one batch takes long enough to time reliably
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+    uint64_t allocs = 0;
+    uint64_t min_time_ns = (uint64_t)(min_time_s * 1e9);
+
+    while (1) {
+        uint64_t allocs_before = alloc_count;
+        uint64_t start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            fn(arg);
+        }
+        elapsed = bench_now_ns() - start;
+        allocs = alloc_count - allocs_before;
+
+        if (elapsed >= min_time_ns || iterations >= (1ull << 40)) {
+            break;
+        }
+
+        uint64_t next = elapsed ? iterations * min_time_ns * 12 / 10 / elapsed : iterations * 100;
+        if (next <= iterations) {
+            next = iterations * 2;
+        }
+        if (next > iterations * 100) {
+            next = iterations * 100;
+        }
+        iterations = next;
+    }
+
+    result_t *result = &results[results_count++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->iterations = iterations;
+    result->ns_per_op = (double)elapsed / iterations;
+    result->allocs_per_op = (double)allocs / iterations;
+
+    printf("%-40s %12llu iters %14.1f ns/op %8.2f allocs/op\n",
+           result->name,
+           (unsigned long long)result->iterations,
+           result->ns_per_op,
+           result->allocs_per_op);
+}
+
+static int write_json(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "{\n  \"benchmarks\": [\n");
+    for (int i = 0; i < results_count; i++) {
+        fprintf(fp,
+                "    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, "
+                "\"allocs_per_op\": %.2f}%s\n",
+                results[i].name,
+                (unsigned long long)results[i].iterations,
+                results[i].ns_per_op,
+                results[i].allocs_per_op,
+                i + 1 < results_count ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+
+    fclose(fp);
+    printf("results written to %s\n", path);
+
+    return 0;
+}
+
+static size_t put_name(char *buffer, size_t offset, const char *name) {
+    const char *label = name;
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        size_t len = dot ? (size_t)(dot - label) : strlen(label);
+
+        buffer[offset++] = len;
+        memcpy(buffer + offset, label, len);
+        offset += len;
+
+        if (!dot) {
+            break;
+        }
+        label = dot + 1;
+    }
+    buffer[offset++] = 0;
+
+    return offset;
+}
+
+static void build_packet(packet_t *packet, const char *name, const char *qname) {
+    memset(packet, 0, sizeof(*packet));
+    packet->name = name;
+
+    dns_header_t *header = (dns_header_t *)packet->buffer;
+    header->id = htons(0x1234);
+    header->flags = htons(0x0100);
+    header->qd_count = htons(1);
+
+    packet->question_offset = sizeof(dns_header_t);
+    size_t offset = put_name(packet->buffer, packet->question_offset, qname);
+    uint16_t tail[2] = {htons(1), htons(1)};
+    memcpy(packet->buffer + offset, tail, sizeof(tail));
+    packet->len = offset + sizeof(tail);
+}
+
+// two questions, the second one ("mail.example.com") ends in a pointer into the first
+static void build_compressed_packet(packet_t *packet) {
+    build_packet(packet, "compressed", "www.example.com");
+
+    dns_header_t *header = (dns_header_t *)packet->buffer;
+    header->qd_count = htons(2);
+
+    size_t offset = packet->len;
+    packet->question_offset = offset;
+
+    packet->buffer[offset++] = 4;
+    memcpy(packet->buffer + offset, "mail", 4);
+    offset += 4;
+
+    uint16_t pointer = htons(0xc000 | (sizeof(dns_header_t) + 4));
+    memcpy(packet->buffer + offset, &pointer, sizeof(pointer));
+    offset += sizeof(pointer);
+
+    uint16_t tail[2] = {htons(1), htons(1)};
+    memcpy(packet->buffer + offset, tail, sizeof(tail));
+    packet->len = offset + sizeof(tail);
+}
+
+static void build_blacklist(blacklist_t *blacklist, int len) {
+    blacklist_init(blacklist);
+
+    char name[64];
+    for (int i = 0; i < len; i++) {
+        snprintf(name, sizeof(name), "blocked%d.example.com", i);
+        blacklist_add(blacklist, name);
+    }
+
+    blacklist_compile(blacklist);
+}
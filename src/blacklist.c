@@ -0,0 +1,140 @@
+#include "blacklist.h"
+
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+void blacklist_init(blacklist_t *blacklist) {
+    trie_init(&blacklist->trie);
+    pattern_set_init(&blacklist->patterns);
+}
+
+void blacklist_free(blacklist_t *blacklist) {
+    trie_free(&blacklist->trie);
+    pattern_set_free(&blacklist->patterns);
+}
+
+int blacklist_add(blacklist_t *blacklist, const char *domain) {
+    size_t len = strlen(domain);
+    if (len >= 2 && domain[0] == '/' && domain[len - 1] == '/') {
+        char *regex = strndup(domain + 1, len - 2);
+        if (!regex) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+
+        int ret = pattern_set_add_regex(&blacklist->patterns, regex);
+        free(regex);
+        return ret;
+    }
+
+    const char *rest = (domain[0] == '*' && domain[1] == '.') ? domain + 2 : domain;
+    if (strpbrk(rest, "*?")) {
+        return pattern_set_add_glob(&blacklist->patterns, domain);
+    }
+
+    return trie_add(&blacklist->trie, domain, TRIE_BLOCK, TRIE_NO_FORWARD);
+}
+
+int blacklist_compile(blacklist_t *blacklist) {
+    if (trie_compile(&blacklist->trie) || pattern_set_compile(&blacklist->patterns)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int blacklist_load_file(blacklist_t *blacklist, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[1024];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_number++;
+        line[strcspn(line, "#\r\n")] = 0;
+
+        char *save;
+        char *field = strtok_r(line, " \t", &save);
+        if (!field) {
+            continue;
+        }
+
+        uint8_t address[16];
+        char *domain = field;
+        if (inet_pton(AF_INET, field, address) == 1 || inet_pton(AF_INET6, field, address) == 1) {
+            domain = strtok_r(0, " \t", &save);
+        }
+
+        for (; domain; domain = strtok_r(0, " \t", &save)) {
+            if (blacklist_add(blacklist, domain)) {
+                fprintf(stderr, "%s:%d: invalid entry %s\n", path, line_number, domain);
+            }
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+char blacklist_match(blacklist_t *blacklist, const uint8_t *name, size_t name_len) {
+    trie_match_t match;
+    trie_match(&blacklist->trie, name, name_len, &match);
+
+    return match.blocked || pattern_set_match(&blacklist->patterns, name, name_len);
+}
+
+char is_domain_allowed(blacklist_t *blacklist, const domain_t *domain) {
+    uint8_t name[DNS_MAX_NAME_LEN];
+    size_t name_len = 0;
+
+    for (int i = 0; i < domain->len; i++) {
+        size_t label_len = strlen(domain->labels[i]);
+        if (label_len == 0 || label_len > 63 || name_len + label_len + 2 > DNS_MAX_NAME_LEN) {
+            return 1;
+        }
+
+        name[name_len++] = label_len;
+        for (size_t j = 0; j < label_len; j++) {
+            name[name_len++] = tolower((unsigned char)domain->labels[i][j]);
+        }
+    }
+    name[name_len++] = 0;
+
+    return !blacklist_match(blacklist, name, name_len);
+}
+
+char is_request_allowed(blacklist_t *blacklist, const char *buffer, size_t len, int *forward) {
+    const dns_header_t *header = (const dns_header_t *)buffer;
+    size_t offset = sizeof(dns_header_t);
+
+    if (forward) {
+        *forward = TRIE_NO_FORWARD;
+    }
+
+    for (int i = 0; i < ntohs(header->qd_count); i++) {
+        uint8_t name[DNS_MAX_NAME_LEN];
+        size_t name_len;
+        if (dns_read_name(buffer, len, &offset, name, &name_len)) {
+            return 1;
+        }
+        offset += 4; // qtype and qclass
+
+        trie_match_t match;
+        trie_match(&blacklist->trie, name, name_len, &match);
+        if (match.blocked || pattern_set_match(&blacklist->patterns, name, name_len)) {
+            return 0;
+        }
+
+        if (i == 0 && forward) {
+            *forward = match.forward;
+        }
+    }
+
+    return 1;
+}
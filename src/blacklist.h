@@ -0,0 +1,29 @@
+#ifndef DNSPROXY_BLACKLIST_H
+#define DNSPROXY_BLACKLIST_H
+
+#include "dns.h"
+#include "trie.h"
+#include "pattern.h"
+
+typedef struct {
+    trie_t trie;            // exact names, the names below them and forward zones
+    pattern_set_t patterns; // wildcard and regex entries
+} blacklist_t;
+
+void blacklist_init(blacklist_t *blacklist);
+void blacklist_free(blacklist_t *blacklist);
+
+// blocks domain and every name below it, "*.domain" blocks only the names below it. other
+// entries with * or ? are wildcards and entries between slashes are regular expressions
+int blacklist_add(blacklist_t *blacklist, const char *domain);
+// one domain per line, hosts style lines ("0.0.0.0 domain ...") are accepted too
+int blacklist_load_file(blacklist_t *blacklist, const char *path);
+int blacklist_compile(blacklist_t *blacklist);
+
+// name is lowercase wire format, not const as the pattern dfa may cache states it builds
+char blacklist_match(blacklist_t *blacklist, const uint8_t *name, size_t name_len);
+char is_domain_allowed(blacklist_t *blacklist, const domain_t *domain);
+// checks every question, forward is set to the forward zone of the first one if not null
+char is_request_allowed(blacklist_t *blacklist, const char *buffer, size_t len, int *forward);
+
+#endif
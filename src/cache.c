@@ -0,0 +1,927 @@
+#include "cache.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_FILE_MAGIC "DNSPCACH"
+#define CACHE_FILE_VERSION 2
+#define CACHE_MIN_CHUNK 64
+#define CACHE_FREE CACHE_REGIONS // region of the chunks on a free list
+#define CACHE_COLDER 4           // a page moves to a class this many times more hit per page
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} cache_file_header_t;
+
+typedef struct {
+    uint64_t stored_at;
+    uint64_t expires_at;
+    uint16_t key_len;
+    uint16_t message_len;
+    uint8_t region;
+} __attribute__((packed)) cache_file_record_t;
+
+static cache_entry_t *insert_entry(cache_t *cache,
+                                   const uint8_t *key,
+                                   size_t key_len,
+                                   const char *message,
+                                   size_t len,
+                                   uint64_t stored_at,
+                                   uint64_t expires_at);
+static void init_entry(cache_entry_t *entry,
+                       cache_entry_t **slot,
+                       uint64_t hash,
+                       const uint8_t *key,
+                       size_t key_len,
+                       const char *message,
+                       size_t len,
+                       uint64_t stored_at,
+                       uint64_t expires_at);
+static cache_class_t *class_for(cache_t *cache, size_t size);
+static cache_entry_t *alloc_chunk(cache_t *cache, cache_class_t *slab_class);
+static void carve_page(cache_t *cache, cache_class_t *slab_class, char *page);
+static cache_class_t *colder_class(cache_t *cache, const cache_class_t *slab_class);
+static char *release_page(cache_t *cache, cache_class_t *slab_class);
+static int region_max(const cache_class_t *slab_class, int region);
+static char has_room(const cache_class_t *slab_class, int region);
+static void admit(cache_t *cache, cache_class_t *slab_class);
+static void evict_one(cache_t *cache, cache_class_t *slab_class);
+static void touch_entry(cache_t *cache, cache_entry_t *entry);
+static void move_entry(cache_t *cache, cache_entry_t *entry, int region);
+static void sketch_add(cache_t *cache, uint64_t hash);
+static int sketch_estimate(const cache_t *cache, uint64_t hash);
+static cache_entry_t **find_slot(cache_t *cache,
+                                 uint64_t hash,
+                                 const uint8_t *key,
+                                 size_t key_len);
+static void remove_entry(cache_t *cache, cache_entry_t *entry);
+static void decay_hits(cache_entry_t *entry, uint64_t now);
+static void lru_unlink(cache_t *cache, cache_entry_t *entry);
+static void lru_push_front(cache_t *cache, cache_entry_t *entry, int region);
+static void lru_push_back(cache_t *cache, cache_entry_t *entry, int region);
+static int sync_dir(const char *path);
+
+int cache_init(cache_t *cache, const cache_config_t *config) {
+    memset(cache, 0, sizeof(*cache));
+    cache->expected_size = config->expected_size;
+    cache->max_stale = (uint64_t)config->max_stale * 1000;
+    cache->prefetch_hits = config->prefetch_hits;
+    cache->max_message_len = config->max_message_len < CACHE_MAX_MESSAGE_LEN
+                                 ? config->max_message_len
+                                 : CACHE_MAX_MESSAGE_LEN;
+
+    // every class is a quarter larger than the one before, so a chunk wastes at most a fifth
+    size_t max_chunk =
+        (sizeof(cache_entry_t) + CACHE_MAX_KEY_LEN + cache->max_message_len + 7) & ~7;
+    size_t chunk_size = CACHE_MIN_CHUNK;
+    while (cache->classes_count < CACHE_MAX_CLASSES) {
+        chunk_size = (chunk_size + 7) & ~7;
+        if (chunk_size > max_chunk || cache->classes_count == CACHE_MAX_CLASSES - 1) {
+            chunk_size = max_chunk;
+        }
+
+        cache->classes[cache->classes_count++].chunk_size = chunk_size;
+        if (chunk_size == max_chunk) {
+            break;
+        }
+        chunk_size += chunk_size / 4;
+    }
+
+    // the whole budget is mapped and touched up front, so the cache never grows the rss
+    cache->arena_size = config->memory / CACHE_SLAB_PAGE * CACHE_SLAB_PAGE;
+    if (hugepage_enabled() && cache->arena_size >= HUGEPAGE_SIZE) {
+        cache->arena_size = cache->arena_size / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+    }
+
+    if (config->expected_size > 0 && cache->arena_size) {
+        cache->arena_mapped = cache->arena_size;
+        // the snapshot child reads the arena as of the fork
+        cache->arena = hugepage_alloc(&cache->arena_mapped, 1, &cache->arena_backing);
+        if (!cache->arena) {
+            fprintf(stderr, "failed to map cache memory: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    size_t width = 16;
+    while (width < (size_t)config->sketch_width) {
+        width *= 2;
+    }
+
+    cache->sketch = calloc(width * CACHE_SKETCH_ROWS, 1);
+    if (!cache->sketch) {
+        fprintf(stderr, "failed to allocate memory\n");
+        return -1;
+    }
+
+    cache->sketch_mask = width - 1;
+    cache->sketch_sample = width * 10;
+
+    size_t buckets = 16;
+    while (buckets < (size_t)config->expected_size * 2) {
+        buckets *= 2;
+    }
+
+    cache->buckets = calloc(buckets, sizeof(cache_entry_t *));
+    if (!cache->buckets) {
+        fprintf(stderr, "failed to allocate memory\n");
+        return -1;
+    }
+
+    cache->buckets_mask = buckets - 1;
+
+    return 0;
+}
+
+void cache_free(cache_t *cache) {
+    hugepage_free(cache->arena, cache->arena_mapped);
+
+    free(cache->buckets);
+    free(cache->sketch);
+    memset(cache, 0, sizeof(*cache));
+}
+
+int cache_key_from_message(const char *buffer, size_t len, uint8_t *key, size_t *key_len) {
+    if (len < sizeof(dns_header_t)) {
+        return -1;
+    }
+
+    const dns_header_t *header = (const dns_header_t *)buffer;
+    if (ntohs(header->qd_count) != 1) {
+        return -1;
+    }
+
+    size_t offset = sizeof(dns_header_t);
+    size_t name_len;
+    if (dns_read_name(buffer, len, &offset, key, &name_len) || offset + 4 > len) {
+        return -1;
+    }
+
+    memcpy(key + name_len, buffer + offset, 4);
+    *key_len = name_len + 4;
+
+    return 0;
+}
+
+cache_entry_t *cache_lookup(cache_t *cache, const uint8_t *key, size_t key_len, uint64_t now) {
+    uint64_t hash = hash_bytes(key, key_len, 0);
+    sketch_add(cache, hash);
+
+    cache_entry_t **slot = find_slot(cache, hash, key, key_len);
+    cache_entry_t *entry = *slot;
+    if (!entry) {
+        return 0;
+    }
+
+    if (entry->expires_at + cache->max_stale <= now) {
+        remove_entry(cache, entry);
+        return 0;
+    }
+
+    decay_hits(entry, now);
+    if (entry->hits < UINT32_MAX) {
+        entry->hits++;
+    }
+    cache->classes[entry->slab_class].hits++;
+
+    touch_entry(cache, entry);
+
+    return entry;
+}
+
+void cache_store(cache_t *cache,
+                 const uint8_t *key,
+                 size_t key_len,
+                 const char *message,
+                 size_t len,
+                 uint64_t now) {
+    uint32_t ttl;
+    if (cache->expected_size <= 0 || cache_message_ttl(message, len, &ttl)) {
+        return;
+    }
+
+    insert_entry(cache, key, key_len, message, len, now, now + (uint64_t)ttl * 1000);
+}
+
+cache_entry_t *cache_insert(cache_t *cache,
+                            const uint8_t *key,
+                            size_t key_len,
+                            const char *message,
+                            size_t len,
+                            uint64_t stored_at,
+                            uint64_t expires_at) {
+    if (cache->expected_size <= 0) {
+        return 0;
+    }
+
+    return insert_entry(cache, key, key_len, message, len, stored_at, expires_at);
+}
+
+int cache_message_ttl(const char *message, size_t len, uint32_t *ttl) {
+    if (len < sizeof(dns_header_t)) {
+        return -1;
+    }
+
+    const dns_header_t *header = (const dns_header_t *)message;
+    uint16_t flags = ntohs(header->flags);
+    uint8_t rcode = DNS_GET_RCODE(flags);
+    if (!DNS_GET_QR(flags) || DNS_GET_TC(flags) ||
+        (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN)) {
+        return -1;
+    }
+
+    size_t offset = sizeof(dns_header_t);
+    for (int i = 0; i < ntohs(header->qd_count); i++) {
+        if (dns_skip_question(message, len, &offset)) {
+            return -1;
+        }
+    }
+
+    int an_count = ntohs(header->an_count);
+    int ns_count = ntohs(header->ns_count);
+    char negative = rcode == DNS_RCODE_NXDOMAIN || an_count == 0;
+    uint32_t min_ttl = CACHE_MAX_TTL;
+    char found = 0;
+
+    for (int i = 0; i < an_count + ns_count; i++) {
+        dns_rr_t rr;
+        if (dns_next_rr(message, len, &offset, &rr)) {
+            return -1;
+        }
+
+        if (!negative && i < an_count) {
+            if (rr.ttl < min_ttl) {
+                min_ttl = rr.ttl;
+            }
+            found = 1;
+        } else if (negative && i >= an_count && rr.type == DNS_TYPE_SOA) {
+            size_t rdata = rr.rdata_offset;
+            if (dns_skip_name(message, len, &rdata) || dns_skip_name(message, len, &rdata) ||
+                rdata + 20 > rr.rdata_offset + rr.rdlength) {
+                return -1;
+            }
+
+            uint32_t minimum = dns_read_u32(message, rdata + 16);
+            uint32_t soa_ttl = rr.ttl < minimum ? rr.ttl : minimum;
+            if (soa_ttl < min_ttl) {
+                min_ttl = soa_ttl;
+            }
+            found = 1;
+        }
+    }
+
+    if (!found || min_ttl == 0) {
+        return -1;
+    }
+
+    *ttl = min_ttl;
+
+    return 0;
+}
+
+char cache_claim_refresh(cache_entry_t *entry, uint64_t now, uint64_t timeout) {
+    if (entry->refresh_until > now) {
+        return 0;
+    }
+
+    entry->refresh_until = now + timeout;
+
+    return 1;
+}
+
+char cache_claim_prefetch(const cache_t *cache,
+                          cache_entry_t *entry,
+                          uint64_t now,
+                          uint64_t timeout) {
+    if (!cache->prefetch_hits || entry->hits < cache->prefetch_hits ||
+        entry->expires_at > now + (entry->expires_at - entry->stored_at) / 10) {
+        return 0;
+    }
+
+    return cache_claim_refresh(entry, now, timeout);
+}
+
+size_t cache_build_response(const cache_entry_t *entry,
+                            const char *query,
+                            size_t query_len,
+                            char *buffer,
+                            uint64_t now) {
+    const char *message = entry->data + entry->key_len;
+    size_t len = entry->message_len;
+    memcpy(buffer, message, len);
+
+    // the id and the exact spelling of the question (0x20 randomization) belong to the client
+    memcpy(buffer, query, sizeof(uint16_t));
+
+    size_t query_offset = sizeof(dns_header_t);
+    size_t offset = sizeof(dns_header_t);
+    if (dns_skip_question(query, query_len, &query_offset) == 0 &&
+        dns_skip_question(buffer, len, &offset) == 0 && query_offset == offset) {
+        memcpy(buffer + sizeof(dns_header_t),
+               query + sizeof(dns_header_t),
+               offset - sizeof(dns_header_t));
+    }
+
+    uint32_t age = (now - entry->stored_at) / 1000;
+    char stale = entry->expires_at <= now;
+    const dns_header_t *header = (const dns_header_t *)buffer;
+    int rr_count = ntohs(header->an_count) + ntohs(header->ns_count) + ntohs(header->ar_count);
+
+    for (int i = 0; i < rr_count; i++) {
+        dns_rr_t rr;
+        if (dns_next_rr(buffer, len, &offset, &rr)) {
+            break;
+        }
+
+        if (rr.type == DNS_TYPE_OPT) {
+            continue;
+        }
+
+        uint32_t ttl = rr.ttl > age ? rr.ttl - age : 0;
+        dns_write_u32(buffer, rr.ttl_offset, stale ? CACHE_STALE_TTL : ttl);
+    }
+
+    return len;
+}
+
+int cache_save(const cache_t *cache, const char *path, uint64_t now) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        fprintf(stderr, "failed to open %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    cache_file_header_t header;
+    memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_FILE_VERSION;
+    header.count = 0;
+    fwrite(&header, sizeof(header), 1, fp);
+
+    // most recently used first, loading appends and drops the tail if the cache shrank
+    for (int i = 0; i < cache->classes_count; i++) {
+        for (int region = 0; region < CACHE_REGIONS; region++) {
+            const cache_entry_t *entry = cache->classes[i].lru[region].head;
+            for (; entry; entry = entry->lru_next) {
+                if (entry->expires_at + cache->max_stale <= now) {
+                    continue;
+                }
+
+                cache_file_record_t record;
+                record.stored_at = entry->stored_at;
+                record.expires_at = entry->expires_at;
+                record.key_len = entry->key_len;
+                record.message_len = entry->message_len;
+                record.region = region;
+                fwrite(&record, sizeof(record), 1, fp);
+                fwrite(entry->data, 1, entry->key_len + entry->message_len, fp);
+                header.count++;
+            }
+        }
+    }
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+
+    // the data is on disk before the rename makes it the snapshot, so a crash leaves either
+    // snapshot whole
+    if (fflush(fp) | ferror(fp) | fsync(fileno(fp)) | fclose(fp)) {
+        fprintf(stderr, "failed to write %s\n", tmp_path);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if (rename(tmp_path, path)) {
+        fprintf(stderr, "failed to rename %s: %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return sync_dir(path);
+}
+
+int cache_load(cache_t *cache, const char *path, uint64_t now) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(cache_file_header_t)) {
+        fprintf(stderr, "cache file %s is truncated\n", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    const char *data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "failed to map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    cache_file_header_t header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CACHE_FILE_VERSION) {
+        fprintf(stderr, "%s is not a cache file\n", path);
+        munmap((void *)data, size);
+        return -1;
+    }
+
+    size_t offset = sizeof(header);
+    int loaded = 0;
+    for (uint32_t i = 0; i < header.count; i++) {
+        cache_file_record_t record;
+        if (offset + sizeof(record) > size) {
+            break;
+        }
+
+        memcpy(&record, data + offset, sizeof(record));
+        offset += sizeof(record);
+
+        if (record.key_len > CACHE_MAX_KEY_LEN || record.message_len > CACHE_MAX_MESSAGE_LEN ||
+            record.region >= CACHE_REGIONS ||
+            offset + record.key_len + record.message_len > size) {
+            break;
+        }
+
+        const uint8_t *key = (const uint8_t *)data + offset;
+        const char *message = data + offset + record.key_len;
+        offset += record.key_len + record.message_len;
+
+        // a file written with a larger limit may hold answers the buffers here cannot take
+        if (record.message_len > cache->max_message_len ||
+            record.expires_at + cache->max_stale <= now) {
+            continue;
+        }
+
+        uint64_t hash = hash_bytes(key, record.key_len, 0);
+        cache_entry_t **slot = find_slot(cache, hash, key, record.key_len);
+        cache_class_t *slab_class =
+            class_for(cache, sizeof(cache_entry_t) + record.key_len + record.message_len);
+        cache_entry_t *entry = *slot ? 0 : alloc_chunk(cache, slab_class);
+        if (!entry) {
+            continue;
+        }
+
+        init_entry(entry,
+                   slot,
+                   hash,
+                   key,
+                   record.key_len,
+                   message,
+                   record.message_len,
+                   record.stored_at,
+                   record.expires_at);
+        cache->size++;
+
+        int region = has_room(slab_class, record.region) ? record.region : CACHE_PROBATION;
+        lru_push_back(cache, entry, region);
+        loaded++;
+    }
+
+    munmap((void *)data, size);
+
+    printf("loaded %d cache entries from %s\n", loaded, path);
+
+    return 0;
+}
+
+// returns the entry, or 0 if there was no room for it or the window turned it away
+static cache_entry_t *insert_entry(cache_t *cache,
+                                   const uint8_t *key,
+                                   size_t key_len,
+                                   const char *message,
+                                   size_t len,
+                                   uint64_t stored_at,
+                                   uint64_t expires_at) {
+    if (len > cache->max_message_len || key_len > CACHE_MAX_KEY_LEN) {
+        return 0;
+    }
+
+    uint64_t hash = hash_bytes(key, key_len, 0);
+    cache_entry_t **slot = find_slot(cache, hash, key, key_len);
+
+    // a refreshed entry keeps its place and stays as popular as it was
+    int region = CACHE_WINDOW;
+    uint32_t hits = 0;
+    uint64_t hits_at = stored_at;
+    if (*slot) {
+        cache_entry_t *old = *slot;
+        region = old->region;
+        hits = old->hits;
+        hits_at = old->hits_at;
+        remove_entry(cache, old);
+        slot = find_slot(cache, hash, key, key_len);
+    }
+
+    // once the arena is used up a page may move over from a colder class, otherwise eviction
+    // stays within the class, so freed chunks always fit the entry that needs them
+    cache_class_t *slab_class = class_for(cache, sizeof(cache_entry_t) + key_len + len);
+    cache_entry_t *entry = alloc_chunk(cache, slab_class);
+    cache_class_t *colder = entry ? 0 : colder_class(cache, slab_class);
+    if (colder) {
+        carve_page(cache, slab_class, release_page(cache, colder));
+        slot = find_slot(cache, hash, key, key_len);
+        entry = alloc_chunk(cache, slab_class);
+    }
+    if (!entry && slab_class->chunks) {
+        evict_one(cache, slab_class);
+        slot = find_slot(cache, hash, key, key_len);
+        entry = alloc_chunk(cache, slab_class);
+    }
+
+    // the class has no page and every other class is down to its last one
+    if (!entry) {
+        return 0;
+    }
+
+    init_entry(entry, slot, hash, key, key_len, message, len, stored_at, expires_at);
+    entry->hits = hits;
+    entry->hits_at = hits_at;
+    cache->size++;
+
+    if (!has_room(slab_class, region)) {
+        region = CACHE_WINDOW;
+    }
+    lru_push_front(cache, entry, region);
+    if (region == CACHE_WINDOW) {
+        admit(cache, slab_class);
+    }
+
+    return *find_slot(cache, hash, key, key_len);
+}
+
+// links a new entry into the hash table, the caller puts it into an lru
+static void init_entry(cache_entry_t *entry,
+                       cache_entry_t **slot,
+                       uint64_t hash,
+                       const uint8_t *key,
+                       size_t key_len,
+                       const char *message,
+                       size_t len,
+                       uint64_t stored_at,
+                       uint64_t expires_at) {
+    entry->hash = hash;
+    entry->stored_at = stored_at;
+    entry->expires_at = expires_at;
+    entry->refresh_until = 0;
+    entry->hits = 0;
+    entry->hits_at = stored_at;
+    entry->key_len = key_len;
+    entry->message_len = len;
+    memcpy(entry->data, key, key_len);
+    memcpy(entry->data + key_len, message, len);
+
+    entry->hash_next = 0;
+    *slot = entry;
+}
+
+static cache_class_t *class_for(cache_t *cache, size_t size) {
+    int i = 0;
+    while (cache->classes[i].chunk_size < size) {
+        i++;
+    }
+
+    return &cache->classes[i];
+}
+
+// takes a free chunk, carving a new page of the arena into the class if it has none
+static cache_entry_t *alloc_chunk(cache_t *cache, cache_class_t *slab_class) {
+    if (!slab_class->free && cache->arena_used + CACHE_SLAB_PAGE <= cache->arena_size) {
+        carve_page(cache, slab_class, cache->arena + cache->arena_used);
+        cache->arena_used += CACHE_SLAB_PAGE;
+    }
+
+    cache_entry_t *chunk = slab_class->free;
+    if (chunk) {
+        slab_class->free = chunk->hash_next;
+    }
+
+    return chunk;
+}
+
+static void carve_page(cache_t *cache, cache_class_t *slab_class, char *page) {
+    size_t chunk_size = slab_class->chunk_size;
+    for (size_t offset = 0; offset + chunk_size <= CACHE_SLAB_PAGE; offset += chunk_size) {
+        cache_entry_t *chunk = (cache_entry_t *)(page + offset);
+        chunk->slab_class = slab_class - cache->classes;
+        chunk->region = CACHE_FREE;
+        chunk->hash_next = slab_class->free;
+        slab_class->free = chunk;
+        slab_class->chunks++;
+    }
+    slab_class->pages++;
+    slab_class->evictions = 0;
+}
+
+// the class hit least per page that has a page to spare. a class without pages takes it from
+// anyone, others only once they evicted a page worth of entries and from a much colder class
+static cache_class_t *colder_class(cache_t *cache, const cache_class_t *slab_class) {
+    if (cache->arena_used + CACHE_SLAB_PAGE <= cache->arena_size ||
+        (slab_class->pages &&
+         slab_class->evictions < CACHE_SLAB_PAGE / slab_class->chunk_size)) {
+        return 0;
+    }
+
+    cache_class_t *coldest = 0;
+    for (int i = 0; i < cache->classes_count; i++) {
+        cache_class_t *other = &cache->classes[i];
+        if (other == slab_class || other->pages < 2) {
+            continue;
+        }
+        if (!coldest || (uint64_t)other->hits * coldest->pages <
+                            (uint64_t)coldest->hits * other->pages) {
+            coldest = other;
+        }
+    }
+
+    if (coldest && slab_class->pages &&
+        (uint64_t)coldest->hits * CACHE_COLDER * slab_class->pages >=
+            (uint64_t)slab_class->hits * coldest->pages) {
+        return 0;
+    }
+
+    return coldest;
+}
+
+// evicts the entries of the page holding the coldest entry of the class, and takes the page
+// from the class. the class has a second page, so some chunk of it is in use or free
+static char *release_page(cache_t *cache, cache_class_t *slab_class) {
+    cache_entry_t *coldest = slab_class->lru[CACHE_PROBATION].tail;
+    for (int region = 0; !coldest && region < CACHE_REGIONS; region++) {
+        coldest = slab_class->lru[region].tail;
+    }
+    if (!coldest) {
+        coldest = slab_class->free;
+    }
+
+    size_t page_offset = ((char *)coldest - cache->arena) / CACHE_SLAB_PAGE * CACHE_SLAB_PAGE;
+    char *page = cache->arena + page_offset;
+    size_t chunk_size = slab_class->chunk_size;
+    for (size_t offset = 0; offset + chunk_size <= CACHE_SLAB_PAGE; offset += chunk_size) {
+        cache_entry_t *chunk = (cache_entry_t *)(page + offset);
+        if (chunk->region != CACHE_FREE) {
+            remove_entry(cache, chunk);
+        }
+        slab_class->chunks--;
+    }
+
+    cache_entry_t **next = &slab_class->free;
+    while (*next) {
+        if ((char *)*next >= page && (char *)*next < page + CACHE_SLAB_PAGE) {
+            *next = (*next)->hash_next;
+        } else {
+            next = &(*next)->hash_next;
+        }
+    }
+    slab_class->pages--;
+
+    return page;
+}
+
+// 1% of the chunks for the window, and 80% of the main lru protected
+static int region_max(const cache_class_t *slab_class, int region) {
+    int window = slab_class->chunks / 100 > 1 ? slab_class->chunks / 100 : 1;
+    int main_size = slab_class->chunks > window ? slab_class->chunks - window : 0;
+    if (region == CACHE_WINDOW) {
+        return window;
+    } else if (region == CACHE_PROTECTED) {
+        return main_size * 8 / 10;
+    }
+
+    return main_size;
+}
+
+// probation may take the room protected does not use
+static char has_room(const cache_class_t *slab_class, int region) {
+    int size = slab_class->lru[region].size;
+    if (region == CACHE_PROBATION) {
+        size += slab_class->lru[CACHE_PROTECTED].size;
+    }
+
+    return size < region_max(slab_class, region);
+}
+
+// entries leaving the window only enter the main lru if they are asked for more often than
+// the entry they would evict, so one-off names never push out the popular ones
+static void admit(cache_t *cache, cache_class_t *slab_class) {
+    cache_lru_t *window = &slab_class->lru[CACHE_WINDOW];
+    while (window->size > region_max(slab_class, CACHE_WINDOW)) {
+        if (has_room(slab_class, CACHE_PROBATION)) {
+            move_entry(cache, window->tail, CACHE_PROBATION);
+        } else {
+            evict_one(cache, slab_class);
+        }
+    }
+}
+
+// frees a chunk of the class, a full window makes its tail compete with the main lru tail
+static void evict_one(cache_t *cache, cache_class_t *slab_class) {
+    slab_class->evictions++;
+
+    cache_entry_t *candidate = slab_class->lru[CACHE_WINDOW].tail;
+    cache_entry_t *victim = slab_class->lru[CACHE_PROBATION].tail;
+    if (!victim) {
+        victim = slab_class->lru[CACHE_PROTECTED].tail;
+    }
+
+    if (!victim || !candidate) {
+        remove_entry(cache, victim ? victim : candidate);
+        return;
+    }
+
+    if (slab_class->lru[CACHE_WINDOW].size < region_max(slab_class, CACHE_WINDOW)) {
+        remove_entry(cache, victim);
+    } else if (sketch_estimate(cache, candidate->hash) > sketch_estimate(cache, victim->hash)) {
+        remove_entry(cache, victim);
+        move_entry(cache, candidate, CACHE_PROBATION);
+    } else {
+        remove_entry(cache, candidate);
+    }
+}
+
+static void touch_entry(cache_t *cache, cache_entry_t *entry) {
+    if (entry->region != CACHE_PROBATION) {
+        move_entry(cache, entry, entry->region);
+        return;
+    }
+
+    move_entry(cache, entry, CACHE_PROTECTED);
+
+    cache_class_t *slab_class = &cache->classes[entry->slab_class];
+    if (slab_class->lru[CACHE_PROTECTED].size > region_max(slab_class, CACHE_PROTECTED)) {
+        move_entry(cache, slab_class->lru[CACHE_PROTECTED].tail, CACHE_PROBATION);
+    }
+}
+
+static void move_entry(cache_t *cache, cache_entry_t *entry, int region) {
+    lru_unlink(cache, entry);
+    lru_push_front(cache, entry, region);
+}
+
+static void sketch_add(cache_t *cache, uint64_t hash) {
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        uint64_t row_hash = hash_mix(hash + row * 0x9e3779b97f4a7c15ull);
+        uint8_t *counter = &cache->sketch[row * (cache->sketch_mask + 1) +
+                                          (row_hash & cache->sketch_mask)];
+        if (*counter < CACHE_SKETCH_MAX) {
+            (*counter)++;
+        }
+    }
+
+    // aging keeps the counts about recent traffic
+    if (++cache->sketch_additions >= cache->sketch_sample) {
+        size_t counters = (cache->sketch_mask + 1) * CACHE_SKETCH_ROWS;
+        for (size_t i = 0; i < counters; i++) {
+            cache->sketch[i] >>= 1;
+        }
+        cache->sketch_additions /= 2;
+        for (int i = 0; i < cache->classes_count; i++) {
+            cache->classes[i].hits /= 2;
+        }
+    }
+}
+
+static int sketch_estimate(const cache_t *cache, uint64_t hash) {
+    int estimate = CACHE_SKETCH_MAX;
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        uint64_t row_hash = hash_mix(hash + row * 0x9e3779b97f4a7c15ull);
+        uint8_t counter =
+            cache->sketch[row * (cache->sketch_mask + 1) + (row_hash & cache->sketch_mask)];
+        if (counter < estimate) {
+            estimate = counter;
+        }
+    }
+
+    return estimate;
+}
+
+static cache_entry_t **find_slot(cache_t *cache,
+                                 uint64_t hash,
+                                 const uint8_t *key,
+                                 size_t key_len) {
+    cache_entry_t **slot = &cache->buckets[hash & cache->buckets_mask];
+    while (*slot) {
+        cache_entry_t *entry = *slot;
+        if (entry->hash == hash && entry->key_len == key_len &&
+            memcmp(entry->data, key, key_len) == 0) {
+            break;
+        }
+        slot = &entry->hash_next;
+    }
+
+    return slot;
+}
+
+static void remove_entry(cache_t *cache, cache_entry_t *entry) {
+    cache_entry_t **slot = &cache->buckets[entry->hash & cache->buckets_mask];
+    while (*slot != entry) {
+        slot = &(*slot)->hash_next;
+    }
+    *slot = entry->hash_next;
+
+    lru_unlink(cache, entry);
+    cache->size--;
+
+    cache_class_t *slab_class = &cache->classes[entry->slab_class];
+    entry->region = CACHE_FREE;
+    entry->hash_next = slab_class->free;
+    slab_class->free = entry;
+}
+
+static void decay_hits(cache_entry_t *entry, uint64_t now) {
+    if (now < entry->hits_at + CACHE_HITS_HALF_LIFE) {
+        return;
+    }
+
+    uint64_t periods = (now - entry->hits_at) / CACHE_HITS_HALF_LIFE;
+    entry->hits = periods < 32 ? entry->hits >> periods : 0;
+    entry->hits_at += periods * CACHE_HITS_HALF_LIFE;
+}
+
+static void lru_unlink(cache_t *cache, cache_entry_t *entry) {
+    cache_lru_t *lru = &cache->classes[entry->slab_class].lru[entry->region];
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru->head = entry->lru_next;
+    }
+
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru->tail = entry->lru_prev;
+    }
+    lru->size--;
+}
+
+static void lru_push_front(cache_t *cache, cache_entry_t *entry, int region) {
+    cache_lru_t *lru = &cache->classes[entry->slab_class].lru[region];
+    entry->region = region;
+    entry->lru_prev = 0;
+    entry->lru_next = lru->head;
+    if (lru->head) {
+        lru->head->lru_prev = entry;
+    } else {
+        lru->tail = entry;
+    }
+    lru->head = entry;
+    lru->size++;
+}
+
+static void lru_push_back(cache_t *cache, cache_entry_t *entry, int region) {
+    cache_lru_t *lru = &cache->classes[entry->slab_class].lru[region];
+    entry->region = region;
+    entry->lru_next = 0;
+    entry->lru_prev = lru->tail;
+    if (lru->tail) {
+        lru->tail->lru_next = entry;
+    } else {
+        lru->head = entry;
+    }
+    lru->tail = entry;
+    lru->size++;
+}
+
+// makes a rename of the file at path durable
+static int sync_dir(const char *path) {
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || fsync(fd)) {
+        fprintf(stderr, "failed to sync %s: %s\n", dir, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+
+    return 0;
+}
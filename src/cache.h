@@ -0,0 +1,135 @@
+#ifndef DNSPROXY_CACHE_H
+#define DNSPROXY_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dns.h"
+#include "hugepage.h"
+
+#define CACHE_MAX_KEY_LEN (DNS_MAX_NAME_LEN + 4)
+#define CACHE_MAX_MESSAGE_LEN 4096 // bound of max_message_len
+#define CACHE_SLAB_PAGE 65536      // bytes handed to a size class at a time
+#define CACHE_MAX_CLASSES 32
+#define CACHE_MAX_TTL 86400
+#define CACHE_STALE_TTL 30 // ttl of stale answers, as rfc 8767 recommends
+#define CACHE_HITS_HALF_LIFE 60000 // ms
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_SKETCH_MAX 15 // counters saturate here
+
+// w-tinylfu: new entries go through a small lru window, then have to be seen more often than
+// the probation tail of the segmented main lru to stay, and hits in probation promote entries
+// to the protected segment. every size class runs its own lrus over the chunks it owns
+enum { CACHE_WINDOW, CACHE_PROBATION, CACHE_PROTECTED, CACHE_REGIONS };
+
+// key is the lowercase wire format qname followed by qtype and qclass
+typedef struct cache_entry {
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+    uint64_t hash;
+    uint64_t stored_at;     // ms since epoch
+    uint64_t expires_at;    // ms since epoch
+    uint64_t refresh_until; // ms since epoch, a refresh of the entry is in flight until then
+    uint64_t hits_at;       // ms since epoch, hits were last decayed
+    uint32_t hits;          // halved every CACHE_HITS_HALF_LIFE
+    uint16_t key_len;
+    uint16_t message_len;
+    uint8_t region;
+    uint8_t slab_class;
+    char data[]; // key followed by the wire format response
+} cache_entry_t;
+
+typedef struct {
+    cache_entry_t *head; // most recently used
+    cache_entry_t *tail;
+    int size;
+} cache_lru_t;
+
+typedef struct {
+    size_t chunk_size;
+    int chunks;          // chunks carved from the pages the class owns
+    int pages;
+    cache_entry_t *free; // free chunks, linked through hash_next
+    cache_lru_t lru[CACHE_REGIONS];
+    uint32_t hits;      // halved with the sketch counters, so about recent traffic
+    uint32_t evictions; // since the class last got a page
+} cache_class_t;
+
+typedef struct {
+    int expected_size;  // entries the hash table is sized for, 0 disables the cache
+    size_t memory;      // bytes of the slab arena, the hard limit
+    int sketch_width;   // counters per sketch row
+    uint32_t max_stale; // seconds expired entries are kept for
+    uint32_t prefetch_hits;
+    size_t max_message_len; // larger answers are not kept, at most CACHE_MAX_MESSAGE_LEN
+} cache_config_t;
+
+typedef struct {
+    cache_entry_t **buckets;
+    size_t buckets_mask;
+    char *arena; // allocated once, pages go to size classes as they fill up and move to the
+                 // classes that need them more once it is used up
+    size_t arena_size;
+    size_t arena_used;
+    size_t arena_mapped;
+    hugepage_backing_t arena_backing;
+    cache_class_t classes[CACHE_MAX_CLASSES];
+    int classes_count;
+    uint8_t *sketch; // count-min sketch of how often keys are asked for
+    size_t sketch_mask;
+    uint32_t sketch_additions;
+    uint32_t sketch_sample; // additions after which every counter is halved
+    int size;
+    int expected_size;
+    uint64_t max_stale;     // ms expired entries are kept for
+    uint32_t prefetch_hits; // decayed hits that make an entry worth prefetching, 0 for never
+    size_t max_message_len;
+} cache_t;
+
+int cache_init(cache_t *cache, const cache_config_t *config);
+void cache_free(cache_t *cache);
+
+int cache_key_from_message(const char *buffer, size_t len, uint8_t *key, size_t *key_len);
+
+// counts the access, may return an entry that expired less than max_stale ago
+cache_entry_t *cache_lookup(cache_t *cache, const uint8_t *key, size_t key_len, uint64_t now);
+void cache_store(cache_t *cache,
+                 const uint8_t *key,
+                 size_t key_len,
+                 const char *message,
+                 size_t len,
+                 uint64_t now);
+// stores a message with the times it was first stored and expires at, e.g. when it is taken
+// from another cache. returns the entry, or 0 if it was not kept
+cache_entry_t *cache_insert(cache_t *cache,
+                            const uint8_t *key,
+                            size_t key_len,
+                            const char *message,
+                            size_t len,
+                            uint64_t stored_at,
+                            uint64_t expires_at);
+
+// smallest ttl of the answers, or of the soa for negative answers (rfc 2308)
+int cache_message_ttl(const char *message, size_t len, uint32_t *ttl);
+
+// returns 1 if the caller should refresh the expired entry, once until timeout passes
+char cache_claim_refresh(cache_entry_t *entry, uint64_t now, uint64_t timeout);
+// same for a popular entry in the last tenth of its ttl
+char cache_claim_prefetch(const cache_t *cache,
+                          cache_entry_t *entry,
+                          uint64_t now,
+                          uint64_t timeout);
+
+// copies the cached response with the query id and question and ttls reduced by its age,
+// or set to CACHE_STALE_TTL if it has expired. buffer holds max_message_len bytes
+size_t cache_build_response(const cache_entry_t *entry,
+                            const char *query,
+                            size_t query_len,
+                            char *buffer,
+                            uint64_t now);
+
+int cache_save(const cache_t *cache, const char *path, uint64_t now);
+int cache_load(cache_t *cache, const char *path, uint64_t now);
+
+#endif
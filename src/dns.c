@@ -12,21 +12,25 @@ domain_t parse_domain(const char *buffer, size_t *offset) {
     end_domain.len = 0;
 
     while (1) {
-        if (*(short *)(buffer + *offset) == 0) {
+        if (buffer[*offset] == 0) {
+            *offset += 1;
             break;
         }
 
         const char pointer_mask = (1 << 7) | (1 << 6);
-        char is_pointer = (buffer[*offset] && pointer_mask) == pointer_mask;
+        char is_pointer = (buffer[*offset] & pointer_mask) == pointer_mask;
         if (is_pointer) {
             short pointer_s = *(const short *)(buffer + *offset);
-            pointer_s = pointer_s & ~((1 << 15) | (1 << 14));
+            pointer_s = pointer_s & ~htons((1 << 15) | (1 << 14));
             size_t pointer = ntohs(pointer_s);
             end_domain = parse_domain(buffer, &pointer);
+            *offset += 2;
+            break;
+        } else if (labels_count == 127) {
             break;
         } else {
-            char len = buffer[*offset];
-            char *str = (char *)malloc(len);
+            uint8_t len = buffer[*offset];
+            char *str = (char *)malloc(len + 1);
             if (!str) {
                 fprintf(stderr, "failed to allocate memory\n");
                 exit(-1);
@@ -42,7 +46,7 @@ domain_t parse_domain(const char *buffer, size_t *offset) {
 
     domain.len = labels_count + end_domain.len;
     domain.labels = malloc(sizeof(char **) * domain.len);
-    if (!labels) {
+    if (!domain.labels && domain.len) {
         fprintf(stderr, "failed to allocate memory\n");
         exit(-1);
     }
@@ -107,24 +111,191 @@ void free_domain(domain_t domain) {
     free(domain.labels);
 }
 
-dns_header_t *create_dns_refuse_header(uint16_t id, uint8_t rcode) {
-    dns_header_t *header = malloc(sizeof(dns_header_t));
-    if (!header) {
-        fprintf(stderr, "failed to allocate memory\n");
-        exit(-1);
+int dns_read_name(const char *buffer, size_t len, size_t *offset, uint8_t *name, size_t *name_len) {
+    size_t pos = *offset;
+    size_t out = 0;
+    int jumps = 0;
+    char jumped = 0;
+
+    while (1) {
+        if (pos >= len) {
+            return -1;
+        }
+
+        uint8_t label_len = buffer[pos];
+        if ((label_len & 0xc0) == 0xc0) {
+            if (pos + 1 >= len || ++jumps > 64) {
+                return -1;
+            }
+
+            if (!jumped) {
+                *offset = pos + 2;
+                jumped = 1;
+            }
+
+            pos = ((label_len & 0x3f) << 8) | (uint8_t)buffer[pos + 1];
+            continue;
+        } else if (label_len & 0xc0) {
+            return -1;
+        }
+
+        if (pos + 1 + label_len > len || out + label_len + 2 > DNS_MAX_NAME_LEN) {
+            return -1;
+        }
+
+        name[out++] = label_len;
+        if (label_len == 0) {
+            break;
+        }
+
+        for (int i = 0; i < label_len; i++) {
+            char c = buffer[pos + 1 + i];
+            name[out++] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        }
+
+        pos += label_len + 1;
+    }
+
+    if (!jumped) {
+        *offset = pos + 1;
+    }
+
+    *name_len = out;
+
+    return 0;
+}
+
+int dns_skip_name(const char *buffer, size_t len, size_t *offset) {
+    size_t pos = *offset;
+
+    while (1) {
+        if (pos >= len) {
+            return -1;
+        }
+
+        uint8_t label_len = buffer[pos];
+        if ((label_len & 0xc0) == 0xc0) {
+            pos += 2;
+            break;
+        } else if (label_len & 0xc0) {
+            return -1;
+        }
+
+        pos += label_len + 1;
+        if (label_len == 0) {
+            break;
+        }
+    }
+
+    if (pos > len) {
+        return -1;
+    }
+
+    *offset = pos;
+
+    return 0;
+}
+
+int dns_name_from_str(const char *str, uint8_t *name, size_t *name_len) {
+    size_t out = 0;
+    const char *label = str;
+
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        size_t label_len = dot ? (size_t)(dot - label) : strlen(label);
+        if (label_len == 0 || label_len > 63 || out + label_len + 2 > DNS_MAX_NAME_LEN) {
+            return -1;
+        }
+
+        name[out++] = label_len;
+        for (size_t i = 0; i < label_len; i++) {
+            char c = label[i];
+            name[out++] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        }
+
+        if (!dot) {
+            break;
+        }
+        label = dot + 1;
+    }
+
+    name[out++] = 0;
+    *name_len = out;
+
+    return 0;
+}
+
+int dns_skip_question(const char *buffer, size_t len, size_t *offset) {
+    if (dns_skip_name(buffer, len, offset) || *offset + 4 > len) {
+        return -1;
+    }
+
+    *offset += 4;
+
+    return 0;
+}
+
+int dns_check_questions(const char *buffer, size_t len, size_t *first_question_len) {
+    if (len < sizeof(dns_header_t)) {
+        return -1;
     }
 
-    header->id = id;
+    const dns_header_t *header = (const dns_header_t *)buffer;
+    int qd_count = ntohs(header->qd_count);
+    if (qd_count == 0) {
+        return -1;
+    }
+
+    size_t offset = sizeof(dns_header_t);
+    for (int i = 0; i < qd_count; i++) {
+        if (dns_skip_question(buffer, len, &offset)) {
+            return -1;
+        }
+
+        if (i == 0) {
+            *first_question_len = offset - sizeof(dns_header_t);
+        }
+    }
+
+    return 0;
+}
+
+int dns_next_rr(const char *buffer, size_t len, size_t *offset, dns_rr_t *rr) {
+    size_t pos = *offset;
+    if (dns_skip_name(buffer, len, &pos) || pos + 10 > len) {
+        return -1;
+    }
 
-    uint16_t flags = 0;
-    flags |= (1 << 15);
-    flags |= 5;
-    header->flags = htons(flags);
+    rr->type = dns_read_u16(buffer, pos);
+    rr->class = dns_read_u16(buffer, pos + 2);
+    rr->ttl = dns_read_u32(buffer, pos + 4);
+    rr->rdlength = dns_read_u16(buffer, pos + 8);
+    rr->ttl_offset = pos + 4;
+    rr->rdata_offset = pos + 10;
 
-    header->qd_count = 0;
-    header->an_count = 0;
-    header->ns_count = 0;
-    header->ar_count = 0;
+    if (rr->rdata_offset + rr->rdlength > len) {
+        return -1;
+    }
+
+    *offset = rr->rdata_offset + rr->rdlength;
+
+    return 0;
+}
+
+uint16_t dns_read_u16(const char *buffer, size_t offset) {
+    return ((uint8_t)buffer[offset] << 8) | (uint8_t)buffer[offset + 1];
+}
+
+uint32_t dns_read_u32(const char *buffer, size_t offset) {
+    return ((uint32_t)dns_read_u16(buffer, offset) << 16) | dns_read_u16(buffer, offset + 2);
+}
+
+void dns_write_u16(char *buffer, size_t offset, uint16_t value) {
+    buffer[offset] = value >> 8;
+    buffer[offset + 1] = value & 0xff;
+}
 
-    return header;
+void dns_write_u32(char *buffer, size_t offset, uint32_t value) {
+    dns_write_u16(buffer, offset, value >> 16);
+    dns_write_u16(buffer, offset + 2, value & 0xffff);
 }
@@ -7,6 +7,26 @@
 #include <string.h>
 
 #define DNS_GET_QR(flags) (((flags) & 0x8000) >> 15)
+#define DNS_GET_TC(flags) (((flags) & 0x0200) >> 9)
+#define DNS_GET_RCODE(flags) ((flags) & 0x000f)
+
+#define DNS_MAX_NAME_LEN 255
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_NS 2
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_OPT 41
+
+#define DNS_CLASS_IN 1
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_FORMERR 1
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_RCODE_REFUSED 5
 
 typedef struct {
     uint16_t id;
@@ -17,6 +37,15 @@ typedef struct {
     uint16_t ar_count;
 } __attribute__((packed)) dns_header_t;
 
+typedef struct {
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t rdlength;
+    size_t ttl_offset;
+    size_t rdata_offset;
+} dns_rr_t;
+
 typedef struct {
     char **labels;
     int len;
@@ -26,6 +55,22 @@ domain_t parse_domain(const char *buffer, size_t *offset);
 char *domain_to_str(const domain_t *domain);
 void free_domain(domain_t domain);
 
-dns_header_t *create_dns_refuse_header(uint16_t id, uint8_t rcode);
+// bounds-checked wire format helpers, all return 0 on success and -1 on a malformed message
+
+// reads a possibly compressed name as lowercase uncompressed wire format,
+// name must hold DNS_MAX_NAME_LEN bytes
+int dns_read_name(const char *buffer, size_t len, size_t *offset, uint8_t *name, size_t *name_len);
+int dns_skip_name(const char *buffer, size_t len, size_t *offset);
+// converts a dotted name ("www.example.com" or "www.example.com.") to lowercase wire format
+int dns_name_from_str(const char *str, uint8_t *name, size_t *name_len);
+int dns_skip_question(const char *buffer, size_t len, size_t *offset);
+// checks that there is at least one question and all of them are well formed
+int dns_check_questions(const char *buffer, size_t len, size_t *first_question_len);
+int dns_next_rr(const char *buffer, size_t len, size_t *offset, dns_rr_t *rr);
+
+uint16_t dns_read_u16(const char *buffer, size_t offset);
+uint32_t dns_read_u32(const char *buffer, size_t offset);
+void dns_write_u16(char *buffer, size_t offset, uint16_t value);
+void dns_write_u32(char *buffer, size_t offset, uint32_t value);
 
 #endif
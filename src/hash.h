@@ -0,0 +1,35 @@
+#ifndef DNSPROXY_HASH_H
+#define DNSPROXY_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+static inline uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *bytes = data;
+    uint64_t hash = seed ^ (len * 0x9e3779b97f4a7c15ull);
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = hash_mix(hash ^ word) + 0x9e3779b97f4a7c15ull;
+        bytes += 8;
+        len -= 8;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, bytes, len);
+
+    return hash_mix(hash ^ tail ^ ((uint64_t)len << 56));
+}
+
+#endif
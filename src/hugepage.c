@@ -0,0 +1,126 @@
+#include "hugepage.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static char has_huge_pages(const void *ptr);
+
+static char enabled;
+
+void hugepage_set_enabled(char value) {
+    enabled = value;
+}
+
+char hugepage_enabled() {
+    return enabled;
+}
+
+void *hugepage_alloc(size_t *len, char private_copy, hugepage_backing_t *backing) {
+    if (enabled) {
+        *len = (*len + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+
+        // a child gets copies of private huge pages only while free ones are left, and is
+        // killed when it touches a page it could not get, so only mappings it reads are private
+        void *ptr = mmap(0,
+                         *len,
+                         PROT_READ | PROT_WRITE,
+                         (private_copy ? MAP_PRIVATE : MAP_SHARED) | MAP_ANONYMOUS |
+                             MAP_HUGETLB | MAP_POPULATE,
+                         -1,
+                         0);
+        if (ptr != MAP_FAILED) {
+            *backing = HUGEPAGE_HUGETLB;
+            return ptr;
+        }
+    }
+
+    // transparent huge pages only back aligned 2 MiB ranges, so the mapping is aligned
+    size_t map_len = enabled ? *len + HUGEPAGE_SIZE : *len;
+    uint8_t *map = mmap(0, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    uint8_t *ptr = map;
+    if (enabled) {
+        ptr = (uint8_t *)(((uintptr_t)map + HUGEPAGE_SIZE - 1) & ~(uintptr_t)(HUGEPAGE_SIZE - 1));
+        if (ptr > map) {
+            munmap(map, ptr - map);
+        }
+        munmap(ptr + *len, map + map_len - (ptr + *len));
+    }
+
+    char advised = enabled && madvise(ptr, *len, MADV_HUGEPAGE) == 0;
+
+    // touched after the advice, so the kernel can fault in huge pages right away
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < *len; offset += page_size) {
+        ((volatile uint8_t *)ptr)[offset] = 0;
+    }
+
+    // the advice is accepted even when thp is off or no huge page was free
+    *backing = advised && has_huge_pages(ptr) ? HUGEPAGE_THP : HUGEPAGE_NONE;
+
+    return ptr;
+}
+
+void hugepage_free(void *ptr, size_t len) {
+    if (ptr) {
+        munmap(ptr, len);
+    }
+}
+
+size_t hugepage_free_count() {
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp) {
+        return 0;
+    }
+
+    char line[256];
+    unsigned long count = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "HugePages_Free: %lu", &count) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+
+    return count;
+}
+
+const char *hugepage_backing_name(hugepage_backing_t backing) {
+    switch (backing) {
+    case HUGEPAGE_HUGETLB:
+        return "reserved huge pages";
+    case HUGEPAGE_THP:
+        return "transparent huge pages";
+    default:
+        return "regular pages";
+    }
+}
+
+// AnonHugePages of the mapping holding ptr in /proc/self/smaps
+static char has_huge_pages(const void *ptr) {
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if (!fp) {
+        return 0;
+    }
+
+    char line[512];
+    char inside = 0;
+    unsigned long huge_kb = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long start;
+        unsigned long end;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            inside = start <= (uintptr_t)ptr && (uintptr_t)ptr < end;
+        } else if (inside && sscanf(line, "AnonHugePages: %lu kB", &huge_kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+
+    return huge_kb > 0;
+}
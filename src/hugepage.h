@@ -0,0 +1,29 @@
+#ifndef DNSPROXY_HUGEPAGE_H
+#define DNSPROXY_HUGEPAGE_H
+
+#include <stddef.h>
+
+#define HUGEPAGE_SIZE (2 << 20)
+
+typedef enum {
+    HUGEPAGE_NONE,    // regular pages
+    HUGEPAGE_HUGETLB, // reserved huge pages, MAP_HUGETLB
+    HUGEPAGE_THP,     // transparent huge pages, MADV_HUGEPAGE
+} hugepage_backing_t;
+
+// off by default, set once from the config before anything is allocated
+void hugepage_set_enabled(char enabled);
+char hugepage_enabled();
+
+// maps len bytes populated and zeroed, rounded up in len to whole huge pages when they are
+// enabled. reserved huge pages are tried first, then transparent ones, then regular pages.
+// private_copy is set for memory a forked child reads and must see as of the fork, reserved
+// huge pages are otherwise shared with children
+void *hugepage_alloc(size_t *len, char private_copy, hugepage_backing_t *backing);
+void hugepage_free(void *ptr, size_t len);
+// reserved huge pages nobody uses, which the copies of private ones come from
+size_t hugepage_free_count();
+
+const char *hugepage_backing_name(hugepage_backing_t backing);
+
+#endif
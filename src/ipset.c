@@ -0,0 +1,265 @@
+#include "ipset.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define IPSET_V4_OFFSET 12
+#define IPSET_V4_INDEX_LEN (IPSET_V4_OFFSET * 8 + IPSET_V4_INDEX_BITS)
+
+static void make_key(const uint8_t *addr, size_t addr_len, uint8_t *key);
+static void mask_key(uint8_t *key, int len);
+static uint8_t get_bit(const uint8_t *key, int bit);
+static int common_bits(const uint8_t *a, const uint8_t *b, int from, int max);
+static uint32_t add_node(ipset_t *set, const uint8_t *key, int len, uint8_t terminal);
+static void insert(ipset_t *set, const uint8_t *key, int len);
+static uint32_t walk(const ipset_t *set, const uint8_t *key, int len);
+
+void ipset_init(ipset_t *set) {
+    memset(set, 0, sizeof(*set));
+}
+
+void ipset_free(ipset_t *set) {
+    free(set->nodes);
+    free(set->v4_index);
+    ipset_init(set);
+}
+
+int ipset_add(ipset_t *set, const char *prefix) {
+    char host[INET6_ADDRSTRLEN];
+    const char *slash = strchr(prefix, '/');
+    size_t host_len = slash ? (size_t)(slash - prefix) : strlen(prefix);
+    if (host_len >= sizeof(host)) {
+        return -1;
+    }
+
+    memcpy(host, prefix, host_len);
+    host[host_len] = 0;
+
+    uint8_t addr[IPSET_KEY_LEN];
+    size_t addr_len;
+    if (inet_pton(AF_INET, host, addr) == 1) {
+        addr_len = 4;
+    } else if (inet_pton(AF_INET6, host, addr) == 1) {
+        addr_len = IPSET_KEY_LEN;
+    } else {
+        return -1;
+    }
+
+    long len = addr_len * 8;
+    if (slash) {
+        char *end;
+        len = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end || len < 0 || len > (long)addr_len * 8) {
+            return -1;
+        }
+    }
+
+    uint8_t key[IPSET_KEY_LEN];
+    make_key(addr, addr_len, key);
+    if (addr_len == 4) {
+        len += IPSET_V4_OFFSET * 8;
+    }
+    mask_key(key, len);
+
+    insert(set, key, len);
+    set->prefixes_count++;
+
+    return 0;
+}
+
+int ipset_compile(ipset_t *set) {
+    if (!set->nodes_count) {
+        return 0;
+    }
+
+    set->v4_index = malloc(sizeof(uint32_t) << IPSET_V4_INDEX_BITS);
+    if (!set->v4_index) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    for (uint32_t top = 0; top < 1u << IPSET_V4_INDEX_BITS; top++) {
+        uint8_t addr[4] = {top >> 8, top & 0xff, 0, 0};
+        uint8_t key[IPSET_KEY_LEN];
+        make_key(addr, sizeof(addr), key);
+        set->v4_index[top] = walk(set, key, IPSET_V4_INDEX_LEN);
+    }
+
+    return 0;
+}
+
+char ipset_contains(const ipset_t *set, const uint8_t *addr, size_t addr_len) {
+    if (!set->nodes_count || (addr_len != 4 && addr_len != IPSET_KEY_LEN)) {
+        return 0;
+    }
+
+    uint8_t key[IPSET_KEY_LEN];
+    make_key(addr, addr_len, key);
+
+    uint32_t i = 0;
+    int checked = 0;
+    if (addr_len == 4 && set->v4_index) {
+        i = set->v4_index[addr[0] << 8 | addr[1]];
+        if (i == IPSET_MATCH || i == IPSET_NO_NODE) {
+            return i == IPSET_MATCH;
+        }
+        checked = IPSET_V4_INDEX_LEN;
+    }
+
+    // any prefix on the path matches, so the walk stops at the first one. the bits above the
+    // parent's length were compared on the way down
+    while (1) {
+        const ipset_node_t *node = &set->nodes[i];
+        if (common_bits(node->key, key, checked, node->len) < node->len) {
+            return 0;
+        }
+        if (node->terminal) {
+            return 1;
+        }
+
+        i = node->children[get_bit(key, node->len)];
+        if (!i) {
+            return 0;
+        }
+        checked = node->len;
+    }
+}
+
+// walks the first len bits of key, returns the first node at least that long whose first len
+// bits match, IPSET_MATCH if a shorter prefix already matched, IPSET_NO_NODE otherwise
+static uint32_t walk(const ipset_t *set, const uint8_t *key, int len) {
+    uint32_t i = 0;
+    while (1) {
+        const ipset_node_t *node = &set->nodes[i];
+        int node_len = node->len < len ? node->len : len;
+        if (common_bits(node->key, key, 0, node_len) < node_len) {
+            return IPSET_NO_NODE;
+        }
+        if (node->len >= len) {
+            return i;
+        }
+        if (node->terminal) {
+            return IPSET_MATCH;
+        }
+
+        i = node->children[get_bit(key, node->len)];
+        if (!i) {
+            return IPSET_NO_NODE;
+        }
+    }
+}
+
+static void make_key(const uint8_t *addr, size_t addr_len, uint8_t *key) {
+    if (addr_len == IPSET_KEY_LEN) {
+        memcpy(key, addr, IPSET_KEY_LEN);
+        return;
+    }
+
+    memset(key, 0, IPSET_V4_OFFSET);
+    key[10] = 0xff;
+    key[11] = 0xff;
+    memcpy(key + IPSET_V4_OFFSET, addr, 4);
+}
+
+static void mask_key(uint8_t *key, int len) {
+    for (int i = 0; i < IPSET_KEY_LEN; i++) {
+        int bits = len - i * 8;
+        if (bits <= 0) {
+            key[i] = 0;
+        } else if (bits < 8) {
+            key[i] &= 0xff << (8 - bits);
+        }
+    }
+}
+
+static uint8_t get_bit(const uint8_t *key, int bit) {
+    return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+// a and b are known to share the first from bits
+static int common_bits(const uint8_t *a, const uint8_t *b, int from, int max) {
+    for (int i = from >> 3; i * 8 < max; i++) {
+        uint8_t diff = a[i] ^ b[i];
+        if (diff) {
+            int bits = i * 8 + __builtin_clz(diff) - 24;
+            return bits < max ? bits : max;
+        }
+    }
+
+    return max;
+}
+
+static uint32_t add_node(ipset_t *set, const uint8_t *key, int len, uint8_t terminal) {
+    if (set->nodes_count == set->nodes_capacity) {
+        set->nodes_capacity = set->nodes_capacity ? set->nodes_capacity * 2 : 64;
+        set->nodes = realloc(set->nodes, sizeof(ipset_node_t) * set->nodes_capacity);
+        if (!set->nodes) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    ipset_node_t *node = &set->nodes[set->nodes_count];
+    memcpy(node->key, key, IPSET_KEY_LEN);
+    node->len = len;
+    node->terminal = terminal;
+    node->children[0] = 0;
+    node->children[1] = 0;
+
+    return set->nodes_count++;
+}
+
+// add_node may move the nodes, so they are copied or indexed again after every call
+static void insert(ipset_t *set, const uint8_t *key, int len) {
+    if (!set->nodes_count) {
+        add_node(set, key, len, 1);
+        return;
+    }
+
+    uint32_t i = 0;
+    while (1) {
+        ipset_node_t node = set->nodes[i];
+        int common = common_bits(node.key, key, 0, node.len < len ? node.len : len);
+
+        if (common < node.len) {
+            // node i becomes the branch where the paths part, its old contents move below it
+            uint32_t moved = add_node(set, node.key, node.len, node.terminal);
+            set->nodes[moved].children[0] = node.children[0];
+            set->nodes[moved].children[1] = node.children[1];
+
+            uint8_t branch_key[IPSET_KEY_LEN];
+            memcpy(branch_key, key, IPSET_KEY_LEN);
+            mask_key(branch_key, common);
+
+            ipset_node_t *branch = &set->nodes[i];
+            memcpy(branch->key, branch_key, IPSET_KEY_LEN);
+            branch->len = common;
+            branch->terminal = len == common;
+            branch->children[0] = 0;
+            branch->children[1] = 0;
+            branch->children[get_bit(node.key, common)] = moved;
+
+            if (len > common) {
+                uint32_t leaf = add_node(set, key, len, 1);
+                set->nodes[i].children[get_bit(key, common)] = leaf;
+            }
+            return;
+        }
+
+        if (len == node.len) {
+            set->nodes[i].terminal = 1;
+            return;
+        }
+
+        uint8_t bit = get_bit(key, node.len);
+        if (!node.children[bit]) {
+            uint32_t leaf = add_node(set, key, len, 1);
+            set->nodes[i].children[bit] = leaf;
+            return;
+        }
+
+        i = node.children[bit];
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef DNSPROXY_IPSET_H
+#define DNSPROXY_IPSET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define IPSET_KEY_LEN 16 // IPv4 addresses are kept as ::ffff:a.b.c.d
+#define IPSET_V4_INDEX_BITS 16
+#define IPSET_NO_NODE UINT32_MAX
+#define IPSET_MATCH (UINT32_MAX - 1)
+
+// a node covers the first len bits of key, nodes on a path only exist where it branches
+typedef struct {
+    uint8_t key[IPSET_KEY_LEN];
+    uint8_t len;
+    uint8_t terminal; // key/len itself is in the set
+    uint32_t children[2]; // by the bit after len, 0 if none since the root is never a child
+} ipset_node_t;
+
+// a set of IPv4 and IPv6 prefixes in a path compressed binary trie
+typedef struct {
+    ipset_node_t *nodes;
+    uint32_t nodes_count;
+    uint32_t nodes_capacity;
+    int prefixes_count;
+
+    // where the walk of an IPv4 address is after its top 16 bits, so it skips the top of the
+    // trie: a node, IPSET_MATCH or IPSET_NO_NODE
+    uint32_t *v4_index;
+} ipset_t;
+
+void ipset_init(ipset_t *set);
+void ipset_free(ipset_t *set);
+
+// prefix is an IPv4 or IPv6 address with an optional "/length"
+int ipset_add(ipset_t *set, const char *prefix);
+int ipset_compile(ipset_t *set);
+
+// addr is 4 or 16 bytes in network order, as in A and AAAA rdata
+char ipset_contains(const ipset_t *set, const uint8_t *addr, size_t addr_len);
+
+#endif
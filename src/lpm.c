@@ -0,0 +1,189 @@
+#include "lpm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define LPM_ROOT_ENTRIES 65536
+#define LPM_TABLE_ENTRIES 256
+
+static int prefix_cmp(const void *a, const void *b);
+static uint32_t add_table(lpm_t *lpm, uint32_t fill);
+static void insert(lpm_t *lpm, const lpm_prefix_t *prefix);
+
+void lpm_init(lpm_t *lpm) {
+    memset(lpm, 0, sizeof(*lpm));
+}
+
+void lpm_free(lpm_t *lpm) {
+    free(lpm->prefixes);
+    free(lpm->root);
+    free(lpm->tables);
+    lpm_init(lpm);
+}
+
+int lpm_add(lpm_t *lpm, const char *prefix, int value) {
+    char host[INET_ADDRSTRLEN];
+    const char *slash = strchr(prefix, '/');
+    size_t host_len = slash ? (size_t)(slash - prefix) : strlen(prefix);
+    if (host_len >= sizeof(host)) {
+        return -1;
+    }
+
+    memcpy(host, prefix, host_len);
+    host[host_len] = 0;
+
+    struct in_addr addr;
+    if (inet_pton(AF_INET, host, &addr) != 1) {
+        return -1;
+    }
+
+    long len = 32;
+    if (slash) {
+        char *end;
+        len = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end || len < 0 || len > 32) {
+            return -1;
+        }
+    }
+
+    if (lpm->prefixes_count == lpm->prefixes_capacity) {
+        lpm->prefixes_capacity = lpm->prefixes_capacity ? lpm->prefixes_capacity * 2 : 16;
+        lpm->prefixes = realloc(lpm->prefixes, sizeof(lpm_prefix_t) * lpm->prefixes_capacity);
+        if (!lpm->prefixes) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    lpm_prefix_t *added = &lpm->prefixes[lpm->prefixes_count++];
+    uint32_t mask = len ? 0xffffffffu << (32 - len) : 0;
+    added->addr = ntohl(addr.s_addr) & mask;
+    added->len = len;
+    added->value = value;
+
+    return 0;
+}
+
+int lpm_compile(lpm_t *lpm) {
+    if (!lpm->prefixes_count) {
+        return 0;
+    }
+
+    // shorter prefixes go first so the longer ones overwrite them where they overlap
+    qsort(lpm->prefixes, lpm->prefixes_count, sizeof(lpm_prefix_t), prefix_cmp);
+
+    for (int i = 1; i < lpm->prefixes_count; i++) {
+        const lpm_prefix_t *prefix = &lpm->prefixes[i];
+        if (prefix->len == lpm->prefixes[i - 1].len && prefix->addr == lpm->prefixes[i - 1].addr) {
+            struct in_addr addr = {htonl(prefix->addr)};
+            char host[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &addr, host, sizeof(host));
+            fprintf(stderr, "prefix %s/%d is listed twice\n", host, prefix->len);
+            return -1;
+        }
+    }
+
+    lpm->root = calloc(LPM_ROOT_ENTRIES, sizeof(uint32_t));
+    if (!lpm->root) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    for (int i = 0; i < lpm->prefixes_count; i++) {
+        insert(lpm, &lpm->prefixes[i]);
+    }
+
+    free(lpm->prefixes);
+    lpm->prefixes = 0;
+    lpm->prefixes_count = 0;
+    lpm->prefixes_capacity = 0;
+
+    return 0;
+}
+
+int lpm_lookup(const lpm_t *lpm, uint32_t addr) {
+    if (!lpm->root) {
+        return LPM_NO_MATCH;
+    }
+
+    uint32_t entry = lpm->root[addr >> 16];
+    if (entry & LPM_TABLE) {
+        entry = lpm->tables[(entry & ~LPM_TABLE) * LPM_TABLE_ENTRIES + ((addr >> 8) & 0xff)];
+        if (entry & LPM_TABLE) {
+            entry = lpm->tables[(entry & ~LPM_TABLE) * LPM_TABLE_ENTRIES + (addr & 0xff)];
+        }
+    }
+
+    return (int)entry - 1;
+}
+
+static int prefix_cmp(const void *a, const void *b) {
+    const lpm_prefix_t *prefix_a = a;
+    const lpm_prefix_t *prefix_b = b;
+
+    if (prefix_a->len != prefix_b->len) {
+        return (int)prefix_a->len - (int)prefix_b->len;
+    }
+
+    return prefix_a->addr < prefix_b->addr ? -1 : prefix_a->addr > prefix_b->addr;
+}
+
+// returns the entry pointing to a new table with every entry set to fill
+static uint32_t add_table(lpm_t *lpm, uint32_t fill) {
+    if (lpm->tables_count == lpm->tables_capacity) {
+        lpm->tables_capacity = lpm->tables_capacity ? lpm->tables_capacity * 2 : 16;
+        lpm->tables = realloc(lpm->tables,
+                              sizeof(uint32_t) * LPM_TABLE_ENTRIES * lpm->tables_capacity);
+        if (!lpm->tables) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    uint32_t *table = lpm->tables + lpm->tables_count * LPM_TABLE_ENTRIES;
+    for (int i = 0; i < LPM_TABLE_ENTRIES; i++) {
+        table[i] = fill;
+    }
+
+    return LPM_TABLE | lpm->tables_count++;
+}
+
+static void insert(lpm_t *lpm, const lpm_prefix_t *prefix) {
+    uint32_t value = prefix->value + 1;
+
+    if (prefix->len <= 16) {
+        uint32_t first = prefix->addr >> 16;
+        for (uint32_t i = 0; i < 1u << (16 - prefix->len); i++) {
+            lpm->root[first + i] = value;
+        }
+        return;
+    }
+
+    uint32_t *root_entry = &lpm->root[prefix->addr >> 16];
+    if (!(*root_entry & LPM_TABLE)) {
+        *root_entry = add_table(lpm, *root_entry);
+    }
+
+    // add_table may move the tables, so they are indexed rather than pointed into
+    uint32_t middle_i = (*root_entry & ~LPM_TABLE) * LPM_TABLE_ENTRIES;
+    middle_i += (prefix->addr >> 8) & 0xff;
+    if (prefix->len <= 24) {
+        for (uint32_t i = 0; i < 1u << (24 - prefix->len); i++) {
+            lpm->tables[middle_i + i] = value;
+        }
+        return;
+    }
+
+    if (!(lpm->tables[middle_i] & LPM_TABLE)) {
+        uint32_t table = add_table(lpm, lpm->tables[middle_i]);
+        lpm->tables[middle_i] = table;
+    }
+
+    uint32_t last_i = (lpm->tables[middle_i] & ~LPM_TABLE) * LPM_TABLE_ENTRIES;
+    last_i += prefix->addr & 0xff;
+    for (uint32_t i = 0; i < 1u << (32 - prefix->len); i++) {
+        lpm->tables[last_i + i] = value;
+    }
+}
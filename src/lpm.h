@@ -0,0 +1,38 @@
+#ifndef DNSPROXY_LPM_H
+#define DNSPROXY_LPM_H
+
+#include <stdint.h>
+
+#define LPM_NO_MATCH -1
+#define LPM_TABLE 0x80000000u // the entry is the index of the next level table
+
+typedef struct {
+    uint32_t addr;
+    uint8_t len;
+    int value;
+} lpm_prefix_t;
+
+// longest prefix match over IPv4 addresses in three levels indexed by 16, 8 and 8 bits of the
+// address, prefixes are expanded into every entry they cover so a lookup is at most three loads
+typedef struct {
+    lpm_prefix_t *prefixes; // collected by lpm_add until lpm_compile
+    int prefixes_count;
+    int prefixes_capacity;
+
+    uint32_t *root;   // by the top 16 bits, value + 1 or LPM_TABLE | table, 0 if no prefix
+    uint32_t *tables; // 256 entries each, same encoding
+    uint32_t tables_count;
+    uint32_t tables_capacity;
+} lpm_t;
+
+void lpm_init(lpm_t *lpm);
+void lpm_free(lpm_t *lpm);
+
+// prefix is "address/length" or a single address, value is returned by lpm_lookup
+int lpm_add(lpm_t *lpm, const char *prefix, int value);
+int lpm_compile(lpm_t *lpm);
+
+// addr is in host order, returns the value of the longest matching prefix or LPM_NO_MATCH
+int lpm_lookup(const lpm_t *lpm, uint32_t addr);
+
+#endif
@@ -5,60 +5,254 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <signal.h>
 #include <time.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/random.h>
 #include <toml.h>
-#include <ctype.h>
 
 #include "dns.h"
-
+#include "hash.h"
+#include "hugepage.h"
+#include "blacklist.h"
+#include "cache.h"
+#include "shmcache.h"
+#include "policy.h"
+#include "qsbr.h"
+#include "watch.h"
+
+#define CONFIG_PATH "config.toml"
 #define DNS_PORT 53
+#define MAIN_WORKER 0
+#define RELOAD_SETTLE_MS 100
 #define UDP_MESSAGE_LIMIT 512
 #define BUFFER_SIZE UDP_MESSAGE_LIMIT
 #define REQUEST_EXPIRES_AFTER 2000
+#define DEFAULT_MAX_IN_FLIGHT 32768
+#define DEFAULT_BACKLOG_SIZE 256
+#define BACKLOG_WAIT 500 // ms a query waits for a free slot before it is shed
+#define PROBE_INTERVAL 100 // ms between checks for ejected upstreams due for a probe
+#define REQUEST_BATCH 64 // client queries read per wakeup, answers are drained first
+#define STRAY_REPORT_INTERVAL 10000 // ms between reports of answers from unknown sources
+#define DEFAULT_CACHE_SIZE 10000
+#define DEFAULT_CACHE_MEMORY (8 << 20)
+#define DEFAULT_CACHE_SNAPSHOT_INTERVAL 300
+#define DEFAULT_CACHE_STALE_REFRESH 60
+#define DEFAULT_CACHE_SERVE_STALE 86400
+#define DEFAULT_CACHE_PREFETCH_HITS 10
+#define DEFAULT_SHARED_CACHE_MEMORY (64 << 20)
+#define DEFAULT_PEER_TIMEOUT 200
+#define DEFAULT_UPSTREAM_SOCKETS 4
+#define LISTEN_SOCKET 0 // index in ctx.sockets, peers are asked from it
+#define ID_ATTEMPTS 16  // random socket and id pairs tried before a query is given up
 
 typedef struct {
     struct sockaddr_in addr;
     socklen_t addr_len;
-    uint16_t id;
+    int socket;         // index in ctx.sockets the query went out from
+    uint16_t id;        // random id the query went out with
+    uint16_t client_id; // id of the client query, restored in the answer
+    uint64_t question;  // hash of the cache key of the query, 0 if it has none
+    struct sockaddr_in upstream_addr;
     uint64_t expiration_time;
-
+    char refresh; // refreshes an expired cache entry, nobody waits for the answer
+    char peer;    // asked the peer owning the name, goes upstream if the peer fails
+    char probe;   // checks if an ejected upstream or peer is back, nobody waits for the answer
+    char *query;  // copy of the client query if a stale cache entry or the upstream may need it
+    size_t query_len;
+    int hash_next; // next request of the bucket, or next free slot
+    int expiry_prev;
+    int expiry_next;
 } queued_request_t;
 
+// requests to upstreams and to peers expire after fixed times, so each list stays sorted by
+// expiration when requests are appended
+enum { EXPIRY_UPSTREAM, EXPIRY_PEER, EXPIRY_LISTS };
+
+typedef struct {
+    int head; // expires first
+    int tail;
+} expiry_list_t;
+
+// upstream sockets are connect()ed, so the kernel drops answers from anyone else
+typedef struct {
+    int fd;                  // -1 in the groups of closed sockets, which are reused
+    struct sockaddr_in addr; // upstream the socket is connected to
+    uint64_t retire_at;      // in the first of a group, closed after it unless an upstream has it
+} upstream_socket_t;
+
+// lower goes first, a peer asks for the share of the whole fleet and gives up sooner
+enum { BACKLOG_PEER, BACKLOG_CLIENT };
+
+// a query waiting for an upstream with room for it
+typedef struct {
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    int forward;
+    int priority;
+    uint64_t deadline; // ms since epoch, shed with SERVFAIL after
+    char *query;
+    size_t query_len;
+} backlog_entry_t;
+
 typedef struct {
     int sock_fd;
+    upstream_socket_t *sockets; // the listening socket, then upstream_sockets per upstream
+    struct pollfd *poll_fds;    // one per socket
+    int sockets_count;
+    int sockets_capacity;
     char *buffer;
-    char is_running;
-    struct sockaddr_in external_dns_addr;
-    queued_request_t *queue;
+    char *response_buffer;
+    volatile sig_atomic_t is_running;
+    queued_request_t *queue; // preallocated pool of max_in_flight pending requests
     int queue_size;
+    int queue_free;     // first free slot, linked through hash_next
+    int *queue_buckets; // pending requests by socket and id
+    uint32_t queue_buckets_mask;
+    expiry_list_t expiry[EXPIRY_LISTS];
+    size_t queue_mapped;
+    hugepage_backing_t queue_backing;
+    backlog_entry_t *backlog; // backlog_size entries
+    int backlog_count;
+    uint64_t random; // state of the generator of query ids
+    uint64_t next_probe_time;
+    unsigned long stray_answers; // answers from unknown sources since the last report
+    uint64_t next_stray_report;
+    cache_t cache;
+    shmcache_t shared_cache;
+    reply_scratch_t reply_scratch;
+    uint64_t next_snapshot_time;
+    pid_t snapshot_pid;
+    _Atomic(policy_t *) policy;
+    qsbr_t qsbr;
+    pthread_t reload_thread;
+    int reload_stop_fd;
 } server_ctx_t;
 
 static server_ctx_t ctx;
 
-static char **blacklist;
-static int blacklist_len;
-static char *external_dns_server;
-static uint8_t refuse_r_code;
+static uint16_t listen_port = DNS_PORT;
+static int cache_size = DEFAULT_CACHE_SIZE;
+static char *cache_file;
+static int cache_snapshot_interval = DEFAULT_CACHE_SNAPSHOT_INTERVAL;
+static int cache_stale_refresh = DEFAULT_CACHE_STALE_REFRESH;
+static int cache_serve_stale = DEFAULT_CACHE_SERVE_STALE;
+static int cache_prefetch_hits = DEFAULT_CACHE_PREFETCH_HITS;
+static int cache_sketch_width; // defaults to cache_size
+static size_t cache_memory = DEFAULT_CACHE_MEMORY;
+static char *shared_cache;
+static size_t shared_cache_memory = DEFAULT_SHARED_CACHE_MEMORY;
+static int peer_timeout = DEFAULT_PEER_TIMEOUT;
+static int max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+static int backlog_size = DEFAULT_BACKLOG_SIZE;
+static int upstream_sockets = DEFAULT_UPSTREAM_SOCKETS;
 
 static int load_config();
+static toml_table_t *parse_config();
 
 static int init_context();
 static int init_server();
 static void run_server();
 static void cleanup_server();
-
-static void process_request();
-static char is_domain_allowed(domain_t *domain);
-
-static void queue_add_request(server_ctx_t *ctx, queued_request_t *request);
-static int queue_index_from_id(server_ctx_t *ctx, uint16_t id);
+static void handle_stop_signal(int sig);
+
+static int start_reload_thread();
+static void stop_reload_thread();
+static void *reload_main(void *arg);
+static void reload_policy(watch_t *watch);
+static void report_restart_settings(toml_table_t *conf);
+static void watch_policy_files(watch_t *watch, const policy_t *policy);
+
+static void snapshot_cache(uint64_t now);
+static void reap_snapshot(char wait);
+
+static void drain_requests();
+static void drain_responses(int socket);
+static void process_request(const struct sockaddr_in *client_addr,
+                            socklen_t client_addr_len,
+                            size_t buffer_size);
+static void process_response(int socket, size_t buffer_size);
+static void report_stray_answers(uint64_t now);
+static void process_answer(policy_t *policy, queued_request_t *request, size_t buffer_size);
+static void send_reply(const policy_t *policy,
+                       reply_kind_t kind,
+                       size_t question_len,
+                       const struct sockaddr_in *addr,
+                       socklen_t addr_len);
+
+static void send_block_reply(const policy_t *policy,
+                             size_t question_len,
+                             const struct sockaddr_in *addr,
+                             socklen_t addr_len);
+static void send_cached(policy_t *policy,
+                        const cache_entry_t *entry,
+                        size_t query_len,
+                        size_t question_len,
+                        const struct sockaddr_in *addr,
+                        socklen_t addr_len,
+                        uint64_t now);
+static char send_stale(policy_t *policy, const queued_request_t *request, uint64_t now);
+static cache_entry_t *lookup_shared_cache(const uint8_t *key,
+                                          size_t key_len,
+                                          cache_entry_t *entry,
+                                          uint64_t now);
+static const struct sockaddr_in *select_upstream(policy_t *policy,
+                                                 int forward,
+                                                 const char *query,
+                                                 size_t query_len,
+                                                 char replacing,
+                                                 char *full);
+static const struct sockaddr_in *select_peer(const policy_t *policy,
+                                             const uint8_t *qname,
+                                             size_t qname_len,
+                                             const struct sockaddr_in *client);
+static char send_upstream_instead(policy_t *policy, queued_request_t *request, uint64_t now);
+static void send_refresh(policy_t *policy, int forward, size_t query_len, uint64_t now);
+static int send_query(const struct sockaddr_in *upstream_addr,
+                      char peer,
+                      char *query,
+                      size_t query_len,
+                      queued_request_t *request);
+static int socket_group(const struct sockaddr_in *upstream_addr);
+static int find_socket_group(const struct sockaddr_in *upstream_addr);
+static int open_socket_group(const struct sockaddr_in *upstream_addr);
+static void close_retired_groups(uint64_t now);
+static int add_socket(int fd, const struct sockaddr_in *addr);
+static uint64_t question_hash(const uint8_t *key, size_t key_len);
+static uint64_t next_random();
+static upstreams_t *adopted_upstreams(policy_t *policy);
+static void record_outcome(policy_t *policy,
+                           const struct sockaddr_in *addr,
+                           char ok,
+                           uint64_t now);
+static void probe_upstreams(uint64_t now);
+static char send_probe(const struct sockaddr_in *upstream_addr, char peer, uint64_t now);
+static char backlog_add(policy_t *policy,
+                        const struct sockaddr_in *addr,
+                        socklen_t addr_len,
+                        int forward,
+                        size_t query_len,
+                        uint64_t now);
+static void drain_backlog(uint64_t now);
+static void shed_entry(policy_t *policy, backlog_entry_t *entry);
+
+static void queue_add_request(server_ctx_t *ctx, const queued_request_t *request);
+static queued_request_t *queue_find(server_ctx_t *ctx, int socket, uint16_t id);
 static void queue_delete_expired(server_ctx_t *ctx);
-static void queue_delete_by_id(server_ctx_t *ctx, uint16_t id);
+static void queue_delete(server_ctx_t *ctx, queued_request_t *request);
+static char same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b);
+static uint32_t queue_bucket(const server_ctx_t *ctx, int socket, uint16_t id);
 
 static uint64_t get_time_ms();
-static void str_to_lower(char *str);
 
 int main() {
+    ctx.sock_fd = -1;
+    ctx.reload_stop_fd = -1;
+
     int ret = load_config();
     if (ret) {
         fprintf(stderr, "failed to load config file\n");
@@ -81,74 +275,204 @@ int main() {
 }
 
 static int load_config() {
-    FILE *fp = fopen("config.toml", "r");
-    if (!fp) {
-        fprintf(stderr, "failed to open config file\n");
+    toml_table_t *conf = parse_config();
+    if (!conf) {
         return -1;
     }
 
-    char error_buffer[200];
-    toml_table_t *conf = toml_parse_file(fp, error_buffer, sizeof(error_buffer));
-    if (!conf) {
-        fprintf(stderr, "failed to parse config file\n");
-        return -1;
+    // the blacklist image is built by policy_load, so this comes first
+    toml_datum_t huge_pages_toml = toml_bool_in(conf, "huge_pages");
+    if (huge_pages_toml.ok) {
+        hugepage_set_enabled(huge_pages_toml.u.b);
     }
 
-    toml_datum_t dns_server_toml = toml_string_in(conf, "dns_server");
-    if (!dns_server_toml.ok) {
-        fprintf(stderr, "failed to parse dns_server field\n");
+    policy_t *policy = policy_load(conf);
+    if (!policy) {
         toml_free(conf);
         return -1;
     }
+    atomic_init(&ctx.policy, policy);
 
-    external_dns_server = dns_server_toml.u.s;
+    toml_datum_t listen_port_toml = toml_int_in(conf, "listen_port");
+    if (listen_port_toml.ok) {
+        if (listen_port_toml.u.i <= 0 || listen_port_toml.u.i > 65535) {
+            fprintf(stderr, "listen_port should be in range [1, 65535]\n");
+            toml_free(conf);
+            return -1;
+        }
+        listen_port = listen_port_toml.u.i;
+    }
 
-    toml_array_t *blacklist_toml = toml_array_in(conf, "blacklist");
-    if (!blacklist_toml) {
-        fprintf(stderr, "failed to parse blacklist field\n");
-        toml_free(conf);
-        return -1;
+    toml_datum_t cache_size_toml = toml_int_in(conf, "cache_size");
+    if (cache_size_toml.ok) {
+        if (cache_size_toml.u.i < 0 || cache_size_toml.u.i > 100000000) {
+            fprintf(stderr, "cache_size should be in range [0, 100000000]\n");
+            toml_free(conf);
+            return -1;
+        }
+        cache_size = cache_size_toml.u.i;
     }
 
-    int len = toml_array_nelem(blacklist_toml);
-    blacklist = malloc(sizeof(char *) * len);
-    for (int i = 0; i < len; i++) {
-        toml_datum_t domain = toml_string_at(blacklist_toml, i);
-        if (!domain.ok) {
-            fprintf(stderr, "failed to parse blacklist field\n");
+    toml_datum_t cache_memory_toml = toml_int_in(conf, "cache_memory");
+    if (cache_memory_toml.ok) {
+        if (cache_memory_toml.u.i < CACHE_SLAB_PAGE || cache_memory_toml.u.i > (1ll << 40)) {
+            fprintf(stderr,
+                    "cache_memory should be in range [%d, %lld]\n",
+                    CACHE_SLAB_PAGE,
+                    1ll << 40);
             toml_free(conf);
             return -1;
         }
+        cache_memory = cache_memory_toml.u.i;
+    }
 
-        str_to_lower(domain.u.s);
-        blacklist[i] = domain.u.s;
-        blacklist_len++;
+    toml_datum_t cache_sketch_width_toml = toml_int_in(conf, "cache_sketch_width");
+    if (cache_sketch_width_toml.ok) {
+        if (cache_sketch_width_toml.u.i < 0 || cache_sketch_width_toml.u.i > 100000000) {
+            fprintf(stderr, "cache_sketch_width should be in range [0, 100000000]\n");
+            toml_free(conf);
+            return -1;
+        }
+        cache_sketch_width = cache_sketch_width_toml.u.i;
     }
 
-    toml_datum_t refuse_r_code_toml = toml_int_in(conf, "refuse_r_code");
-    if (!refuse_r_code_toml.ok) {
-        fprintf(stderr, "failed to parse refuse_r_code field\n");
-        toml_free(conf);
-        return -1;
-    } else if (refuse_r_code_toml.u.i <= 0 || refuse_r_code_toml.u.i > 5) {
-        fprintf(stderr, "refuse_r_code should be in range [1, 5]\n");
-        toml_free(conf);
-        return -1;
+    toml_datum_t cache_file_toml = toml_string_in(conf, "cache_file");
+    if (cache_file_toml.ok) {
+        cache_file = cache_file_toml.u.s;
+    }
+
+    toml_datum_t cache_snapshot_interval_toml = toml_int_in(conf, "cache_snapshot_interval");
+    if (cache_snapshot_interval_toml.ok) {
+        if (cache_snapshot_interval_toml.u.i < 0) {
+            fprintf(stderr, "cache_snapshot_interval should not be negative\n");
+            toml_free(conf);
+            return -1;
+        }
+        cache_snapshot_interval = cache_snapshot_interval_toml.u.i;
+    }
+
+    toml_datum_t cache_stale_refresh_toml = toml_int_in(conf, "cache_stale_refresh");
+    if (cache_stale_refresh_toml.ok) {
+        if (cache_stale_refresh_toml.u.i < 0 || cache_stale_refresh_toml.u.i > CACHE_MAX_TTL) {
+            fprintf(stderr, "cache_stale_refresh should be in range [0, %d]\n", CACHE_MAX_TTL);
+            toml_free(conf);
+            return -1;
+        }
+        cache_stale_refresh = cache_stale_refresh_toml.u.i;
+    }
+
+    toml_datum_t cache_serve_stale_toml = toml_int_in(conf, "cache_serve_stale");
+    if (cache_serve_stale_toml.ok) {
+        if (cache_serve_stale_toml.u.i < 0 || cache_serve_stale_toml.u.i > 7 * CACHE_MAX_TTL) {
+            fprintf(stderr, "cache_serve_stale should be in range [0, %d]\n", 7 * CACHE_MAX_TTL);
+            toml_free(conf);
+            return -1;
+        }
+        cache_serve_stale = cache_serve_stale_toml.u.i;
+    }
+
+    toml_datum_t cache_prefetch_hits_toml = toml_int_in(conf, "cache_prefetch_hits");
+    if (cache_prefetch_hits_toml.ok) {
+        if (cache_prefetch_hits_toml.u.i < 0 || cache_prefetch_hits_toml.u.i > 1000000) {
+            fprintf(stderr, "cache_prefetch_hits should be in range [0, 1000000]\n");
+            toml_free(conf);
+            return -1;
+        }
+        cache_prefetch_hits = cache_prefetch_hits_toml.u.i;
+    }
+
+    toml_datum_t max_in_flight_toml = toml_int_in(conf, "max_in_flight");
+    if (max_in_flight_toml.ok) {
+        if (max_in_flight_toml.u.i < 1 || max_in_flight_toml.u.i > 1000000) {
+            fprintf(stderr, "max_in_flight should be in range [1, 1000000]\n");
+            toml_free(conf);
+            return -1;
+        }
+        max_in_flight = max_in_flight_toml.u.i;
+    }
+
+    toml_datum_t backlog_size_toml = toml_int_in(conf, "backlog_size");
+    if (backlog_size_toml.ok) {
+        if (backlog_size_toml.u.i < 0 || backlog_size_toml.u.i > 65536) {
+            fprintf(stderr, "backlog_size should be in range [0, 65536]\n");
+            toml_free(conf);
+            return -1;
+        }
+        backlog_size = backlog_size_toml.u.i;
+    }
+
+    toml_datum_t upstream_sockets_toml = toml_int_in(conf, "upstream_sockets");
+    if (upstream_sockets_toml.ok) {
+        if (upstream_sockets_toml.u.i < 1 || upstream_sockets_toml.u.i > 64) {
+            fprintf(stderr, "upstream_sockets should be in range [1, 64]\n");
+            toml_free(conf);
+            return -1;
+        }
+        upstream_sockets = upstream_sockets_toml.u.i;
+    }
+
+    toml_datum_t peer_timeout_toml = toml_int_in(conf, "peer_timeout");
+    if (peer_timeout_toml.ok) {
+        if (peer_timeout_toml.u.i < 1 || peer_timeout_toml.u.i > REQUEST_EXPIRES_AFTER) {
+            fprintf(stderr, "peer_timeout should be in range [1, %d]\n", REQUEST_EXPIRES_AFTER);
+            toml_free(conf);
+            return -1;
+        }
+        peer_timeout = peer_timeout_toml.u.i;
     }
 
-    refuse_r_code = refuse_r_code_toml.u.i;
+    toml_datum_t shared_cache_toml = toml_string_in(conf, "shared_cache");
+    if (shared_cache_toml.ok) {
+        shared_cache = shared_cache_toml.u.s;
+    }
+
+    toml_datum_t shared_cache_memory_toml = toml_int_in(conf, "shared_cache_memory");
+    if (shared_cache_memory_toml.ok) {
+        if (shared_cache_memory_toml.u.i < (1 << 20) ||
+            shared_cache_memory_toml.u.i > (1ll << 40)) {
+            fprintf(stderr,
+                    "shared_cache_memory should be in range [%d, %lld]\n",
+                    1 << 20,
+                    1ll << 40);
+            toml_free(conf);
+            return -1;
+        }
+        shared_cache_memory = shared_cache_memory_toml.u.i;
+    }
 
     printf("config file successfully loaded\n");
-    printf("external dns server: %s\n", external_dns_server);
-    printf("blacklist:\n");
-    for (int i = 0; i < blacklist_len; i++) {
-        printf("    %s\n", blacklist[i]);
+    printf("listen port: %d\n", listen_port);
+    printf("cache size: %d\n", cache_size);
+    printf("cache memory: %zu bytes\n", cache_memory);
+    if (cache_file) {
+        printf("cache file: %s\n", cache_file);
+    }
+    if (shared_cache) {
+        printf("shared cache: %s, %zu bytes\n", shared_cache, shared_cache_memory);
     }
 
-    free(conf);
+    toml_free(conf);
     return 0;
 }
 
+static toml_table_t *parse_config() {
+    FILE *fp = fopen(CONFIG_PATH, "r");
+    if (!fp) {
+        fprintf(stderr, "failed to open config file\n");
+        return 0;
+    }
+
+    char error_buffer[200];
+    toml_table_t *conf = toml_parse_file(fp, error_buffer, sizeof(error_buffer));
+    fclose(fp);
+    if (!conf) {
+        fprintf(stderr, "failed to parse config file: %s\n", error_buffer);
+        return 0;
+    }
+
+    return conf;
+}
+
 static int init_context() {
     ctx.sock_fd = -1;
     ctx.buffer = malloc(BUFFER_SIZE);
@@ -157,15 +481,94 @@ static int init_context() {
         return -1;
     }
 
-    ctx.is_running = 0;
+    ctx.response_buffer = malloc(BUFFER_SIZE);
+    if (!ctx.response_buffer) {
+        fprintf(stderr, "failed to allocate buffer\n");
+        return -1;
+    }
 
-    memset(&ctx.external_dns_addr, 0, sizeof(ctx.external_dns_addr));
-    ctx.external_dns_addr.sin_family = AF_INET;
-    ctx.external_dns_addr.sin_port = htons(DNS_PORT);
-    inet_pton(AF_INET, external_dns_server, &ctx.external_dns_addr.sin_addr);
+    ctx.is_running = 0;
 
-    ctx.queue = 0;
+    for (int i = 0; i < EXPIRY_LISTS; i++) {
+        ctx.expiry[i].head = -1;
+        ctx.expiry[i].tail = -1;
+    }
+    ctx.queue_mapped = sizeof(queued_request_t) * max_in_flight;
+    ctx.queue = hugepage_alloc(&ctx.queue_mapped, 0, &ctx.queue_backing);
+    if (!ctx.queue) {
+        fprintf(stderr, "failed to allocate request queue\n");
+        return -1;
+    }
     ctx.queue_size = 0;
+    for (int i = 0; i < max_in_flight; i++) {
+        ctx.queue[i].hash_next = i + 1 < max_in_flight ? i + 1 : -1;
+    }
+    ctx.queue_free = 0;
+
+    uint32_t buckets_count = 1;
+    while (buckets_count < (uint32_t)max_in_flight) {
+        buckets_count <<= 1;
+    }
+    ctx.queue_buckets = malloc(sizeof(int) * buckets_count);
+    if (!ctx.queue_buckets) {
+        fprintf(stderr, "failed to allocate request queue\n");
+        return -1;
+    }
+    memset(ctx.queue_buckets, -1, sizeof(int) * buckets_count);
+    ctx.queue_buckets_mask = buckets_count - 1;
+
+    // query ids are what stops off-path spoofing, so they must not be guessable
+    if (getrandom(&ctx.random, sizeof(ctx.random), 0) != sizeof(ctx.random)) {
+        fprintf(stderr, "getrandom failed with: %s\n", strerror(errno));
+        return -1;
+    }
+
+    ctx.backlog = malloc(sizeof(backlog_entry_t) * (backlog_size ? backlog_size : 1));
+    if (!ctx.backlog) {
+        fprintf(stderr, "failed to allocate request backlog\n");
+        return -1;
+    }
+    ctx.backlog_count = 0;
+
+    cache_config_t cache_config;
+    cache_config.expected_size = cache_size;
+    cache_config.memory = cache_memory;
+    cache_config.sketch_width = cache_sketch_width ? cache_sketch_width : cache_size;
+    cache_config.max_stale = cache_serve_stale > cache_stale_refresh ? cache_serve_stale
+                                                                     : cache_stale_refresh;
+    cache_config.prefetch_hits = cache_prefetch_hits;
+    cache_config.max_message_len = BUFFER_SIZE; // cached answers are built in response_buffer
+    if (cache_init(&ctx.cache, &cache_config)) {
+        fprintf(stderr, "failed to initialize cache\n");
+        return -1;
+    }
+
+    if (shared_cache && cache_size > 0 &&
+        shmcache_open(
+            &ctx.shared_cache, shared_cache, shared_cache_memory, cache_config.max_stale)) {
+        fprintf(stderr, "failed to open shared cache\n");
+        return -1;
+    }
+
+    if (hugepage_enabled()) {
+        printf("request queue: %zu bytes on %s\n",
+               ctx.queue_mapped,
+               hugepage_backing_name(ctx.queue_backing));
+        if (ctx.cache.arena) {
+            printf("cache arena: %zu bytes on %s\n",
+                   ctx.cache.arena_mapped,
+                   hugepage_backing_name(ctx.cache.arena_backing));
+        }
+    }
+
+    if (cache_file && cache_size > 0 && cache_load(&ctx.cache, cache_file, get_time_ms())) {
+        fprintf(stderr, "ignoring cache file %s\n", cache_file);
+    }
+
+    ctx.next_snapshot_time = get_time_ms() + (uint64_t)cache_snapshot_interval * 1000;
+    ctx.snapshot_pid = -1;
+
+    qsbr_init(&ctx.qsbr, 1);
 
     return 0;
 }
@@ -187,7 +590,7 @@ static int init_server() {
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(DNS_PORT);
+    server_addr.sin_port = htons(listen_port);
 
     ret = bind(ctx.sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
     if (ret) {
@@ -195,6 +598,8 @@ static int init_server() {
         return -1;
     }
 
+    add_socket(ctx.sock_fd, &server_addr);
+
     printf("server successfully initialized\n");
 
     return 0;
@@ -203,280 +608,1455 @@ static int init_server() {
 static void run_server() {
     ctx.is_running = 1;
 
-    struct pollfd poll_fd;
-    poll_fd.fd = ctx.sock_fd;
-    poll_fd.events = POLLIN;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+
+    if (start_reload_thread()) {
+        fprintf(stderr, "config reload is disabled\n");
+    }
 
     printf("server is running\n");
 
     while (ctx.is_running) {
-        int ret = poll(&poll_fd, 1, 100);
-        if (ret < 0) {
+        // the policy is only referenced while processing, sleeping in poll is quiescent
+        qsbr_offline(&ctx.qsbr, MAIN_WORKER);
+        int ret = poll(ctx.poll_fds, ctx.sockets_count, 100);
+        qsbr_online(&ctx.qsbr, MAIN_WORKER);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
             fprintf(stderr, "poll failed with: %s", strerror(errno));
             ctx.is_running = 0;
             break;
         }
 
-        if (poll_fd.revents & POLLIN) {
-            process_request();
-        }
-
-        if (poll_fd.revents & (POLLERR | POLLHUP)) {
+        if (ctx.poll_fds[LISTEN_SOCKET].revents & (POLLERR | POLLHUP)) {
             fprintf(stderr, "socket error\n");
             ctx.is_running = 0;
             break;
         }
 
+        // answers go first, they free the slots that waiting and new queries need. an
+        // upstream refusing the port shows up as an error on its socket, reading it clears
+        // the error and the request times out like any other
+        for (int i = LISTEN_SOCKET + 1; i < ctx.sockets_count; i++) {
+            if (ctx.poll_fds[i].revents & (POLLIN | POLLERR)) {
+                drain_responses(i);
+            }
+        }
+
         queue_delete_expired(&ctx);
-    }
 
-    printf("server stopped\n");
-}
+        uint64_t now = get_time_ms();
+        if (ctx.backlog_count) {
+            drain_backlog(now);
+        }
 
-static void cleanup_server() {
-    if (blacklist) {
-        for (int i; i < blacklist_len; i++) {
-            free(blacklist);
+        if (ctx.poll_fds[LISTEN_SOCKET].revents & POLLIN) {
+            drain_requests();
+        }
+
+        if (ctx.stray_answers && now >= ctx.next_stray_report) {
+            report_stray_answers(now);
+        }
+        if (now >= ctx.next_probe_time) {
+            probe_upstreams(now);
+            close_retired_groups(now);
+            ctx.next_probe_time = now + PROBE_INTERVAL;
         }
 
-        free(blacklist);
+        if (cache_file && cache_snapshot_interval > 0 && now >= ctx.next_snapshot_time) {
+            snapshot_cache(now);
+            ctx.next_snapshot_time = now + (uint64_t)cache_snapshot_interval * 1000;
+        }
+        reap_snapshot(0);
     }
 
-    if (external_dns_server) {
-        free(external_dns_server);
+    qsbr_offline(&ctx.qsbr, MAIN_WORKER);
+    stop_reload_thread();
+
+    reap_snapshot(1);
+    if (cache_file && cache_size > 0) {
+        if (cache_save(&ctx.cache, cache_file, get_time_ms()) == 0) {
+            printf("cache saved to %s\n", cache_file);
+        }
     }
 
+    printf("server stopped\n");
+}
+
+static void cleanup_server() {
+    policy_free(atomic_load(&ctx.policy));
+    qsbr_free(&ctx.qsbr);
+
     if (ctx.sock_fd != -1) {
         close(ctx.sock_fd);
     }
 
+    for (int i = LISTEN_SOCKET + 1; i < ctx.sockets_count; i++) {
+        if (ctx.sockets[i].fd != -1) {
+            close(ctx.sockets[i].fd);
+        }
+    }
+    free(ctx.sockets);
+    free(ctx.poll_fds);
+
     if (ctx.buffer) {
         free(ctx.buffer);
         ctx.buffer = 0;
     }
 
-    if (ctx.queue) {
-        free(ctx.queue);
+    if (ctx.response_buffer) {
+        free(ctx.response_buffer);
+        ctx.response_buffer = 0;
     }
-}
 
-static void process_request() {
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+    cache_free(&ctx.cache);
+    shmcache_close(&ctx.shared_cache);
 
-    ssize_t buffer_size = recvfrom(ctx.sock_fd,
-                                   ctx.buffer,
-                                   UDP_MESSAGE_LIMIT,
-                                   0,
-                                   (struct sockaddr *)&client_addr,
-                                   &client_addr_len);
+    if (cache_file) {
+        free(cache_file);
+    }
 
-    if (buffer_size < (ssize_t)sizeof(dns_header_t)) {
-        return;
+    if (shared_cache) {
+        free(shared_cache);
     }
 
-    const dns_header_t *header = (const dns_header_t *)ctx.buffer;
-    offsetof(dns_header_t, flags);
-
-    if (DNS_GET_QR(header->flags) == 0) { // request
-        size_t offset = sizeof(dns_header_t);
-
-        char request_allowed = 1;
-        for (int i = 0; i < ntohs(header->qd_count); i++) {
-            domain_t domain = parse_domain(ctx.buffer, &offset);
-            if (!is_domain_allowed(&domain)) {
-                request_allowed = 0;
-                free_domain(domain);
-                break;
+    if (ctx.queue) {
+        for (int i = 0; i < EXPIRY_LISTS; i++) {
+            for (int j = ctx.expiry[i].head; j != -1; j = ctx.queue[j].expiry_next) {
+                free(ctx.queue[j].query);
             }
-            free_domain(domain);
         }
+        hugepage_free(ctx.queue, ctx.queue_mapped);
+    }
+    free(ctx.queue_buckets);
 
-        if (request_allowed) {
-            int ret = sendto(ctx.sock_fd,
-                             ctx.buffer,
-                             buffer_size,
-                             0,
-                             (const struct sockaddr *)&ctx.external_dns_addr,
-                             sizeof(ctx.external_dns_addr));
-            if (ret < 0) {
-                fprintf(stderr, "sendto to external dns server failed with: %s", strerror(errno));
-                return;
-            }
-
-            queued_request_t request;
-            request.addr = client_addr;
-            request.addr_len = client_addr_len;
-            request.id = header->id;
-            request.expiration_time = get_time_ms() + REQUEST_EXPIRES_AFTER;
-            queue_add_request(&ctx, &request);
-        } else {
-            dns_header_t *refuse_header = create_dns_refuse_header(header->id, refuse_r_code);
-            int ret = sendto(ctx.sock_fd,
-                             refuse_header,
-                             sizeof(dns_header_t),
-                             0,
-                             (const struct sockaddr *)&client_addr,
-                             client_addr_len);
-            if (ret < 0) {
-                fprintf(stderr, "sendto to external dns server failed with: %s", strerror(errno));
-                free(refuse_header);
-                return;
-            }
-            free(refuse_header);
-        }
-    } else { // response
-        if (memcmp(&ctx.external_dns_addr, &client_addr, client_addr_len) != 0) {
-            printf("reponse from unauthorized\n");
-            return;
+    if (ctx.backlog) {
+        for (int i = 0; i < ctx.backlog_count; i++) {
+            free(ctx.backlog[i].query);
         }
+        free(ctx.backlog);
+    }
+}
 
-        int request_i = queue_index_from_id(&ctx, header->id);
-        if (request_i < 0) {
+// reads at most REQUEST_BATCH datagrams, so answers waiting on upstream sockets are not held
+// up by a flood of queries; poll returns right away for the rest
+static void drain_requests() {
+    for (int i = 0; i < REQUEST_BATCH; i++) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+
+        ssize_t buffer_size = recvfrom(ctx.sock_fd,
+                                       ctx.buffer,
+                                       UDP_MESSAGE_LIMIT,
+                                       MSG_DONTWAIT,
+                                       (struct sockaddr *)&client_addr,
+                                       &client_addr_len);
+        if (buffer_size < 0) {
             return;
         }
 
-        queued_request_t *request = &ctx.queue[request_i];
+        if (buffer_size >= (ssize_t)sizeof(dns_header_t)) {
+            process_request(&client_addr, client_addr_len, buffer_size);
+        }
+    }
+}
 
-        int ret = sendto(ctx.sock_fd,
-                         ctx.buffer,
-                         buffer_size,
-                         0,
-                         (const struct sockaddr *)&request->addr,
-                         request->addr_len);
-        if (ret < 0) {
-            fprintf(stderr, "sendto to client failed with: %s", strerror(errno));
+// answers on an upstream socket are bounded by the queries in flight to it, so the socket is
+// read until it is empty
+static void drain_responses(int socket) {
+    while (1) {
+        ssize_t buffer_size = recv(ctx.sockets[socket].fd, ctx.buffer, UDP_MESSAGE_LIMIT, 0);
+        if (buffer_size < 0) {
             return;
         }
 
-        queue_delete_by_id(&ctx, header->id);
+        if (buffer_size >= (ssize_t)sizeof(dns_header_t)) {
+            process_response(socket, buffer_size);
+        }
     }
 }
 
-static char is_domain_allowed(domain_t *domain) {
-    char *str = domain_to_str(domain);
-    str_to_lower(str);
+static void process_request(const struct sockaddr_in *client_addr,
+                            socklen_t client_addr_len,
+                            size_t buffer_size) {
+    policy_t *policy = atomic_load_explicit(&ctx.policy, memory_order_acquire);
 
-    for (int i = 0; i < blacklist_len; i++) {
-        if (strcmp(blacklist[i], str) == 0) {
-            free(str);
-            return 0;
+    const dns_header_t *header = (const dns_header_t *)ctx.buffer;
+
+    if (DNS_GET_QR(ntohs(header->flags)) == 0) { // request
+        size_t question_len;
+        if (dns_check_questions(ctx.buffer, buffer_size, &question_len)) {
+            send_reply(policy, REPLY_FORMERR, 0, client_addr, client_addr_len);
+            return;
         }
-    }
 
-    free(str);
-    return 1;
-}
+        const local_records_t *local_records = &policy->local_records;
+        if (local_records->names_count && ntohs(header->qd_count) == 1) {
+            uint8_t qname[DNS_MAX_NAME_LEN];
+            size_t qname_len;
+            size_t offset = sizeof(dns_header_t);
+            dns_read_name(ctx.buffer, buffer_size, &offset, qname, &qname_len);
+
+            const local_answer_t *answer = 0;
+            if (offset == sizeof(dns_header_t) + question_len - 4 &&
+                dns_read_u16(ctx.buffer, offset + 2) == DNS_CLASS_IN) {
+                uint16_t qtype = dns_read_u16(ctx.buffer, offset);
+                answer = local_records_lookup(local_records, qname, qname_len, qtype);
+            }
 
-static void queue_add_request(server_ctx_t *ctx, queued_request_t *request) {
-    if (ctx->queue_size == 0) {
-        ctx->queue_size++;
-        ctx->queue = malloc(sizeof(queued_request_t));
-        if (!ctx->queue) {
-            fprintf(stderr, "failed to allocate memory\n");
-            exit(-1);
-        }
-    } else {
-        ctx->queue_size++;
-        ctx->queue = realloc(ctx->queue, sizeof(queued_request_t) * ctx->queue_size);
-        if (!ctx->queue) {
-            fprintf(stderr, "failed to allocate memory\n");
-            exit(-1);
+            if (answer) {
+                int ret = reply_send_answer(ctx.sock_fd,
+                                            &ctx.reply_scratch,
+                                            ctx.buffer,
+                                            question_len,
+                                            answer->an_count,
+                                            local_records->data + answer->offset,
+                                            answer->len,
+                                            (const struct sockaddr *)client_addr,
+                                            client_addr_len);
+                if (ret < 0) {
+                    fprintf(stderr, "sendmsg to client failed with: %s", strerror(errno));
+                }
+                return;
+            }
         }
-    }
 
-    ctx->queue[ctx->queue_size - 1] = *request;
-}
+        int forward;
+        if (policy_allows_request(policy, client_addr, ctx.buffer, buffer_size, &forward)) {
+            uint64_t now = get_time_ms();
+            uint8_t key[CACHE_MAX_KEY_LEN];
+            size_t key_len;
+            cache_entry_t *stale = 0;
+            const struct sockaddr_in *peer_addr = 0;
+            if (ctx.cache.expected_size > 0 &&
+                cache_key_from_message(ctx.buffer, buffer_size, key, &key_len) == 0) {
+                cache_entry_t *entry = cache_lookup(&ctx.cache, key, key_len, now);
+                if (ctx.shared_cache.header && (!entry || entry->expires_at <= now)) {
+                    entry = lookup_shared_cache(key, key_len, entry, now);
+                }
+                if (entry && entry->expires_at + (uint64_t)cache_stale_refresh * 1000 > now) {
+                    send_cached(policy,
+                                entry,
+                                buffer_size,
+                                question_len,
+                                client_addr,
+                                client_addr_len,
+                                now);
+
+                    // recently expired entries are answered right away and refreshed behind,
+                    // popular ones are refreshed before they expire
+                    char refresh = entry->expires_at <= now
+                                       ? cache_claim_refresh(entry, now, REQUEST_EXPIRES_AFTER)
+                                       : cache_claim_prefetch(
+                                             &ctx.cache, entry, now, REQUEST_EXPIRES_AFTER);
+                    if (refresh) {
+                        send_refresh(policy, forward, buffer_size, now);
+                    }
+                    return;
+                }
+
+                if (entry && entry->expires_at + (uint64_t)cache_serve_stale * 1000 > now) {
+                    stale = entry;
+                }
+
+                // every name is resolved and cached by the peer owning it, so the fleet asks
+                // upstream once per name
+                if (forward == TRIE_NO_FORWARD) {
+                    peer_addr = select_peer(policy, key, key_len - 4, client_addr);
+                }
+            }
 
-static int queue_index_from_id(server_ctx_t *ctx, uint16_t id) {
-    for (int i = 0; i < ctx->queue_size; i++) {
-        if (ctx->queue[i].id == id) {
-            return i;
-        }
-    }
+            char full = 0;
+            const struct sockaddr_in *upstream_addr =
+                peer_addr && ctx.queue_size < max_in_flight
+                    ? peer_addr
+                    : select_upstream(policy, forward, ctx.buffer, buffer_size, 0, &full);
 
-    return -1;
-}
+            // without a stale answer, the query waits for an upstream to make room
+            if (full && !stale &&
+                backlog_add(policy, client_addr, client_addr_len, forward, buffer_size, now)) {
+                return;
+            }
 
-static void queue_delete_expired(server_ctx_t *ctx) {
-    if (ctx->queue_size == 0) {
-        return;
-    }
+            // a query shed from the backlog or for a pool without healthy upstreams is
+            // answered like a failing upstream
+            queued_request_t request;
+            memset(&request, 0, sizeof(request));
+            int ret = -1;
+            if (upstream_addr) {
+                ret = send_query(
+                    upstream_addr, upstream_addr == peer_addr, ctx.buffer, buffer_size, &request);
+            }
 
-    uint64_t cur_time = get_time_ms();
+            if (ret < 0) {
+                if (stale) {
+                    send_cached(policy,
+                                stale,
+                                buffer_size,
+                                question_len,
+                                client_addr,
+                                client_addr_len,
+                                now);
+                } else {
+                    send_reply(
+                        policy, REPLY_SERVFAIL, question_len, client_addr, client_addr_len);
+                }
+                return;
+            }
 
-    int write_i = 0;
-    char changed = 0;
-    for (int read_i = 0; read_i < ctx->queue_size; read_i++) {
-        if (ctx->queue[read_i].expiration_time > cur_time) { // keep element
-            ctx->queue[write_i] = ctx->queue[read_i];
-            write_i++;
+            request.addr = *client_addr;
+            request.addr_len = client_addr_len;
+            request.expiration_time = now + (request.peer ? peer_timeout : REQUEST_EXPIRES_AFTER);
+            if (stale || request.peer) {
+                request.query = malloc(buffer_size);
+                if (!request.query) {
+                    fprintf(stderr, "failed to allocate memory\n");
+                    exit(-1);
+                }
+                memcpy(request.query, ctx.buffer, buffer_size);
+                request.query_len = buffer_size;
+            }
+            queue_add_request(&ctx, &request);
         } else {
-            changed = 1;
+            send_block_reply(policy, question_len, client_addr, client_addr_len);
         }
+    } else { // answer from a peer, upstreams answer on sockets of their own
+        queued_request_t *request = queue_find(&ctx, LISTEN_SOCKET, header->id);
+        if (!request || !same_addr(&request->upstream_addr, client_addr)) {
+            // late answers of peers are expected, anything else is only counted here
+            if (upstreams_find(&policy->peers, client_addr) < 0) {
+                ctx.stray_answers++;
+            }
+            return;
+        }
+
+        process_answer(policy, request, buffer_size);
     }
+}
 
-    if (!changed) {
+static void process_response(int socket, size_t buffer_size) {
+    const dns_header_t *header = (const dns_header_t *)ctx.buffer;
+    if (DNS_GET_QR(ntohs(header->flags)) == 0) {
         return;
     }
 
-    ctx->queue_size = write_i;
-    if (ctx->queue_size == 0) {
-        free(ctx->queue);
-        ctx->queue = 0;
+    // answers that come after their request expired are dropped
+    queued_request_t *request = queue_find(&ctx, socket, header->id);
+    if (!request) {
         return;
     }
 
-    ctx->queue = realloc(ctx->queue, sizeof(queued_request_t) * ctx->queue_size);
-    if (!ctx->queue) {
-        fprintf(stderr, "failed to allocate memory\n");
-        exit(-1);
-    }
+    policy_t *policy = atomic_load_explicit(&ctx.policy, memory_order_acquire);
+    process_answer(policy, request, buffer_size);
 }
 
-static void queue_delete_by_id(server_ctx_t *ctx, uint16_t id) {
-    if (ctx->queue_size == 0) {
+// handles the answer in ctx.buffer and deletes its request. pending requests carry their
+// upstream, so answers from upstreams dropped by a reload are still delivered
+static void process_answer(policy_t *policy, queued_request_t *request, size_t buffer_size) {
+    // an answer to another question than the one asked would be cached under its own key and
+    // served to everyone asking it, so it is dropped and the request keeps waiting
+    uint8_t key[CACHE_MAX_KEY_LEN];
+    size_t key_len;
+    char has_key = cache_key_from_message(ctx.buffer, buffer_size, key, &key_len) == 0;
+    if (question_hash(has_key ? key : 0, key_len) != request->question) {
         return;
     }
 
-    int write_i = 0;
-    char changed = 0;
-    for (int read_i = 0; read_i < ctx->queue_size; read_i++) {
-        if (ctx->queue[read_i].id != id) { // keep element
-            ctx->queue[write_i] = ctx->queue[read_i];
-            write_i++;
-        } else {
-            changed = 1;
-        }
+    dns_header_t *header = (dns_header_t *)ctx.buffer;
+    struct sockaddr_in upstream_addr = request->upstream_addr;
+    uint8_t rcode = DNS_GET_RCODE(ntohs(header->flags));
+
+    // any answer shows the server is up, a SERVFAIL is about the name (a lame delegation, a
+    // failed DNSSEC validation) and only timeouts and failed sends count against the server
+    if (request->probe) {
+        uint64_t now = get_time_ms();
+        upstreams_probed(&policy->upstreams, &upstream_addr, 1, now);
+        upstreams_probed(&policy->peers, &upstream_addr, 1, now);
+        queue_delete(&ctx, request);
+        return;
     }
+    record_outcome(policy, &upstream_addr, 1, get_time_ms());
 
-    if (!changed) {
+    // a failing peer leaves the query to the upstream
+    if (request->peer && (rcode == DNS_RCODE_SERVFAIL || rcode == DNS_RCODE_REFUSED) &&
+        send_upstream_instead(policy, request, get_time_ms())) {
         return;
     }
 
-    ctx->queue_size = write_i;
-    if (ctx->queue_size == 0) {
-        free(ctx->queue);
-        ctx->queue = 0;
+    // a failing upstream is covered by the stale entry; send_stale reuses ctx.buffer,
+    // and failures are not cached
+    if (!request->refresh && (rcode == DNS_RCODE_SERVFAIL || rcode == DNS_RCODE_REFUSED) &&
+        send_stale(policy, request, get_time_ms())) {
+        queue_delete(&ctx, request);
         return;
     }
 
-    ctx->queue = realloc(ctx->queue, sizeof(queued_request_t) * ctx->queue_size);
-    if (!ctx->queue) {
-        fprintf(stderr, "failed to allocate memory\n");
-        exit(-1);
-    }
-}
+    // refreshes only update the cache, their client was answered from it already
+    if (!request->refresh) {
+        header->id = request->client_id;
 
-static uint64_t get_time_ms() {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        // answers are checked on their way to the client, so cached ones are checked
+        // again under the policy of whoever hits them
+        if (policy_allows_response(policy, &request->addr, ctx.buffer, buffer_size)) {
+            int ret = sendto(ctx.sock_fd,
+                             ctx.buffer,
+                             buffer_size,
+                             0,
+                             (const struct sockaddr *)&request->addr,
+                             request->addr_len);
+            if (ret < 0) {
+                fprintf(stderr, "sendto to client failed with: %s", strerror(errno));
+                return;
+            }
+        } else {
+            // the response echoes the question, so the block reply is built from it
+            size_t question_len;
+            if (dns_check_questions(ctx.buffer, buffer_size, &question_len)) {
+                question_len = 0;
+            }
+            send_block_reply(policy, question_len, &request->addr, request->addr_len);
+        }
+    }
+
+    queue_delete(&ctx, request);
+
+    if (ctx.cache.expected_size > 0 && has_key) {
+        uint64_t now = get_time_ms();
+        cache_store(&ctx.cache, key, key_len, ctx.buffer, buffer_size, now);
+        if (ctx.shared_cache.header) {
+            shmcache_store(&ctx.shared_cache, key, key_len, ctx.buffer, buffer_size, now);
+        }
+    }
+}
+
+static void report_stray_answers(uint64_t now) {
+    printf("dropped %lu answers from unknown sources\n", ctx.stray_answers);
+    ctx.stray_answers = 0;
+    ctx.next_stray_report = now + STRAY_REPORT_INTERVAL;
+}
+
+static void send_reply(const policy_t *policy,
+                       reply_kind_t kind,
+                       size_t question_len,
+                       const struct sockaddr_in *addr,
+                       socklen_t addr_len) {
+    int ret = reply_send(ctx.sock_fd,
+                         &policy->reply_templates.templates[kind],
+                         &ctx.reply_scratch,
+                         ctx.buffer,
+                         question_len,
+                         (const struct sockaddr *)addr,
+                         addr_len);
+    if (ret < 0) {
+        fprintf(stderr, "sendmsg to client failed with: %s", strerror(errno));
+    }
+}
+
+// question_len is 0 if the message in ctx.buffer has no usable question
+static void send_block_reply(const policy_t *policy,
+                             size_t question_len,
+                             const struct sockaddr_in *addr,
+                             socklen_t addr_len) {
+    reply_kind_t kind = REPLY_BLOCK;
+    if (question_len) {
+        uint16_t qtype = dns_read_u16(ctx.buffer, sizeof(dns_header_t) + question_len - 4);
+        kind = reply_block_kind(qtype);
+    }
+
+    send_reply(policy, kind, question_len, addr, addr_len);
+}
+
+// answers the query in ctx.buffer from the cache entry
+static void send_cached(policy_t *policy,
+                        const cache_entry_t *entry,
+                        size_t query_len,
+                        size_t question_len,
+                        const struct sockaddr_in *addr,
+                        socklen_t addr_len,
+                        uint64_t now) {
+    size_t len = cache_build_response(entry, ctx.buffer, query_len, ctx.response_buffer, now);
+    if (!policy_allows_response(policy, addr, ctx.response_buffer, len)) {
+        send_block_reply(policy, question_len, addr, addr_len);
+        return;
+    }
+
+    int ret = sendto(ctx.sock_fd,
+                     ctx.response_buffer,
+                     len,
+                     0,
+                     (const struct sockaddr *)addr,
+                     addr_len);
+    if (ret < 0) {
+        fprintf(stderr, "sendto to client failed with: %s", strerror(errno));
+    }
+}
+
+// answers a request whose upstream failed from its stale cache entry (rfc 8767), returns 0 if
+// the entry is gone
+static char send_stale(policy_t *policy, const queued_request_t *request, uint64_t now) {
+    if (!request->query) {
+        return 0;
+    }
+
+    memcpy(ctx.buffer, request->query, request->query_len);
+
+    size_t question_len;
+    uint8_t key[CACHE_MAX_KEY_LEN];
+    size_t key_len;
+    if (dns_check_questions(ctx.buffer, request->query_len, &question_len) ||
+        cache_key_from_message(ctx.buffer, request->query_len, key, &key_len)) {
+        return 0;
+    }
+
+    const cache_entry_t *entry = cache_lookup(&ctx.cache, key, key_len, now);
+    if (!entry || entry->expires_at + (uint64_t)cache_serve_stale * 1000 <= now) {
+        return 0;
+    }
+
+    send_cached(
+        policy, entry, request->query_len, question_len, &request->addr, request->addr_len, now);
+
+    return 1;
+}
+
+// returns 0 if no upstream of the pool can take the query, full is set if one could later.
+// replacing is set when the query takes over the slot of a pending request
+static const struct sockaddr_in *select_upstream(policy_t *policy,
+                                                 int forward,
+                                                 const char *query,
+                                                 size_t query_len,
+                                                 char replacing,
+                                                 char *full) {
+    upstreams_t *upstreams = adopted_upstreams(policy);
+    int pool = forward == TRIE_NO_FORWARD ? POLICY_DEFAULT_POOL : forward;
+
+    // hashed on the qname, so every type of a name meets the same upstream cache
+    int upstream;
+    uint8_t key[CACHE_MAX_KEY_LEN];
+    size_t key_len;
+    if (upstreams->hashed && cache_key_from_message(query, query_len, key, &key_len) == 0) {
+        upstream = upstreams_select_by_hash(upstreams, pool, hash_bytes(key, key_len - 4, 0));
+    } else {
+        upstream = upstreams_select(upstreams, pool);
+    }
+
+    int queued = ctx.queue_size - replacing;
+    *full = upstream == UPSTREAM_FULL || queued >= max_in_flight;
+    if (upstream < 0 || queued >= max_in_flight) {
+        return 0;
+    }
+
+    return &upstreams->upstreams[upstream].addr;
+}
+
+// the peer owning the name, or 0 if this node owns it or the query came from a peer
+static const struct sockaddr_in *select_peer(const policy_t *policy,
+                                             const uint8_t *qname,
+                                             size_t qname_len,
+                                             const struct sockaddr_in *client) {
+    const upstreams_t *peers = &policy->peers;
+    if (policy->peer_self < 0 || upstreams_find(peers, client) >= 0) {
+        return 0;
+    }
+
+    // names of an ejected peer go to the next one in their ranking
+    int owner = upstreams_rendezvous(peers, 0, hash_bytes(qname, qname_len, 0));
+    if (owner < 0 || owner == policy->peer_self) {
+        return 0;
+    }
+
+    return &peers->upstreams[owner].addr;
+}
+
+// the peer owning the name failed or did not answer in time, so the request is sent upstream
+// after all and queued again under the upstream. returns 0 if it could not be sent, the
+// request is deleted otherwise. probes have no query and are never sent on
+static char send_upstream_instead(policy_t *policy, queued_request_t *request, uint64_t now) {
+    if (!request->query) {
+        return 0;
+    }
+
+    // the query keeps the slot of the request it replaces, and peers count against no upstream
+    char full;
+    const struct sockaddr_in *upstream_addr =
+        select_upstream(policy, TRIE_NO_FORWARD, request->query, request->query_len, 1, &full);
+    if (!upstream_addr) {
+        return 0;
+    }
+
+    queued_request_t retry = *request;
+    if (send_query(upstream_addr, 0, retry.query, retry.query_len, &retry) < 0) {
+        return 0;
+    }
+    retry.expiration_time = now + REQUEST_EXPIRES_AFTER;
+
+    // the query moves to the new request
+    request->query = 0;
+    queue_delete(&ctx, request);
+    queue_add_request(&ctx, &retry);
+
+    return 1;
+}
+
+// another process may have an answer, or a fresher one than the expired local entry. the local
+// entry is replaced by it, so only the returned one may be used afterwards
+static cache_entry_t *lookup_shared_cache(const uint8_t *key,
+                                          size_t key_len,
+                                          cache_entry_t *entry,
+                                          uint64_t now) {
+    char message[SHMCACHE_MAX_MESSAGE_LEN];
+    size_t len;
+    uint64_t stored_at;
+    uint64_t expires_at;
+    if (!shmcache_lookup(
+            &ctx.shared_cache, key, key_len, now, message, &len, &stored_at, &expires_at) ||
+        (entry && expires_at <= entry->expires_at)) {
+        return entry;
+    }
+
+    return cache_insert(&ctx.cache, key, key_len, message, len, stored_at, expires_at);
 }
 
-static void str_to_lower(char *str) {
-    int len = strlen(str);
-    for (int i = 0; i < len; i++) {
-        str[i] = tolower(str[i]);
+// sends the query in ctx.buffer upstream under an id of its own, the answer only goes to the
+// cache
+static void send_refresh(policy_t *policy, int forward, size_t query_len, uint64_t now) {
+    // refreshes are never worth waiting for room
+    char full;
+    const struct sockaddr_in *upstream_addr =
+        select_upstream(policy, forward, ctx.buffer, query_len, 0, &full);
+    if (!upstream_addr) {
+        return;
+    }
+
+    queued_request_t request;
+    memset(&request, 0, sizeof(request));
+    if (send_query(upstream_addr, 0, ctx.buffer, query_len, &request) < 0) {
+        return;
+    }
+
+    request.expiration_time = now + REQUEST_EXPIRES_AFTER;
+    request.refresh = 1;
+    queue_add_request(&ctx, &request);
+}
+
+// sends the query from a random socket of the upstream's group under a random id, which the
+// query only carries while it is sent. peers are asked from the listening socket, so they see
+// the query comes from a peer. fills in where the answer is expected, returns -1 on failure
+static int send_query(const struct sockaddr_in *upstream_addr,
+                      char peer,
+                      char *query,
+                      size_t query_len,
+                      queued_request_t *request) {
+    int first = LISTEN_SOCKET;
+    int count = 1;
+    if (!peer) {
+        first = socket_group(upstream_addr);
+        count = upstream_sockets;
+        if (first < 0) {
+            return -1;
+        }
     }
+
+    int socket = -1;
+    uint16_t id = 0;
+    for (int i = 0; i < ID_ATTEMPTS && socket < 0; i++) {
+        uint64_t random = next_random();
+        id = random;
+        socket = first + (random >> 16) % count;
+        if (queue_find(&ctx, socket, id)) {
+            socket = -1;
+        }
+    }
+    if (socket < 0) {
+        fprintf(stderr, "no free query id for the upstream\n");
+        return -1;
+    }
+
+    uint8_t key[CACHE_MAX_KEY_LEN];
+    size_t key_len;
+    char has_key = cache_key_from_message(query, query_len, key, &key_len) == 0;
+
+    dns_header_t *header = (dns_header_t *)query;
+    uint16_t client_id = header->id;
+    header->id = id;
+
+    int ret;
+    if (peer) {
+        ret = sendto(ctx.sock_fd,
+                     query,
+                     query_len,
+                     0,
+                     (const struct sockaddr *)upstream_addr,
+                     sizeof(*upstream_addr));
+    } else {
+        ret = send(ctx.sockets[socket].fd, query, query_len, 0);
+    }
+    header->id = client_id;
+
+    if (ret < 0) {
+        fprintf(stderr, "sendto to external dns server failed with: %s", strerror(errno));
+        record_outcome(atomic_load_explicit(&ctx.policy, memory_order_acquire),
+                       upstream_addr,
+                       0,
+                       get_time_ms());
+        return -1;
+    }
+
+    request->socket = socket;
+    request->id = id;
+    request->client_id = client_id;
+    request->question = question_hash(has_key ? key : 0, key_len);
+    request->upstream_addr = *upstream_addr;
+    request->peer = peer;
+
+    return 0;
+}
+
+// the first of the upstream_sockets sockets connected to the upstream, opened when it is first
+// asked. upstreams of the policy keep their group, others are looked up, and groups no upstream
+// has are closed once their queries are over
+static int socket_group(const struct sockaddr_in *upstream_addr) {
+    policy_t *policy = atomic_load_explicit(&ctx.policy, memory_order_acquire);
+    upstreams_t *upstreams = adopted_upstreams(policy);
+    int upstream = upstreams_find(upstreams, upstream_addr);
+    if (upstream >= 0 && upstreams->upstreams[upstream].sockets >= 0) {
+        return upstreams->upstreams[upstream].sockets;
+    }
+
+    int first = find_socket_group(upstream_addr);
+    if (first < 0) {
+        first = open_socket_group(upstream_addr);
+    }
+    if (first < 0) {
+        return -1;
+    }
+
+    // an upstream a reload dropped can still be asked by a query of the old policy
+    if (upstream >= 0) {
+        upstreams->upstreams[upstream].sockets = first;
+        ctx.sockets[first].retire_at = 0;
+    } else {
+        ctx.sockets[first].retire_at = get_time_ms() + REQUEST_EXPIRES_AFTER;
+    }
+
+    return first;
+}
+
+static int find_socket_group(const struct sockaddr_in *upstream_addr) {
+    for (int i = LISTEN_SOCKET + 1; i < ctx.sockets_count; i += upstream_sockets) {
+        if (ctx.sockets[i].fd != -1 && same_addr(&ctx.sockets[i].addr, upstream_addr)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// in the slots of a closed group if there is one, appended otherwise
+static int open_socket_group(const struct sockaddr_in *upstream_addr) {
+    int first = ctx.sockets_count;
+    for (int i = LISTEN_SOCKET + 1; i < ctx.sockets_count; i += upstream_sockets) {
+        if (ctx.sockets[i].fd == -1) {
+            first = i;
+            break;
+        }
+    }
+
+    for (int i = 0; i < upstream_sockets; i++) {
+        // connect binds the socket to a random ephemeral port
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1 ||
+            connect(fd, (const struct sockaddr *)upstream_addr, sizeof(*upstream_addr))) {
+            fprintf(stderr, "upstream socket creation failed with: %s\n", strerror(errno));
+            if (fd != -1) {
+                close(fd);
+            }
+            for (int j = first; j < first + i; j++) {
+                close(ctx.sockets[j].fd);
+                ctx.sockets[j].fd = -1;
+                ctx.poll_fds[j].fd = -1;
+            }
+            if (first == ctx.sockets_count - i) {
+                ctx.sockets_count = first;
+            }
+            return -1;
+        }
+
+        if (first + i < ctx.sockets_count) {
+            ctx.sockets[first + i].fd = fd;
+            ctx.sockets[first + i].addr = *upstream_addr;
+            ctx.poll_fds[first + i].fd = fd;
+            ctx.poll_fds[first + i].revents = 0;
+        } else {
+            add_socket(fd, upstream_addr);
+        }
+    }
+    ctx.sockets[first].retire_at = 0;
+
+    return first;
+}
+
+// groups past retire_at are closed once no pending request waits on them. their slots stay in
+// place, the requests of other groups keep their socket numbers
+static void close_retired_groups(uint64_t now) {
+    for (int first = LISTEN_SOCKET + 1; first < ctx.sockets_count; first += upstream_sockets) {
+        upstream_socket_t *group = &ctx.sockets[first];
+        if (group->fd == -1 || !group->retire_at || group->retire_at > now) {
+            continue;
+        }
+
+        char pending = 0;
+        for (int list = 0; list < EXPIRY_LISTS && !pending; list++) {
+            for (int i = ctx.expiry[list].head; i != -1; i = ctx.queue[i].expiry_next) {
+                int socket = ctx.queue[i].socket;
+                if (socket >= first && socket < first + upstream_sockets) {
+                    pending = 1;
+                    break;
+                }
+            }
+        }
+        if (pending) {
+            continue;
+        }
+
+        for (int i = first; i < first + upstream_sockets; i++) {
+            close(ctx.sockets[i].fd);
+            ctx.sockets[i].fd = -1;
+            ctx.poll_fds[i].fd = -1; // ignored by poll
+            ctx.poll_fds[i].revents = 0;
+        }
+        group->retire_at = 0;
+    }
+
+    while (ctx.sockets_count > LISTEN_SOCKET + 1 &&
+           ctx.sockets[ctx.sockets_count - upstream_sockets].fd == -1) {
+        ctx.sockets_count -= upstream_sockets;
+    }
+}
+
+static int add_socket(int fd, const struct sockaddr_in *addr) {
+    if (ctx.sockets_count == ctx.sockets_capacity) {
+        int capacity = ctx.sockets_capacity ? ctx.sockets_capacity * 2 : 16;
+        upstream_socket_t *sockets = realloc(ctx.sockets, sizeof(upstream_socket_t) * capacity);
+        struct pollfd *poll_fds = realloc(ctx.poll_fds, sizeof(struct pollfd) * capacity);
+        if (!sockets || !poll_fds) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+        ctx.sockets = sockets;
+        ctx.poll_fds = poll_fds;
+        ctx.sockets_capacity = capacity;
+    }
+
+    int i = ctx.sockets_count++;
+    ctx.sockets[i].fd = fd;
+    ctx.sockets[i].addr = *addr;
+    ctx.sockets[i].retire_at = 0;
+    ctx.poll_fds[i].fd = fd;
+    ctx.poll_fds[i].events = POLLIN;
+    ctx.poll_fds[i].revents = 0;
+
+    return i;
+}
+
+// the key is lowercase, so the case of a name does not matter
+static uint64_t question_hash(const uint8_t *key, size_t key_len) {
+    return key ? hash_bytes(key, key_len, 0) | 1 : 0;
+}
+
+// splitmix64, seeded by getrandom
+static uint64_t next_random() {
+    ctx.random += 0x9e3779b97f4a7c15ull;
+    return hash_mix(ctx.random);
+}
+
+// a reloaded policy starts with nothing in flight and no sockets, so the first time it is used
+// its counts are taken from the pending queries, which may have been sent under the old one,
+// its upstreams take over their socket groups, and the groups left over are retired
+static upstreams_t *adopted_upstreams(policy_t *policy) {
+    upstreams_t *upstreams = &policy->upstreams;
+    if (upstreams->adopted) {
+        return upstreams;
+    }
+
+    for (int list = 0; list < EXPIRY_LISTS; list++) {
+        for (int i = ctx.expiry[list].head; i != -1; i = ctx.queue[i].expiry_next) {
+            upstreams_track(upstreams, &ctx.queue[i].upstream_addr, 1);
+        }
+    }
+
+    uint64_t retire_at = get_time_ms() + REQUEST_EXPIRES_AFTER;
+    for (int first = LISTEN_SOCKET + 1; first < ctx.sockets_count; first += upstream_sockets) {
+        ctx.sockets[first].retire_at = retire_at;
+    }
+    for (int i = 0; i < upstreams->upstreams_count; i++) {
+        int first = find_socket_group(&upstreams->upstreams[i].addr);
+        upstreams->upstreams[i].sockets = first;
+        if (first >= 0) {
+            ctx.sockets[first].retire_at = 0;
+        }
+    }
+    upstreams->adopted = 1;
+
+    return upstreams;
+}
+
+// an address is either an upstream or a peer, the other list ignores it
+static void record_outcome(policy_t *policy,
+                           const struct sockaddr_in *addr,
+                           char ok,
+                           uint64_t now) {
+    upstreams_record(&policy->upstreams, addr, ok, now);
+    upstreams_record(&policy->peers, addr, ok, now);
+}
+
+// ejected upstreams and peers are asked for the root ns records once their wait is over, and
+// only get queries again after they answered
+static void probe_upstreams(uint64_t now) {
+    policy_t *policy = atomic_load_explicit(&ctx.policy, memory_order_acquire);
+    upstreams_t *lists[] = {&policy->upstreams, &policy->peers};
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        int upstream;
+        while ((upstream = upstreams_next_probe(lists[i], now)) >= 0) {
+            const struct sockaddr_in *addr = &lists[i]->upstreams[upstream].addr;
+            if (!send_probe(addr, lists[i] == &policy->peers, now)) {
+                upstreams_probed(lists[i], addr, 0, now);
+            }
+        }
+    }
+}
+
+static char send_probe(const struct sockaddr_in *upstream_addr, char peer, uint64_t now) {
+    if (ctx.queue_size >= max_in_flight) {
+        return 0;
+    }
+
+    char query[sizeof(dns_header_t) + 5];
+    memset(query, 0, sizeof(query));
+    dns_header_t *header = (dns_header_t *)query;
+    header->flags = htons(0x0100); // rd
+    header->qd_count = htons(1);
+    // root name, then qtype ns and qclass in
+    query[sizeof(dns_header_t) + 2] = DNS_TYPE_NS;
+    query[sizeof(dns_header_t) + 4] = DNS_CLASS_IN;
+
+    queued_request_t request;
+    memset(&request, 0, sizeof(request));
+    if (send_query(upstream_addr, peer, query, sizeof(query), &request) < 0) {
+        return 0;
+    }
+
+    // a peer gets as long as for its queries, which keeps the list of peer requests sorted
+    request.expiration_time = now + (peer ? peer_timeout : REQUEST_EXPIRES_AFTER);
+    request.probe = 1;
+    queue_add_request(&ctx, &request);
+
+    return 1;
+}
+
+// queues the query in ctx.buffer, pushing out a waiting query of lower priority if the backlog
+// is full. returns 0 if the query has to be shed itself
+static char backlog_add(policy_t *policy,
+                        const struct sockaddr_in *addr,
+                        socklen_t addr_len,
+                        int forward,
+                        size_t query_len,
+                        uint64_t now) {
+    if (!backlog_size) {
+        return 0;
+    }
+
+    int priority = upstreams_find(&policy->peers, addr) >= 0 ? BACKLOG_PEER : BACKLOG_CLIENT;
+
+    // the newest of the lowest priority goes first
+    int worst = -1;
+    if (ctx.backlog_count == backlog_size) {
+        worst = 0;
+        for (int i = 1; i < ctx.backlog_count; i++) {
+            const backlog_entry_t *entry = &ctx.backlog[i];
+            if (entry->priority > ctx.backlog[worst].priority ||
+                (entry->priority == ctx.backlog[worst].priority &&
+                 entry->deadline > ctx.backlog[worst].deadline)) {
+                worst = i;
+            }
+        }
+
+        if (ctx.backlog[worst].priority <= priority) {
+            return 0;
+        }
+    }
+
+    char *query = malloc(query_len);
+    if (!query) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+    memcpy(query, ctx.buffer, query_len);
+
+    // shedding reuses ctx.buffer, so it waits until the query is copied
+    backlog_entry_t *entry;
+    if (worst >= 0) {
+        entry = &ctx.backlog[worst];
+        shed_entry(policy, entry);
+    } else {
+        entry = &ctx.backlog[ctx.backlog_count++];
+    }
+
+    entry->addr = *addr;
+    entry->addr_len = addr_len;
+    entry->forward = forward;
+    entry->priority = priority;
+    entry->deadline = now + (priority == BACKLOG_PEER && peer_timeout < BACKLOG_WAIT
+                                 ? peer_timeout
+                                 : BACKLOG_WAIT);
+    entry->query = query;
+    entry->query_len = query_len;
+
+    return 1;
+}
+
+// sheds the queries that waited too long, then sends the others, best first, while there is room
+static void drain_backlog(uint64_t now) {
+    policy_t *policy = atomic_load_explicit(&ctx.policy, memory_order_acquire);
+
+    for (int i = 0; i < ctx.backlog_count;) {
+        if (ctx.backlog[i].deadline <= now) {
+            shed_entry(policy, &ctx.backlog[i]);
+            ctx.backlog[i] = ctx.backlog[--ctx.backlog_count];
+        } else {
+            i++;
+        }
+    }
+
+    while (ctx.backlog_count) {
+        int best = 0;
+        for (int i = 1; i < ctx.backlog_count; i++) {
+            const backlog_entry_t *entry = &ctx.backlog[i];
+            if (entry->priority < ctx.backlog[best].priority ||
+                (entry->priority == ctx.backlog[best].priority &&
+                 entry->deadline < ctx.backlog[best].deadline)) {
+                best = i;
+            }
+        }
+
+        // a reload may have dropped the forward zone the query was waiting for
+        backlog_entry_t *entry = &ctx.backlog[best];
+        int forward = entry->forward < policy->upstreams.pools_count ? entry->forward
+                                                                     : TRIE_NO_FORWARD;
+        char full;
+        const struct sockaddr_in *upstream_addr =
+            select_upstream(policy, forward, entry->query, entry->query_len, 0, &full);
+        if (!upstream_addr && full) {
+            return;
+        }
+
+        queued_request_t request;
+        memset(&request, 0, sizeof(request));
+        int ret = -1;
+        if (upstream_addr) {
+            ret = send_query(upstream_addr, 0, entry->query, entry->query_len, &request);
+        }
+
+        if (ret < 0) {
+            shed_entry(policy, entry);
+        } else {
+            request.addr = entry->addr;
+            request.addr_len = entry->addr_len;
+            request.expiration_time = now + REQUEST_EXPIRES_AFTER;
+            queue_add_request(&ctx, &request);
+            free(entry->query);
+        }
+
+        ctx.backlog[best] = ctx.backlog[--ctx.backlog_count];
+    }
+}
+
+// answers a query that got no room upstream with SERVFAIL right away, reuses ctx.buffer
+static void shed_entry(policy_t *policy, backlog_entry_t *entry) {
+    memcpy(ctx.buffer, entry->query, entry->query_len);
+    free(entry->query);
+
+    size_t question_len;
+    if (dns_check_questions(ctx.buffer, entry->query_len, &question_len)) {
+        question_len = 0;
+    }
+    send_reply(policy, REPLY_SERVFAIL, question_len, &entry->addr, entry->addr_len);
+}
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    ctx.is_running = 0;
+}
+
+// SIGHUP is taken from a signalfd by the reload thread, so it is blocked before the thread
+// starts and every thread inherits the mask
+static int start_reload_thread() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, 0);
+
+    ctx.reload_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (ctx.reload_stop_fd == -1) {
+        fprintf(stderr, "eventfd failed with: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int ret = pthread_create(&ctx.reload_thread, 0, reload_main, 0);
+    if (ret) {
+        fprintf(stderr, "pthread_create failed with: %s\n", strerror(ret));
+        close(ctx.reload_stop_fd);
+        ctx.reload_stop_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void stop_reload_thread() {
+    if (ctx.reload_stop_fd == -1) {
+        return;
+    }
+
+    uint64_t value = 1;
+    if (write(ctx.reload_stop_fd, &value, sizeof(value)) != sizeof(value)) {
+        fprintf(stderr, "failed to stop reload thread\n");
+        return;
+    }
+
+    pthread_join(ctx.reload_thread, 0);
+    close(ctx.reload_stop_fd);
+    ctx.reload_stop_fd = -1;
+}
+
+static void *reload_main(void *arg) {
+    (void)arg;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        fprintf(stderr, "signalfd failed with: %s\n", strerror(errno));
+    }
+
+    watch_t watch;
+    if (watch_init(&watch) == 0) {
+        watch_policy_files(&watch, atomic_load(&ctx.policy));
+    }
+
+    struct pollfd poll_fds[3];
+    poll_fds[0].fd = ctx.reload_stop_fd;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = signal_fd;
+    poll_fds[1].events = POLLIN;
+    poll_fds[2].fd = watch.fd;
+    poll_fds[2].events = POLLIN;
+
+    while (1) {
+        int ret = poll(poll_fds, 3, -1);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            fprintf(stderr, "reload poll failed with: %s\n", strerror(errno));
+            break;
+        }
+
+        if (poll_fds[0].revents & POLLIN) {
+            break;
+        }
+
+        char changed = 0;
+        if (poll_fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                changed = 1;
+            }
+        }
+
+        if ((poll_fds[2].revents & POLLIN) && watch_read_changes(&watch)) {
+            changed = 1;
+        }
+
+        if (!changed) {
+            continue;
+        }
+
+        // editors and list updaters write in several steps, let them settle
+        struct timespec delay = {0, RELOAD_SETTLE_MS * 1000000};
+        nanosleep(&delay, 0);
+        watch_read_changes(&watch);
+
+        reload_policy(&watch);
+    }
+
+    watch_free(&watch);
+    if (signal_fd != -1) {
+        close(signal_fd);
+    }
+
+    return 0;
+}
+
+static void reload_policy(watch_t *watch) {
+    toml_table_t *conf = parse_config();
+    policy_t *policy = conf ? policy_load(conf) : 0;
+    if (!policy) {
+        if (conf) {
+            toml_free(conf);
+        }
+        fprintf(stderr, "reload failed, keeping the current config\n");
+        return;
+    }
+
+    policy_t *old = atomic_exchange(&ctx.policy, policy);
+    qsbr_synchronize(&ctx.qsbr);
+    policy_free(old);
+
+    printf("config reloaded\n");
+    report_restart_settings(conf);
+    toml_free(conf);
+
+    watch_policy_files(watch, policy);
+}
+
+// only the policy is rebuilt on reload, the settings load_config reads size what init_context
+// allocates, so a change of them is reported instead of silently ignored
+static void report_restart_settings(toml_table_t *conf) {
+    const struct {
+        const char *key;
+        long long running;
+        long long fallback;
+    } ints[] = {
+        {"listen_port", listen_port, DNS_PORT},
+        {"cache_size", cache_size, DEFAULT_CACHE_SIZE},
+        {"cache_memory", cache_memory, DEFAULT_CACHE_MEMORY},
+        {"cache_sketch_width", cache_sketch_width, 0},
+        {"cache_snapshot_interval", cache_snapshot_interval, DEFAULT_CACHE_SNAPSHOT_INTERVAL},
+        {"cache_stale_refresh", cache_stale_refresh, DEFAULT_CACHE_STALE_REFRESH},
+        {"cache_serve_stale", cache_serve_stale, DEFAULT_CACHE_SERVE_STALE},
+        {"cache_prefetch_hits", cache_prefetch_hits, DEFAULT_CACHE_PREFETCH_HITS},
+        {"max_in_flight", max_in_flight, DEFAULT_MAX_IN_FLIGHT},
+        {"backlog_size", backlog_size, DEFAULT_BACKLOG_SIZE},
+        {"upstream_sockets", upstream_sockets, DEFAULT_UPSTREAM_SOCKETS},
+        {"peer_timeout", peer_timeout, DEFAULT_PEER_TIMEOUT},
+        {"shared_cache_memory", shared_cache_memory, DEFAULT_SHARED_CACHE_MEMORY},
+    };
+    for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) {
+        toml_datum_t value = toml_int_in(conf, ints[i].key);
+        if ((value.ok ? value.u.i : ints[i].fallback) != ints[i].running) {
+            fprintf(stderr, "%s changed, requires restart\n", ints[i].key);
+        }
+    }
+
+    const struct {
+        const char *key;
+        const char *running;
+    } strings[] = {
+        {"cache_file", cache_file},
+        {"shared_cache", shared_cache},
+    };
+    for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        toml_datum_t value = toml_string_in(conf, strings[i].key);
+        const char *reloaded = value.ok ? value.u.s : 0;
+        if ((reloaded || strings[i].running) &&
+            (!reloaded || !strings[i].running || strcmp(reloaded, strings[i].running))) {
+            fprintf(stderr, "%s changed, requires restart\n", strings[i].key);
+        }
+        if (value.ok) {
+            free(value.u.s);
+        }
+    }
+
+    toml_datum_t huge_pages_toml = toml_bool_in(conf, "huge_pages");
+    if ((huge_pages_toml.ok && huge_pages_toml.u.b) != hugepage_enabled()) {
+        fprintf(stderr, "huge_pages changed, requires restart\n");
+    }
+}
+
+// the reload thread is the only writer, so the policy it reads here stays valid
+static void watch_policy_files(watch_t *watch, const policy_t *policy) {
+    if (watch->fd == -1) {
+        return;
+    }
+
+    char **paths = malloc(sizeof(char *) * (policy->files_count + 1));
+    if (!paths) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    paths[0] = CONFIG_PATH;
+    memcpy(paths + 1, policy->files, sizeof(char *) * policy->files_count);
+    watch_set_files(watch, paths, policy->files_count + 1);
+
+    free(paths);
+}
+
+// the child writes a copy-on-write image of the cache while the parent keeps serving
+static void snapshot_cache(uint64_t now) {
+    if (ctx.snapshot_pid != -1) {
+        return;
+    }
+
+    // every page of a reserved huge page arena the parent writes during the snapshot is copied
+    // from the free huge pages, the child is killed when there are none left
+    if (ctx.cache.arena_backing == HUGEPAGE_HUGETLB &&
+        hugepage_free_count() < ctx.cache.arena_mapped / HUGEPAGE_SIZE) {
+        fprintf(stderr, "cache snapshot skipped, not enough free huge pages to copy the cache\n");
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "fork for cache snapshot failed with: %s\n", strerror(errno));
+        return;
+    } else if (pid == 0) {
+        _exit(cache_save(&ctx.cache, cache_file, now) == 0 ? 0 : 1);
+    }
+
+    ctx.snapshot_pid = pid;
+}
+
+static void reap_snapshot(char wait) {
+    if (ctx.snapshot_pid == -1) {
+        return;
+    }
+
+    int status;
+    pid_t ret = waitpid(ctx.snapshot_pid, &status, wait ? 0 : WNOHANG);
+    if (ret == 0) {
+        return;
+    }
+
+    if (ret > 0 && WIFSIGNALED(status)) {
+        fprintf(stderr, "cache snapshot killed by signal %d\n", WTERMSIG(status));
+    } else if (ret > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        fprintf(stderr, "cache snapshot failed\n");
+    }
+
+    ctx.snapshot_pid = -1;
+}
+
+// the pool is preallocated, callers check for room before they send anything upstream
+static void queue_add_request(server_ctx_t *ctx, const queued_request_t *request) {
+    policy_t *policy = atomic_load_explicit(&ctx->policy, memory_order_acquire);
+    upstreams_track(adopted_upstreams(policy), &request->upstream_addr, 1);
+
+    int i = ctx->queue_free;
+    queued_request_t *slot = &ctx->queue[i];
+    ctx->queue_free = slot->hash_next;
+    *slot = *request;
+
+    uint32_t bucket = queue_bucket(ctx, request->socket, request->id);
+    slot->hash_next = ctx->queue_buckets[bucket];
+    ctx->queue_buckets[bucket] = i;
+
+    expiry_list_t *list = &ctx->expiry[request->peer ? EXPIRY_PEER : EXPIRY_UPSTREAM];
+    slot->expiry_prev = list->tail;
+    slot->expiry_next = -1;
+    if (list->tail != -1) {
+        ctx->queue[list->tail].expiry_next = i;
+    } else {
+        list->head = i;
+    }
+    list->tail = i;
+
+    ctx->queue_size++;
+}
+
+static char same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static queued_request_t *queue_find(server_ctx_t *ctx, int socket, uint16_t id) {
+    int i = ctx->queue_buckets[queue_bucket(ctx, socket, id)];
+    while (i != -1) {
+        queued_request_t *request = &ctx->queue[i];
+        if (request->socket == socket && request->id == id) {
+            return request;
+        }
+        i = request->hash_next;
+    }
+
+    return 0;
+}
+
+// each list is sorted by expiration, so only the expired heads are looked at
+static void queue_delete_expired(server_ctx_t *ctx) {
+    if (ctx->queue_size == 0) {
+        return;
+    }
+
+    uint64_t cur_time = get_time_ms();
+    policy_t *policy = atomic_load_explicit(&ctx->policy, memory_order_acquire);
+
+    for (int i = 0; i < EXPIRY_LISTS; i++) {
+        while (ctx->expiry[i].head != -1 &&
+               ctx->queue[ctx->expiry[i].head].expiration_time <= cur_time) {
+            queued_request_t *request = &ctx->queue[ctx->expiry[i].head];
+            if (request->probe) {
+                upstreams_probed(&policy->upstreams, &request->upstream_addr, 0, cur_time);
+                upstreams_probed(&policy->peers, &request->upstream_addr, 0, cur_time);
+            } else {
+                record_outcome(policy, &request->upstream_addr, 0, cur_time);
+            }
+
+            if (request->peer && !request->probe && request->query &&
+                send_upstream_instead(policy, request, cur_time)) {
+                continue;
+            }
+
+            // the upstream timed out, a stale answer is better than none
+            if (request->query) {
+                send_stale(policy, request, cur_time);
+            }
+            queue_delete(ctx, request);
+        }
+    }
+}
+
+static void queue_delete(server_ctx_t *ctx, queued_request_t *request) {
+    policy_t *policy = atomic_load_explicit(&ctx->policy, memory_order_acquire);
+    upstreams_track(adopted_upstreams(policy), &request->upstream_addr, -1);
+    free(request->query);
+
+    int i = request - ctx->queue;
+    int *next = &ctx->queue_buckets[queue_bucket(ctx, request->socket, request->id)];
+    while (*next != i) {
+        next = &ctx->queue[*next].hash_next;
+    }
+    *next = request->hash_next;
+
+    expiry_list_t *list = &ctx->expiry[request->peer ? EXPIRY_PEER : EXPIRY_UPSTREAM];
+    if (request->expiry_prev != -1) {
+        ctx->queue[request->expiry_prev].expiry_next = request->expiry_next;
+    } else {
+        list->head = request->expiry_next;
+    }
+    if (request->expiry_next != -1) {
+        ctx->queue[request->expiry_next].expiry_prev = request->expiry_prev;
+    } else {
+        list->tail = request->expiry_prev;
+    }
+
+    request->hash_next = ctx->queue_free;
+    ctx->queue_free = i;
+    ctx->queue_size--;
+}
+
+static uint32_t queue_bucket(const server_ctx_t *ctx, int socket, uint16_t id) {
+    return hash_mix(((uint64_t)socket << 16) | id) & ctx->queue_buckets_mask;
+}
+
+static uint64_t get_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
@@ -0,0 +1,703 @@
+#include "pattern.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "hash.h"
+
+#define PATTERN_UNSET UINT32_MAX
+#define PATTERN_UNKNOWN -1
+#define PATTERN_DEAD_STATE 0
+#define PATTERN_MIN_STATES 16
+
+typedef struct {
+    uint32_t start;
+    uint32_t end; // an epsilon state whose out is patched by the next fragment
+} fragment_t;
+
+typedef struct {
+    pattern_set_t *set;
+    const char *pos;
+    char error;
+} parser_t;
+
+static void *grow(void *array, uint32_t *capacity, uint32_t count, size_t size);
+static uint32_t add_nfa_state(pattern_set_t *set, uint8_t type, uint32_t out, uint32_t out1);
+static fragment_t frag_bytes(pattern_set_t *set, const pattern_byte_set_t *bytes);
+static fragment_t frag_byte(pattern_set_t *set, uint8_t byte);
+static fragment_t frag_any(pattern_set_t *set);
+static fragment_t frag_empty(pattern_set_t *set);
+static fragment_t frag_concat(pattern_set_t *set, fragment_t a, fragment_t b);
+static fragment_t frag_alt(pattern_set_t *set, fragment_t a, fragment_t b);
+static fragment_t frag_star(pattern_set_t *set, fragment_t a);
+static fragment_t frag_plus(pattern_set_t *set, fragment_t a);
+static fragment_t frag_quest(pattern_set_t *set, fragment_t a);
+static void add_pattern(pattern_set_t *set, fragment_t frag);
+
+static fragment_t parse_alt(parser_t *parser);
+static fragment_t parse_concat(parser_t *parser);
+static fragment_t parse_repeat(parser_t *parser);
+static fragment_t parse_atom(parser_t *parser);
+static void parse_escape(parser_t *parser, pattern_byte_set_t *bytes);
+static fragment_t parse_class(parser_t *parser);
+
+static void set_byte(pattern_byte_set_t *bytes, uint8_t byte);
+static char has_byte(const pattern_byte_set_t *bytes, uint8_t byte);
+
+static void build_classes(pattern_set_t *set);
+static void reset_dfa(pattern_set_t *set);
+static uint32_t closure(pattern_set_t *set, const uint32_t *states, uint32_t count);
+static int32_t find_state(const pattern_set_t *set, const uint32_t *nfa_set, uint32_t len);
+static uint32_t add_state(pattern_set_t *set, const uint32_t *nfa_set, uint32_t len);
+static int32_t compute_transition(pattern_set_t *set, uint32_t state, uint32_t class);
+
+void pattern_set_init(pattern_set_t *set) {
+    memset(set, 0, sizeof(*set));
+    set->match_state = PATTERN_UNSET;
+}
+
+void pattern_set_free(pattern_set_t *set) {
+    free(set->nfa);
+    free(set->sets);
+    free(set->starts);
+    free(set->transitions);
+    free(set->accepting);
+    free(set->state_offsets);
+    free(set->state_lens);
+    free(set->state_pool);
+    free(set->table);
+    free(set->stack);
+    free(set->marks);
+    free(set->scratch);
+    pattern_set_init(set);
+}
+
+int pattern_set_add_glob(pattern_set_t *set, const char *glob) {
+    if (!*glob) {
+        return -1;
+    }
+
+    // (.*\.)? in front, so the names below a match are matched too
+    fragment_t frag = frag_concat(set, frag_star(set, frag_any(set)), frag_byte(set, '.'));
+    frag = frag_quest(set, frag);
+
+    for (const char *c = glob; *c; c++) {
+        fragment_t next;
+        if (*c == '*') {
+            next = frag_star(set, frag_any(set));
+        } else if (*c == '?') {
+            next = frag_any(set);
+        } else {
+            next = frag_byte(set, tolower((unsigned char)*c));
+        }
+        frag = frag_concat(set, frag, next);
+    }
+
+    add_pattern(set, frag);
+
+    return 0;
+}
+
+int pattern_set_add_regex(pattern_set_t *set, const char *regex) {
+    size_t len = strlen(regex);
+    char anchored_start = len && regex[0] == '^';
+    char anchored_end = len > (size_t)anchored_start && regex[len - 1] == '$' &&
+                        (len < 2 || regex[len - 2] != '\\');
+
+    char *text = strndup(regex + anchored_start, len - anchored_start - anchored_end);
+    if (!text) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    // names are lowercase, escapes keep their case
+    for (size_t i = 0; text[i]; i++) {
+        if (text[i] == '\\' && text[i + 1]) {
+            i++;
+        } else {
+            text[i] = tolower((unsigned char)text[i]);
+        }
+    }
+
+    uint32_t nfa_count = set->nfa_count;
+    uint32_t sets_count = set->sets_count;
+
+    parser_t parser = {set, text, 0};
+    fragment_t frag = parse_alt(&parser);
+    if (parser.error || *parser.pos) {
+        free(text);
+        set->nfa_count = nfa_count;
+        set->sets_count = sets_count;
+        return -1;
+    }
+    free(text);
+
+    if (!anchored_start) {
+        frag = frag_concat(set, frag_star(set, frag_any(set)), frag);
+    }
+    if (!anchored_end) {
+        frag = frag_concat(set, frag, frag_star(set, frag_any(set)));
+    }
+
+    add_pattern(set, frag);
+
+    return 0;
+}
+
+int pattern_set_compile(pattern_set_t *set) {
+    if (!set->patterns_count) {
+        return 0;
+    }
+
+    build_classes(set);
+
+    size_t state_bytes = set->classes_count * sizeof(int32_t) + 4 * sizeof(uint32_t);
+    set->max_states = PATTERN_DFA_MAX_BYTES / state_bytes;
+    if (set->max_states < PATTERN_MIN_STATES) {
+        set->max_states = PATTERN_MIN_STATES;
+    }
+
+    set->stack = malloc(sizeof(uint32_t) * set->nfa_count * 3);
+    set->marks = calloc(set->nfa_count, sizeof(uint32_t));
+    set->scratch = malloc(sizeof(uint32_t) * set->nfa_count);
+    if (!set->stack || !set->marks || !set->scratch) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    reset_dfa(set);
+
+    // breadth first over every reachable state, giving up on the full dfa when it gets too big
+    for (uint32_t state = 0; state < set->states_count && !set->lazy; state++) {
+        for (uint32_t class = 0; class < set->classes_count; class++) {
+            compute_transition(set, state, class);
+            if (set->lazy) {
+                break;
+            }
+        }
+    }
+
+    if (set->lazy) {
+        reset_dfa(set);
+        printf("patterns: %d rules, dfa is built lazily\n", set->patterns_count);
+    } else {
+        printf("patterns: %d rules, %u dfa states\n", set->patterns_count, set->states_count);
+    }
+
+    return 0;
+}
+
+char pattern_set_match(pattern_set_t *set, const uint8_t *name, size_t name_len) {
+    if (!set->states_count) {
+        return 0;
+    }
+
+    uint32_t state = set->start_state;
+    for (size_t offset = 0; offset < name_len && name[offset]; offset += name[offset] + 1) {
+        // labels are fed with the dots of the presentation format between them
+        for (size_t i = offset ? offset : offset + 1; i <= offset + name[offset]; i++) {
+            uint8_t byte = i == offset ? '.' : name[i];
+            uint32_t class = set->classes[byte];
+
+            int32_t next = set->transitions[state * set->classes_count + class];
+            if (next == PATTERN_UNKNOWN) {
+                next = compute_transition(set, state, class);
+            }
+
+            state = next;
+            if (state == PATTERN_DEAD_STATE) {
+                return 0;
+            }
+        }
+    }
+
+    return set->accepting[state];
+}
+
+static void *grow(void *array, uint32_t *capacity, uint32_t count, size_t size) {
+    if (count < *capacity) {
+        return array;
+    }
+
+    *capacity = *capacity ? *capacity * 2 : 64;
+    array = realloc(array, size * *capacity);
+    if (!array) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    return array;
+}
+
+static uint32_t add_nfa_state(pattern_set_t *set, uint8_t type, uint32_t out, uint32_t out1) {
+    set->nfa = grow(set->nfa, &set->nfa_capacity, set->nfa_count, sizeof(pattern_nfa_state_t));
+
+    pattern_nfa_state_t *state = &set->nfa[set->nfa_count];
+    state->type = type;
+    state->out = out;
+    state->out1 = out1;
+    state->set = PATTERN_UNSET;
+
+    return set->nfa_count++;
+}
+
+static fragment_t frag_bytes(pattern_set_t *set, const pattern_byte_set_t *bytes) {
+    set->sets = grow(set->sets, &set->sets_capacity, set->sets_count, sizeof(pattern_byte_set_t));
+    set->sets[set->sets_count] = *bytes;
+
+    fragment_t frag;
+    frag.end = add_nfa_state(set, PATTERN_NFA_EPSILON, PATTERN_UNSET, PATTERN_UNSET);
+    frag.start = add_nfa_state(set, PATTERN_NFA_BYTES, frag.end, PATTERN_UNSET);
+    set->nfa[frag.start].set = set->sets_count++;
+
+    return frag;
+}
+
+static fragment_t frag_byte(pattern_set_t *set, uint8_t byte) {
+    pattern_byte_set_t bytes;
+    memset(&bytes, 0, sizeof(bytes));
+    set_byte(&bytes, byte);
+    return frag_bytes(set, &bytes);
+}
+
+static fragment_t frag_any(pattern_set_t *set) {
+    pattern_byte_set_t bytes;
+    memset(&bytes, 0xff, sizeof(bytes));
+    return frag_bytes(set, &bytes);
+}
+
+static fragment_t frag_empty(pattern_set_t *set) {
+    fragment_t frag;
+    frag.start = add_nfa_state(set, PATTERN_NFA_EPSILON, PATTERN_UNSET, PATTERN_UNSET);
+    frag.end = frag.start;
+    return frag;
+}
+
+static fragment_t frag_concat(pattern_set_t *set, fragment_t a, fragment_t b) {
+    set->nfa[a.end].out = b.start;
+    fragment_t frag = {a.start, b.end};
+    return frag;
+}
+
+static fragment_t frag_alt(pattern_set_t *set, fragment_t a, fragment_t b) {
+    fragment_t frag;
+    frag.end = add_nfa_state(set, PATTERN_NFA_EPSILON, PATTERN_UNSET, PATTERN_UNSET);
+    frag.start = add_nfa_state(set, PATTERN_NFA_SPLIT, a.start, b.start);
+    set->nfa[a.end].out = frag.end;
+    set->nfa[b.end].out = frag.end;
+    return frag;
+}
+
+static fragment_t frag_star(pattern_set_t *set, fragment_t a) {
+    fragment_t frag;
+    frag.end = add_nfa_state(set, PATTERN_NFA_EPSILON, PATTERN_UNSET, PATTERN_UNSET);
+    frag.start = add_nfa_state(set, PATTERN_NFA_SPLIT, a.start, frag.end);
+    set->nfa[a.end].out = frag.start;
+    return frag;
+}
+
+static fragment_t frag_plus(pattern_set_t *set, fragment_t a) {
+    fragment_t frag;
+    frag.end = add_nfa_state(set, PATTERN_NFA_EPSILON, PATTERN_UNSET, PATTERN_UNSET);
+    uint32_t split = add_nfa_state(set, PATTERN_NFA_SPLIT, a.start, frag.end);
+    set->nfa[a.end].out = split;
+    frag.start = a.start;
+    return frag;
+}
+
+static fragment_t frag_quest(pattern_set_t *set, fragment_t a) {
+    fragment_t frag;
+    frag.end = add_nfa_state(set, PATTERN_NFA_EPSILON, PATTERN_UNSET, PATTERN_UNSET);
+    frag.start = add_nfa_state(set, PATTERN_NFA_SPLIT, a.start, frag.end);
+    set->nfa[a.end].out = frag.end;
+    return frag;
+}
+
+static void add_pattern(pattern_set_t *set, fragment_t frag) {
+    if (set->match_state == PATTERN_UNSET) {
+        set->match_state = add_nfa_state(set, PATTERN_NFA_MATCH, PATTERN_UNSET, PATTERN_UNSET);
+    }
+
+    set->nfa[frag.end].out = set->match_state;
+
+    if (set->patterns_count == set->starts_capacity) {
+        set->starts_capacity = set->starts_capacity ? set->starts_capacity * 2 : 16;
+        set->starts = realloc(set->starts, sizeof(uint32_t) * set->starts_capacity);
+        if (!set->starts) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    set->starts[set->patterns_count++] = frag.start;
+}
+
+static fragment_t parse_alt(parser_t *parser) {
+    fragment_t frag = parse_concat(parser);
+    while (!parser->error && *parser->pos == '|') {
+        parser->pos++;
+        fragment_t next = parse_concat(parser);
+        frag = frag_alt(parser->set, frag, next);
+    }
+
+    return frag;
+}
+
+static fragment_t parse_concat(parser_t *parser) {
+    fragment_t frag = frag_empty(parser->set);
+    while (!parser->error && *parser->pos && *parser->pos != '|' && *parser->pos != ')') {
+        fragment_t next = parse_repeat(parser);
+        frag = frag_concat(parser->set, frag, next);
+    }
+
+    return frag;
+}
+
+static fragment_t parse_repeat(parser_t *parser) {
+    fragment_t frag = parse_atom(parser);
+    while (!parser->error) {
+        if (*parser->pos == '*') {
+            frag = frag_star(parser->set, frag);
+        } else if (*parser->pos == '+') {
+            frag = frag_plus(parser->set, frag);
+        } else if (*parser->pos == '?') {
+            frag = frag_quest(parser->set, frag);
+        } else {
+            break;
+        }
+        parser->pos++;
+    }
+
+    return frag;
+}
+
+static fragment_t parse_atom(parser_t *parser) {
+    char c = *parser->pos++;
+    pattern_byte_set_t bytes;
+
+    switch (c) {
+    case '(': {
+        fragment_t frag = parse_alt(parser);
+        if (*parser->pos != ')') {
+            parser->error = 1;
+            return frag;
+        }
+        parser->pos++;
+        return frag;
+    }
+    case '[':
+        return parse_class(parser);
+    case '.':
+        return frag_any(parser->set);
+    case '\\':
+        memset(&bytes, 0, sizeof(bytes));
+        parse_escape(parser, &bytes);
+        return frag_bytes(parser->set, &bytes);
+    case '*':
+    case '+':
+    case '?':
+    case ')':
+    case '^':
+    case '$':
+    case 0:
+        parser->error = 1;
+        return frag_empty(parser->set);
+    default:
+        return frag_byte(parser->set, c);
+    }
+}
+
+// the backslash was consumed
+static void parse_escape(parser_t *parser, pattern_byte_set_t *bytes) {
+    char c = *parser->pos++;
+    if (c == 'd') {
+        for (int byte = '0'; byte <= '9'; byte++) {
+            set_byte(bytes, byte);
+        }
+    } else if (c == 'w') {
+        for (int byte = 0; byte < 256; byte++) {
+            if (isalnum(byte) || byte == '_') {
+                set_byte(bytes, tolower(byte));
+            }
+        }
+    } else if (c) {
+        set_byte(bytes, c);
+    } else {
+        parser->pos--;
+        parser->error = 1;
+    }
+}
+
+// the opening bracket was consumed
+static fragment_t parse_class(parser_t *parser) {
+    pattern_byte_set_t bytes;
+    memset(&bytes, 0, sizeof(bytes));
+
+    char negate = *parser->pos == '^';
+    parser->pos += negate;
+
+    while (!parser->error && *parser->pos != ']') {
+        char c = *parser->pos++;
+        if (c == 0) {
+            parser->pos--;
+            parser->error = 1;
+        } else if (c == '\\') {
+            parse_escape(parser, &bytes);
+        } else if (parser->pos[0] == '-' && parser->pos[1] && parser->pos[1] != ']') {
+            for (int byte = (uint8_t)c; byte <= (uint8_t)parser->pos[1]; byte++) {
+                set_byte(&bytes, byte);
+            }
+            parser->pos += 2;
+        } else {
+            set_byte(&bytes, c);
+        }
+    }
+
+    if (parser->error) {
+        return frag_empty(parser->set);
+    }
+    parser->pos++;
+
+    if (negate) {
+        for (int i = 0; i < 4; i++) {
+            bytes.bits[i] = ~bytes.bits[i];
+        }
+    }
+
+    return frag_bytes(parser->set, &bytes);
+}
+
+static void set_byte(pattern_byte_set_t *bytes, uint8_t byte) {
+    bytes->bits[byte >> 6] |= 1ull << (byte & 63);
+}
+
+static char has_byte(const pattern_byte_set_t *bytes, uint8_t byte) {
+    return (bytes->bits[byte >> 6] >> (byte & 63)) & 1;
+}
+
+// refines one class of all bytes by every byte set, a class then behaves the same in every state
+static void build_classes(pattern_set_t *set) {
+    memset(set->classes, 0, sizeof(set->classes));
+    set->classes_count = 1;
+
+    for (uint32_t i = 0; i < set->sets_count; i++) {
+        int16_t split[256][2];
+        memset(split, -1, sizeof(split));
+
+        uint32_t count = 0;
+        for (int byte = 0; byte < 256; byte++) {
+            uint8_t inside = has_byte(&set->sets[i], byte);
+            int16_t *class = &split[set->classes[byte]][inside];
+            if (*class < 0) {
+                *class = count++;
+            }
+            set->classes[byte] = *class;
+        }
+        set->classes_count = count;
+    }
+
+    for (int byte = 255; byte >= 0; byte--) {
+        set->class_bytes[set->classes[byte]] = byte;
+    }
+}
+
+// dead state first, then the start state
+static void reset_dfa(pattern_set_t *set) {
+    set->states_count = 0;
+    set->state_pool_len = 0;
+
+    uint32_t table_size = 1;
+    while (table_size < set->max_states * 2) {
+        table_size *= 2;
+    }
+
+    free(set->table);
+    set->table = calloc(table_size, sizeof(uint32_t));
+    if (!set->table) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+    set->table_mask = table_size - 1;
+
+    add_state(set, 0, 0);
+
+    uint32_t len = closure(set, set->starts, set->patterns_count);
+    int32_t start = find_state(set, set->scratch, len);
+    set->start_state = start >= 0 ? (uint32_t)start : add_state(set, set->scratch, len);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// the byte consuming and match states reachable from states, sorted into set->scratch
+static uint32_t closure(pattern_set_t *set, const uint32_t *states, uint32_t count) {
+    if (++set->mark == 0) {
+        memset(set->marks, 0, sizeof(uint32_t) * set->nfa_count);
+        set->mark = 1;
+    }
+
+    uint32_t stack_len = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        set->stack[stack_len++] = states[i];
+    }
+
+    uint32_t len = 0;
+    while (stack_len) {
+        uint32_t id = set->stack[--stack_len];
+        if (set->marks[id] == set->mark) {
+            continue;
+        }
+        set->marks[id] = set->mark;
+
+        const pattern_nfa_state_t *state = &set->nfa[id];
+        if (state->type == PATTERN_NFA_SPLIT) {
+            set->stack[stack_len++] = state->out1;
+            set->stack[stack_len++] = state->out;
+        } else if (state->type == PATTERN_NFA_EPSILON) {
+            set->stack[stack_len++] = state->out;
+        } else {
+            set->scratch[len++] = id;
+        }
+    }
+
+    qsort(set->scratch, len, sizeof(uint32_t), compare_u32);
+
+    return len;
+}
+
+static int32_t find_state(const pattern_set_t *set, const uint32_t *nfa_set, uint32_t len) {
+    uint64_t hash = hash_bytes(nfa_set, sizeof(uint32_t) * len, 0);
+
+    for (uint32_t slot = hash & set->table_mask; set->table[slot];
+         slot = (slot + 1) & set->table_mask) {
+        uint32_t state = set->table[slot] - 1;
+        const uint32_t *state_set = set->state_pool + set->state_offsets[state];
+        if (set->state_lens[state] == len &&
+            memcmp(state_set, nfa_set, sizeof(uint32_t) * len) == 0) {
+            return state;
+        }
+    }
+
+    return -1;
+}
+
+static uint32_t add_state(pattern_set_t *set, const uint32_t *nfa_set, uint32_t len) {
+    uint32_t state = set->states_count;
+    if (state == set->states_capacity) {
+        uint32_t capacity = set->states_capacity ? set->states_capacity * 2 : 64;
+        set->transitions =
+            realloc(set->transitions, sizeof(int32_t) * set->classes_count * capacity);
+        set->accepting = realloc(set->accepting, capacity);
+        set->state_offsets = realloc(set->state_offsets, sizeof(uint32_t) * capacity);
+        set->state_lens = realloc(set->state_lens, sizeof(uint32_t) * capacity);
+        if (!set->transitions || !set->accepting || !set->state_offsets || !set->state_lens) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+        set->states_capacity = capacity;
+    }
+
+    if (set->state_pool_len + len > set->state_pool_capacity) {
+        while (set->state_pool_len + len > set->state_pool_capacity) {
+            set->state_pool_capacity =
+                set->state_pool_capacity ? set->state_pool_capacity * 2 : 256;
+        }
+        set->state_pool = realloc(set->state_pool, sizeof(uint32_t) * set->state_pool_capacity);
+        if (!set->state_pool) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    memcpy(set->state_pool + set->state_pool_len, nfa_set, sizeof(uint32_t) * len);
+    set->state_offsets[state] = set->state_pool_len;
+    set->state_lens[state] = len;
+    set->state_pool_len += len;
+
+    set->accepting[state] = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        if (nfa_set[i] == set->match_state) {
+            set->accepting[state] = 1;
+        }
+    }
+
+    for (uint32_t class = 0; class < set->classes_count; class++) {
+        set->transitions[state * set->classes_count + class] = PATTERN_UNKNOWN;
+    }
+
+    uint64_t hash = hash_bytes(nfa_set, sizeof(uint32_t) * len, 0);
+    uint32_t slot = hash & set->table_mask;
+    while (set->table[slot]) {
+        slot = (slot + 1) & set->table_mask;
+    }
+
+    set->table[slot] = state + 1;
+    set->states_count++;
+
+    return state;
+}
+
+static int32_t compute_transition(pattern_set_t *set, uint32_t state, uint32_t class) {
+    uint8_t byte = set->class_bytes[class];
+    const uint32_t *nfa_set = set->state_pool + set->state_offsets[state];
+    uint32_t len = set->state_lens[state];
+
+    // the top of the stack holds the moved to states, closure copies them before it grows
+    uint32_t *moved = set->stack + set->nfa_count * 2;
+    uint32_t moved_len = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        const pattern_nfa_state_t *nfa_state = &set->nfa[nfa_set[i]];
+        if (nfa_state->type == PATTERN_NFA_BYTES && has_byte(&set->sets[nfa_state->set], byte)) {
+            moved[moved_len++] = nfa_state->out;
+        }
+    }
+
+    uint32_t target_len = closure(set, moved, moved_len);
+
+    set->build_work += len + target_len;
+    if (!set->lazy && set->build_work > PATTERN_BUILD_BUDGET) {
+        set->lazy = 1;
+        return PATTERN_DEAD_STATE;
+    }
+
+    int32_t next = find_state(set, set->scratch, target_len);
+    if (next >= 0) {
+        set->transitions[state * set->classes_count + class] = next;
+        return next;
+    }
+
+    if (set->states_count < set->max_states) {
+        next = add_state(set, set->scratch, target_len);
+        set->transitions[state * set->classes_count + class] = next;
+        return next;
+    }
+
+    if (!set->lazy) {
+        set->lazy = 1;
+        return PATTERN_DEAD_STATE;
+    }
+
+    // the cache is full, start over from the target; scratch is reused by reset_dfa
+    uint32_t *target = malloc(sizeof(uint32_t) * (target_len ? target_len : 1));
+    if (!target) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+    memcpy(target, set->scratch, sizeof(uint32_t) * target_len);
+
+    reset_dfa(set);
+    set->flushes++;
+
+    next = find_state(set, target, target_len);
+    if (next < 0) {
+        next = add_state(set, target, target_len);
+    }
+    free(target);
+
+    return next;
+}
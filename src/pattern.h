@@ -0,0 +1,85 @@
+#ifndef DNSPROXY_PATTERN_H
+#define DNSPROXY_PATTERN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PATTERN_DFA_MAX_BYTES (16 * 1024 * 1024)
+#define PATTERN_BUILD_BUDGET (1 << 25) // nfa states visited before the full dfa is given up
+
+typedef enum {
+    PATTERN_NFA_BYTES, // consumes a byte of sets[set]
+    PATTERN_NFA_SPLIT,
+    PATTERN_NFA_EPSILON,
+    PATTERN_NFA_MATCH,
+} pattern_nfa_type_t;
+
+typedef struct {
+    uint8_t type;
+    uint32_t out;
+    uint32_t out1;
+    uint32_t set;
+} pattern_nfa_state_t;
+
+typedef struct {
+    uint64_t bits[4];
+} pattern_byte_set_t;
+
+// every wildcard and regex rule is compiled into one DFA over the bytes of the dotted name, so
+// matching is linear in the name length however many rules there are. when the DFA would grow
+// past PATTERN_DFA_MAX_BYTES or take more than PATTERN_BUILD_BUDGET to build, its states are
+// built lazily while matching instead, and the state cache is flushed whenever it fills up
+typedef struct {
+    pattern_nfa_state_t *nfa;
+    uint32_t nfa_count;
+    uint32_t nfa_capacity;
+    pattern_byte_set_t *sets;
+    uint32_t sets_count;
+    uint32_t sets_capacity;
+    uint32_t *starts; // first nfa state of every pattern
+    int patterns_count;
+    int starts_capacity;
+    uint32_t match_state;
+
+    uint8_t classes[256]; // bytes no pattern tells apart share a class
+    uint8_t class_bytes[256];
+    uint32_t classes_count;
+
+    int32_t *transitions; // states_count * classes_count, negative until computed
+    uint8_t *accepting;
+    uint32_t *state_offsets; // nfa state sets of the dfa states in state_pool
+    uint32_t *state_lens;
+    uint32_t states_count;
+    uint32_t states_capacity;
+    uint32_t max_states;
+    uint32_t *state_pool;
+    size_t state_pool_len;
+    size_t state_pool_capacity;
+    uint32_t *table; // dfa state + 1 by nfa set hash, 0 is empty
+    uint32_t table_mask;
+    uint32_t start_state;
+    char lazy;
+    uint64_t build_work;
+    uint64_t flushes;
+
+    uint32_t *stack; // closure scratch, sized by nfa_count
+    uint32_t *marks;
+    uint32_t mark;
+    uint32_t *scratch;
+} pattern_set_t;
+
+void pattern_set_init(pattern_set_t *set);
+void pattern_set_free(pattern_set_t *set);
+
+// * matches any run of characters and ? one character, a glob also matches the names below
+// the names it matches, like plain blacklist entries
+int pattern_set_add_glob(pattern_set_t *set, const char *glob);
+// a subset of extended regular expressions: literals, ., [] classes, \d, \w, groups, |, *, + and
+// ?, with ^ and $ anchoring at the ends. unanchored patterns match anywhere in the name
+int pattern_set_add_regex(pattern_set_t *set, const char *regex);
+int pattern_set_compile(pattern_set_t *set);
+
+// name is lowercase wire format, in lazy mode the call may build and cache dfa states
+char pattern_set_match(pattern_set_t *set, const uint8_t *name, size_t name_len);
+
+#endif
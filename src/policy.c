@@ -0,0 +1,659 @@
+#include "policy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "blacklist.h"
+#include "cache.h"
+
+#define DEFAULT_BLOCK_TTL 300
+#define DEFAULT_LOCAL_TTL 60
+
+static policy_group_t *find_group(policy_t *policy, const struct sockaddr_in *client);
+static char is_name_blocked(policy_t *policy,
+                            policy_group_t *group,
+                            const uint8_t *name,
+                            size_t name_len,
+                            int *forward);
+static int load_list(policy_t *policy,
+                     blacklist_t *list,
+                     toml_table_t *table,
+                     const char *key,
+                     char required);
+static int load_groups(policy_t *policy, toml_table_t *conf);
+static int load_blocked_ips(policy_t *policy, toml_table_t *conf);
+static int list_len(const blacklist_t *list);
+static void print_compaction(const char *name, const char *list_name, int len, const trie_t *trie);
+static int load_replies(policy_t *policy, toml_table_t *conf);
+static int load_local_records(policy_t *policy, toml_table_t *conf);
+static int load_forward_rules(policy_t *policy, toml_table_t *conf);
+static int load_server_pool(upstreams_t *upstreams, toml_table_t *table, const char *key);
+static int load_peers(policy_t *policy, toml_table_t *conf);
+static int load_upstream_options(policy_t *policy, toml_table_t *conf);
+static void add_file(policy_t *policy, const char *path);
+
+policy_t *policy_load(toml_table_t *conf) {
+    policy_t *policy = calloc(1, sizeof(policy_t));
+    if (!policy) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    blacklist_init(&policy->blacklist);
+    blacklist_init(&policy->allowlist);
+    lpm_init(&policy->clients);
+    ipset_init(&policy->blocked_ips);
+    upstreams_init(&policy->upstreams);
+    upstreams_init(&policy->peers);
+    policy->peer_self = -1;
+    local_records_init(&policy->local_records);
+
+    if (load_server_pool(&policy->upstreams, conf, "dns_server") != POLICY_DEFAULT_POOL) {
+        fprintf(stderr, "failed to parse dns_server field\n");
+        policy_free(policy);
+        return 0;
+    }
+
+    if (load_list(policy, &policy->blacklist, conf, "blacklist", 1) ||
+        load_list(policy, &policy->allowlist, conf, "allowlist", 0) ||
+        load_forward_rules(policy, conf) || load_groups(policy, conf) ||
+        load_blocked_ips(policy, conf) || load_peers(policy, conf) ||
+        load_upstream_options(policy, conf)) {
+        policy_free(policy);
+        return 0;
+    }
+
+    int blacklist_len = list_len(&policy->blacklist);
+    int allowlist_len = list_len(&policy->allowlist);
+    blacklist_compile(&policy->blacklist);
+    blacklist_compile(&policy->allowlist);
+
+    if (load_replies(policy, conf) || load_local_records(policy, conf)) {
+        policy_free(policy);
+        return 0;
+    }
+
+    const upstreams_t *upstreams = &policy->upstreams;
+    for (int i = 0; i < upstreams->pools_count; i++) {
+        printf(i == POLICY_DEFAULT_POOL ? "default upstreams:" : "upstream pool %d:", i);
+        for (int j = 0; j < upstreams->pools[i].count; j++) {
+            printf(" %s", upstreams->upstreams[upstreams->pools[i].members[j]].name);
+        }
+        printf("\n");
+    }
+    if (upstreams->hashed) {
+        printf("upstreams are selected by hash of the name\n");
+    }
+    if (policy->peer_self >= 0) {
+        printf("peers:");
+        for (int i = 0; i < policy->peers.upstreams_count; i++) {
+            printf(i == policy->peer_self ? " %s (self)" : " %s", policy->peers.upstreams[i].name);
+        }
+        printf("\n");
+    }
+    printf("blacklist and forward zones: %d entries\n", blacklist_len);
+    print_compaction("", "blacklist", blacklist_len, &policy->blacklist.trie);
+    const trie_t *trie = &policy->blacklist.trie;
+    if (trie->image) {
+        printf("blacklist image: %zu bytes on %s\n",
+               trie->image_len,
+               hugepage_backing_name(trie->image_backing));
+    }
+    if (allowlist_len) {
+        printf("allowlist: %d entries\n", allowlist_len);
+        print_compaction("", "allowlist", allowlist_len, &policy->allowlist.trie);
+    }
+    if (policy->blocked_ips.prefixes_count) {
+        printf("blocked answer addresses: %d prefixes\n", policy->blocked_ips.prefixes_count);
+    }
+
+    return policy;
+}
+
+void policy_free(policy_t *policy) {
+    if (!policy) {
+        return;
+    }
+
+    blacklist_free(&policy->blacklist);
+    blacklist_free(&policy->allowlist);
+    for (int i = 0; i < policy->groups_count; i++) {
+        free(policy->groups[i].name);
+        blacklist_free(&policy->groups[i].blacklist);
+        blacklist_free(&policy->groups[i].allowlist);
+    }
+    free(policy->groups);
+    lpm_free(&policy->clients);
+    ipset_free(&policy->blocked_ips);
+    upstreams_free(&policy->upstreams);
+    upstreams_free(&policy->peers);
+    local_records_free(&policy->local_records);
+
+    for (int i = 0; i < policy->files_count; i++) {
+        free(policy->files[i]);
+    }
+    free(policy->files);
+
+    free(policy);
+}
+
+char policy_allows_request(policy_t *policy,
+                           const struct sockaddr_in *client,
+                           const char *buffer,
+                           size_t len,
+                           int *forward) {
+    policy_group_t *group = find_group(policy, client);
+    const dns_header_t *header = (const dns_header_t *)buffer;
+    size_t offset = sizeof(dns_header_t);
+
+    if (forward) {
+        *forward = TRIE_NO_FORWARD;
+    }
+
+    for (int i = 0; i < ntohs(header->qd_count); i++) {
+        uint8_t name[DNS_MAX_NAME_LEN];
+        size_t name_len;
+        if (dns_read_name(buffer, len, &offset, name, &name_len)) {
+            return 1;
+        }
+        offset += 4; // qtype and qclass
+
+        if (is_name_blocked(policy, group, name, name_len, i == 0 ? forward : 0)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+char policy_allows_response(policy_t *policy,
+                            const struct sockaddr_in *client,
+                            const char *buffer,
+                            size_t len) {
+    const dns_header_t *header = (const dns_header_t *)buffer;
+    if (!header->an_count) {
+        return 1;
+    }
+
+    size_t offset = sizeof(dns_header_t);
+    for (int i = 0; i < ntohs(header->qd_count); i++) {
+        if (dns_skip_question(buffer, len, &offset)) {
+            return 1;
+        }
+    }
+
+    policy_group_t *group = find_group(policy, client);
+
+    for (int i = 0; i < ntohs(header->an_count); i++) {
+        dns_rr_t rr;
+        if (dns_next_rr(buffer, len, &offset, &rr)) {
+            return 1;
+        }
+        if (rr.class != DNS_CLASS_IN) {
+            continue;
+        }
+
+        if (rr.type == DNS_TYPE_CNAME) {
+            uint8_t name[DNS_MAX_NAME_LEN];
+            size_t name_len;
+            size_t name_offset = rr.rdata_offset;
+            if (!dns_read_name(buffer, len, &name_offset, name, &name_len) &&
+                is_name_blocked(policy, group, name, name_len, 0)) {
+                return 0;
+            }
+        } else if (rr.type == DNS_TYPE_A || rr.type == DNS_TYPE_AAAA) {
+            const uint8_t *addr = (const uint8_t *)buffer + rr.rdata_offset;
+            if (ipset_contains(&policy->blocked_ips, addr, rr.rdlength)) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+static policy_group_t *find_group(policy_t *policy, const struct sockaddr_in *client) {
+    int group = lpm_lookup(&policy->clients, ntohl(client->sin_addr.s_addr));
+    return group == LPM_NO_MATCH ? 0 : &policy->groups[group];
+}
+
+// forward is set to the longest matching forward zone if not null
+static char is_name_blocked(policy_t *policy,
+                            policy_group_t *group,
+                            const uint8_t *name,
+                            size_t name_len,
+                            int *forward) {
+    // the global trie is walked anyway for the forward zones
+    trie_match_t match;
+    trie_match(&policy->blacklist.trie, name, name_len, &match);
+    if (forward) {
+        *forward = match.forward;
+    }
+
+    char blocked = match.blocked ||
+                   pattern_set_match(&policy->blacklist.patterns, name, name_len) ||
+                   (group && blacklist_match(&group->blacklist, name, name_len));
+
+    return blocked && !blacklist_match(&policy->allowlist, name, name_len) &&
+           !(group && blacklist_match(&group->allowlist, name, name_len));
+}
+
+// key is an array of entries and key_files an array of list files, both optional unless required
+static int load_list(policy_t *policy,
+                     blacklist_t *list,
+                     toml_table_t *table,
+                     const char *key,
+                     char required) {
+    char files_key[64];
+    snprintf(files_key, sizeof(files_key), "%s_files", key);
+
+    toml_array_t *list_toml = toml_array_in(table, key);
+    if (!list_toml && (required || toml_key_exists(table, key))) {
+        fprintf(stderr, "failed to parse %s field\n", key);
+        return -1;
+    }
+
+    for (int i = 0; list_toml && i < toml_array_nelem(list_toml); i++) {
+        toml_datum_t domain = toml_string_at(list_toml, i);
+        if (!domain.ok) {
+            fprintf(stderr, "failed to parse %s field\n", key);
+            return -1;
+        }
+
+        int ret = blacklist_add(list, domain.u.s);
+        if (ret) {
+            fprintf(stderr, "invalid %s entry %s\n", key, domain.u.s);
+        }
+
+        free(domain.u.s);
+        if (ret) {
+            return -1;
+        }
+    }
+
+    toml_array_t *files_toml = toml_array_in(table, files_key);
+    for (int i = 0; files_toml && i < toml_array_nelem(files_toml); i++) {
+        toml_datum_t path = toml_string_at(files_toml, i);
+        if (!path.ok) {
+            fprintf(stderr, "failed to parse %s field\n", files_key);
+            return -1;
+        }
+
+        add_file(policy, path.u.s);
+        int ret = blacklist_load_file(list, path.u.s);
+        free(path.u.s);
+        if (ret) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int load_groups(policy_t *policy, toml_table_t *conf) {
+    toml_array_t *groups_toml = toml_array_in(conf, "group");
+    if (!groups_toml) {
+        return 0;
+    }
+
+    int count = toml_array_nelem(groups_toml);
+    policy->groups = calloc(count ? count : 1, sizeof(policy_group_t));
+    if (!policy->groups) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        toml_table_t *group_toml = toml_table_at(groups_toml, i);
+        if (!group_toml) {
+            fprintf(stderr, "failed to parse group field\n");
+            return -1;
+        }
+
+        policy_group_t *group = &policy->groups[policy->groups_count++];
+        blacklist_init(&group->blacklist);
+        blacklist_init(&group->allowlist);
+
+        toml_datum_t name = toml_string_in(group_toml, "name");
+        toml_array_t *clients_toml = toml_array_in(group_toml, "clients");
+        if (!name.ok || !clients_toml) {
+            fprintf(stderr, "group %d needs a name and clients\n", i + 1);
+            free(name.ok ? name.u.s : 0);
+            return -1;
+        }
+        group->name = name.u.s;
+
+        int clients_count = toml_array_nelem(clients_toml);
+        for (int j = 0; j < clients_count; j++) {
+            toml_datum_t prefix = toml_string_at(clients_toml, j);
+            int ret = prefix.ok ? lpm_add(&policy->clients, prefix.u.s, i) : -1;
+            if (ret) {
+                fprintf(stderr, "invalid client prefix %d of group %s\n", j + 1, group->name);
+            }
+
+            free(prefix.ok ? prefix.u.s : 0);
+            if (ret) {
+                return -1;
+            }
+        }
+
+        if (load_list(policy, &group->blacklist, group_toml, "blacklist", 0) ||
+            load_list(policy, &group->allowlist, group_toml, "allowlist", 0)) {
+            return -1;
+        }
+
+        int blacklist_len = list_len(&group->blacklist);
+        int allowlist_len = list_len(&group->allowlist);
+        printf("group %s: %d client prefixes, %d blacklist and %d allowlist entries\n",
+               group->name,
+               clients_count,
+               blacklist_len,
+               allowlist_len);
+
+        blacklist_compile(&group->blacklist);
+        blacklist_compile(&group->allowlist);
+        print_compaction(group->name, "blacklist", blacklist_len, &group->blacklist.trie);
+        print_compaction(group->name, "allowlist", allowlist_len, &group->allowlist.trie);
+    }
+
+    return lpm_compile(&policy->clients);
+}
+
+static int load_blocked_ips(policy_t *policy, toml_table_t *conf) {
+    toml_array_t *ips_toml = toml_array_in(conf, "blacklist_ips");
+    for (int i = 0; ips_toml && i < toml_array_nelem(ips_toml); i++) {
+        toml_datum_t prefix = toml_string_at(ips_toml, i);
+        int ret = prefix.ok ? ipset_add(&policy->blocked_ips, prefix.u.s) : -1;
+        if (ret) {
+            fprintf(stderr, "invalid blacklist_ips entry %d\n", i + 1);
+        }
+
+        free(prefix.ok ? prefix.u.s : 0);
+        if (ret) {
+            return -1;
+        }
+    }
+
+    return ipset_compile(&policy->blocked_ips);
+}
+
+static int load_upstream_options(policy_t *policy, toml_table_t *conf) {
+    policy->upstreams.max_in_flight = UPSTREAM_DEFAULT_MAX_IN_FLIGHT;
+    toml_datum_t max_in_flight = toml_int_in(conf, "upstream_max_in_flight");
+    if (max_in_flight.ok) {
+        if (max_in_flight.u.i < 0 || max_in_flight.u.i > 1000000) {
+            fprintf(stderr, "upstream_max_in_flight should be in range [0, 1000000]\n");
+            return -1;
+        }
+        policy->upstreams.max_in_flight = max_in_flight.u.i;
+    }
+
+    toml_datum_t routing = toml_string_in(conf, "upstream_routing");
+    if (!routing.ok) {
+        return 0;
+    }
+
+    int ret = 0;
+    if (strcmp(routing.u.s, "hash") == 0) {
+        policy->upstreams.hashed = 1;
+    } else if (strcmp(routing.u.s, "round_robin") != 0) {
+        fprintf(stderr, "upstream_routing should be one of round_robin, hash\n");
+        ret = -1;
+    }
+    free(routing.u.s);
+
+    return ret;
+}
+
+// every node lists the same peers, itself included, so they agree on who owns a name
+static int load_peers(policy_t *policy, toml_table_t *conf) {
+    if (!toml_key_exists(conf, "peers")) {
+        return 0;
+    }
+
+    if (load_server_pool(&policy->peers, conf, "peers") != 0) {
+        fprintf(stderr, "failed to parse peers field\n");
+        return -1;
+    }
+
+    toml_datum_t self = toml_string_in(conf, "peer_self");
+    struct sockaddr_in addr;
+    if (!self.ok || upstreams_parse(self.u.s, &addr) ||
+        (policy->peer_self = upstreams_find(&policy->peers, &addr)) < 0) {
+        fprintf(stderr, "peer_self should be one of the peers\n");
+        free(self.ok ? self.u.s : 0);
+        return -1;
+    }
+
+    free(self.u.s);
+
+    return 0;
+}
+
+// entries added so far, only valid before the list is compiled
+static int list_len(const blacklist_t *list) {
+    return list->trie.entries_len + list->patterns.patterns_count;
+}
+
+// name is the group, empty for the global lists
+static void print_compaction(const char *name, const char *list_name, int len, const trie_t *trie) {
+    int dropped = trie->duplicates + trie->covered;
+    if (!dropped) {
+        return;
+    }
+
+    printf("%s%s%s: dropped %d of %d entries (%d%%), %d duplicates and %d below blocked names\n",
+           name,
+           *name ? " " : "",
+           list_name,
+           dropped,
+           len,
+           dropped * 100 / len,
+           trie->duplicates,
+           trie->covered);
+}
+
+static int load_replies(policy_t *policy, toml_table_t *conf) {
+    toml_datum_t refuse_r_code = toml_int_in(conf, "refuse_r_code");
+    if (!refuse_r_code.ok) {
+        fprintf(stderr, "failed to parse refuse_r_code field\n");
+        return -1;
+    } else if (refuse_r_code.u.i <= 0 || refuse_r_code.u.i > 5) {
+        fprintf(stderr, "refuse_r_code should be in range [1, 5]\n");
+        return -1;
+    }
+
+    block_mode_t block_mode = BLOCK_MODE_REFUSE;
+    toml_datum_t block_mode_toml = toml_string_in(conf, "block_mode");
+    if (block_mode_toml.ok) {
+        static const struct {
+            const char *name;
+            block_mode_t mode;
+        } modes[] = {
+            {"refuse", BLOCK_MODE_REFUSE},
+            {"nxdomain", BLOCK_MODE_NXDOMAIN},
+            {"nodata", BLOCK_MODE_NODATA},
+            {"null", BLOCK_MODE_NULL},
+        };
+
+        int found = 0;
+        for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+            if (strcmp(block_mode_toml.u.s, modes[i].name) == 0) {
+                block_mode = modes[i].mode;
+                found = 1;
+            }
+        }
+        free(block_mode_toml.u.s);
+
+        if (!found) {
+            fprintf(stderr, "block_mode should be one of refuse, nxdomain, nodata, null\n");
+            return -1;
+        }
+    }
+
+    uint32_t block_ttl = DEFAULT_BLOCK_TTL;
+    toml_datum_t block_ttl_toml = toml_int_in(conf, "block_ttl");
+    if (block_ttl_toml.ok) {
+        if (block_ttl_toml.u.i < 0 || block_ttl_toml.u.i > CACHE_MAX_TTL) {
+            fprintf(stderr, "block_ttl should be in range [0, %d]\n", CACHE_MAX_TTL);
+            return -1;
+        }
+        block_ttl = block_ttl_toml.u.i;
+    }
+
+    reply_templates_init(&policy->reply_templates, block_mode, refuse_r_code.u.i, block_ttl);
+
+    return 0;
+}
+
+static int load_local_records(policy_t *policy, toml_table_t *conf) {
+    uint32_t local_ttl = DEFAULT_LOCAL_TTL;
+    toml_datum_t local_ttl_toml = toml_int_in(conf, "local_ttl");
+    if (local_ttl_toml.ok) {
+        if (local_ttl_toml.u.i < 0 || local_ttl_toml.u.i > CACHE_MAX_TTL) {
+            fprintf(stderr, "local_ttl should be in range [0, %d]\n", CACHE_MAX_TTL);
+            return -1;
+        }
+        local_ttl = local_ttl_toml.u.i;
+    }
+
+    toml_array_t *hosts_files_toml = toml_array_in(conf, "hosts_files");
+    for (int i = 0; hosts_files_toml && i < toml_array_nelem(hosts_files_toml); i++) {
+        toml_datum_t path = toml_string_at(hosts_files_toml, i);
+        if (!path.ok) {
+            fprintf(stderr, "failed to parse hosts_files field\n");
+            return -1;
+        }
+
+        add_file(policy, path.u.s);
+        int ret = local_records_load_hosts(&policy->local_records, path.u.s, local_ttl);
+        free(path.u.s);
+        if (ret) {
+            return -1;
+        }
+    }
+
+    toml_array_t *records_toml = toml_array_in(conf, "local_records");
+    for (int i = 0; records_toml && i < toml_array_nelem(records_toml); i++) {
+        toml_table_t *record = toml_table_at(records_toml, i);
+        if (!record) {
+            fprintf(stderr, "failed to parse local_records field\n");
+            return -1;
+        }
+
+        toml_datum_t name = toml_string_in(record, "name");
+        toml_datum_t type = toml_string_in(record, "type");
+        toml_datum_t value = toml_string_in(record, "value");
+        toml_datum_t ttl = toml_int_in(record, "ttl");
+
+        int ret = -1;
+        char ttl_valid = !ttl.ok || (ttl.u.i >= 0 && ttl.u.i <= CACHE_MAX_TTL);
+        if (name.ok && type.ok && value.ok && ttl_valid) {
+            ret = local_records_add(&policy->local_records,
+                                    name.u.s,
+                                    type.u.s,
+                                    value.u.s,
+                                    ttl.ok ? ttl.u.i : local_ttl);
+        }
+
+        if (ret) {
+            fprintf(stderr, "invalid local record %d\n", i + 1);
+        }
+
+        free(name.ok ? name.u.s : 0);
+        free(type.ok ? type.u.s : 0);
+        free(value.ok ? value.u.s : 0);
+
+        if (ret) {
+            return -1;
+        }
+    }
+
+    return local_records_compile(&policy->local_records);
+}
+
+static int load_forward_rules(policy_t *policy, toml_table_t *conf) {
+    toml_array_t *forward_toml = toml_array_in(conf, "forward");
+    for (int i = 0; forward_toml && i < toml_array_nelem(forward_toml); i++) {
+        toml_table_t *rule = toml_table_at(forward_toml, i);
+        if (!rule) {
+            fprintf(stderr, "failed to parse forward field\n");
+            return -1;
+        }
+
+        toml_datum_t zone = toml_string_in(rule, "zone");
+        int pool = load_server_pool(&policy->upstreams, rule, "servers");
+
+        int ret = -1;
+        if (zone.ok && pool >= 0) {
+            ret = trie_add(&policy->blacklist.trie, zone.u.s, 0, pool);
+        }
+
+        if (ret) {
+            fprintf(stderr, "invalid forward rule %d\n", i + 1);
+        } else {
+            printf("forwarding %s to upstream pool %d\n", zone.u.s, pool);
+        }
+
+        free(zone.ok ? zone.u.s : 0);
+
+        if (ret) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// key is a single server or an array of them, returns the pool index
+static int load_server_pool(upstreams_t *upstreams, toml_table_t *table, const char *key) {
+    toml_datum_t server = toml_string_in(table, key);
+    if (server.ok) {
+        int pool = upstreams_add_pool(upstreams, &server.u.s, 1);
+        free(server.u.s);
+        return pool;
+    }
+
+    toml_array_t *servers_toml = toml_array_in(table, key);
+    if (!servers_toml) {
+        return -1;
+    }
+
+    int len = toml_array_nelem(servers_toml);
+    char **servers = malloc(sizeof(char *) * (len ? len : 1));
+    if (!servers) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    int count = 0;
+    for (; count < len; count++) {
+        toml_datum_t server = toml_string_at(servers_toml, count);
+        if (!server.ok) {
+            break;
+        }
+        servers[count] = server.u.s;
+    }
+
+    int pool = count == len ? upstreams_add_pool(upstreams, servers, count) : -1;
+
+    for (int i = 0; i < count; i++) {
+        free(servers[i]);
+    }
+    free(servers);
+
+    return pool;
+}
+
+static void add_file(policy_t *policy, const char *path) {
+    policy->files = realloc(policy->files, sizeof(char *) * (policy->files_count + 1));
+    char *copy = strdup(path);
+    if (!policy->files || !copy) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    policy->files[policy->files_count++] = copy;
+}
@@ -0,0 +1,57 @@
+#ifndef DNSPROXY_POLICY_H
+#define DNSPROXY_POLICY_H
+
+#include <toml.h>
+#include <netinet/in.h>
+
+#include "blacklist.h"
+#include "upstream.h"
+#include "reply.h"
+#include "records.h"
+#include "lpm.h"
+#include "ipset.h"
+
+#define POLICY_DEFAULT_POOL 0
+
+// lists for the clients in some address ranges, applied on top of the global ones
+typedef struct {
+    char *name;
+    blacklist_t blacklist;
+    blacklist_t allowlist; // names allowed even if a blacklist has them
+} policy_group_t;
+
+// everything the config decides about answering a query, rebuilt as a whole on reload
+typedef struct {
+    blacklist_t blacklist; // also holds the forward zones
+    blacklist_t allowlist;
+    policy_group_t *groups;
+    int groups_count;
+    lpm_t clients; // client address to group
+    ipset_t blocked_ips; // answers with these addresses are blocked
+    upstreams_t upstreams;
+    upstreams_t peers; // other proxies sharing their caches, in one pool with this one
+    int peer_self;     // into peers.upstreams, -1 without peers
+    reply_templates_t reply_templates;
+    local_records_t local_records;
+    char **files; // list files the policy was built from
+    int files_count;
+} policy_t;
+
+policy_t *policy_load(toml_table_t *conf);
+void policy_free(policy_t *policy);
+
+// checks every question against the lists of the client's group and the global ones, forward
+// is set to the forward zone of the first question if not null
+char policy_allows_request(policy_t *policy,
+                           const struct sockaddr_in *client,
+                           const char *buffer,
+                           size_t len,
+                           int *forward);
+// checks the CNAME targets in the answers against the same lists and the A and AAAA answers
+// against the blocked addresses, does not allocate
+char policy_allows_response(policy_t *policy,
+                            const struct sockaddr_in *client,
+                            const char *buffer,
+                            size_t len);
+
+#endif
@@ -0,0 +1,52 @@
+#include "qsbr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define QSBR_POLL_NS 1000000
+
+int qsbr_init(qsbr_t *qsbr, int workers_count) {
+    atomic_init(&qsbr->epoch, 0);
+    qsbr->workers_count = workers_count;
+    qsbr->workers = malloc(sizeof(_Atomic uint64_t) * workers_count);
+    if (!qsbr->workers) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    for (int i = 0; i < workers_count; i++) {
+        atomic_init(&qsbr->workers[i], QSBR_OFFLINE);
+    }
+
+    return 0;
+}
+
+void qsbr_free(qsbr_t *qsbr) {
+    free(qsbr->workers);
+    qsbr->workers = 0;
+    qsbr->workers_count = 0;
+}
+
+void qsbr_quiescent(qsbr_t *qsbr, int worker) {
+    atomic_store(&qsbr->workers[worker], atomic_load(&qsbr->epoch));
+}
+
+void qsbr_offline(qsbr_t *qsbr, int worker) {
+    atomic_store(&qsbr->workers[worker], QSBR_OFFLINE);
+}
+
+void qsbr_online(qsbr_t *qsbr, int worker) {
+    qsbr_quiescent(qsbr, worker);
+}
+
+void qsbr_synchronize(qsbr_t *qsbr) {
+    uint64_t target = atomic_fetch_add(&qsbr->epoch, 1) + 1;
+
+    struct timespec delay = {0, QSBR_POLL_NS};
+    for (int i = 0; i < qsbr->workers_count; i++) {
+        while (atomic_load(&qsbr->workers[i]) < target) {
+            nanosleep(&delay, 0);
+        }
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef DNSPROXY_QSBR_H
+#define DNSPROXY_QSBR_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define QSBR_OFFLINE UINT64_MAX
+
+// quiescent state based reclamation: workers read shared data without locks and report
+// points where they hold no references, a writer that unpublished something waits for every
+// worker to pass such a point before freeing it
+typedef struct {
+    _Atomic uint64_t epoch;
+    _Atomic uint64_t *workers; // epoch seen at the last quiescent point, or QSBR_OFFLINE
+    int workers_count;
+} qsbr_t;
+
+int qsbr_init(qsbr_t *qsbr, int workers_count);
+void qsbr_free(qsbr_t *qsbr);
+
+// worker side, never blocks
+void qsbr_quiescent(qsbr_t *qsbr, int worker);
+// an offline worker holds no references and is not waited for, e.g. while it sleeps in poll
+void qsbr_offline(qsbr_t *qsbr, int worker);
+void qsbr_online(qsbr_t *qsbr, int worker);
+
+// writer side, returns once every worker has passed a quiescent point after the call
+void qsbr_synchronize(qsbr_t *qsbr);
+
+#endif
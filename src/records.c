@@ -0,0 +1,582 @@
+#include "records.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <strings.h>
+#include <arpa/inet.h>
+
+#define DISPLACEMENT_MULTIPLIER 0x9e3779b97f4a7c15ull
+#define MAX_CNAME_HOPS 8
+#define MAX_MESSAGE_SIZE 512
+
+typedef struct {
+    int start; // first record of the name in the sorted pending array
+    int len;
+} record_group_t;
+
+static int add_record(local_records_t *records,
+                      const uint8_t *name,
+                      size_t name_len,
+                      uint16_t type,
+                      uint32_t ttl,
+                      const void *rdata,
+                      size_t rdlength);
+static int add_address(local_records_t *records,
+                       const char *name,
+                       const char *address,
+                       uint32_t ttl,
+                       char with_ptr);
+static int reverse_name(int family, const uint8_t *address, uint8_t *name, size_t *name_len);
+static int compare_records(const void *a, const void *b);
+static uint32_t slot_for(const local_records_t *records, uint64_t hash);
+static int build_perfect_hash(local_records_t *records,
+                              const uint64_t *hashes,
+                              uint32_t *slot_of_group);
+static void build_answer(local_records_t *records,
+                         const record_group_t *groups,
+                         const uint32_t *group_of_slot,
+                         uint32_t slot,
+                         local_answer_kind_t kind);
+static void append_data(local_records_t *records, const void *data, size_t len);
+
+void local_records_init(local_records_t *records) {
+    memset(records, 0, sizeof(*records));
+}
+
+void local_records_free(local_records_t *records) {
+    free(records->pending);
+    free(records->names);
+    free(records->displacements);
+    free(records->data);
+    memset(records, 0, sizeof(*records));
+}
+
+int local_records_add(local_records_t *records,
+                      const char *name,
+                      const char *type,
+                      const char *value,
+                      uint32_t ttl) {
+    if (strcasecmp(type, "A") == 0 || strcasecmp(type, "AAAA") == 0) {
+        int family = strcasecmp(type, "A") == 0 ? AF_INET : AF_INET6;
+        uint8_t address[16];
+        if (inet_pton(family, value, address) != 1) {
+            return -1;
+        }
+
+        return add_address(records, name, value, ttl, 0);
+    }
+
+    uint16_t rr_type;
+    if (strcasecmp(type, "CNAME") == 0) {
+        rr_type = DNS_TYPE_CNAME;
+    } else if (strcasecmp(type, "PTR") == 0) {
+        rr_type = DNS_TYPE_PTR;
+    } else {
+        return -1;
+    }
+
+    uint8_t owner[DNS_MAX_NAME_LEN];
+    size_t owner_len;
+    uint8_t address[16];
+    if (rr_type == DNS_TYPE_PTR && inet_pton(AF_INET, name, address) == 1) {
+        reverse_name(AF_INET, address, owner, &owner_len);
+    } else if (rr_type == DNS_TYPE_PTR && inet_pton(AF_INET6, name, address) == 1) {
+        reverse_name(AF_INET6, address, owner, &owner_len);
+    } else if (dns_name_from_str(name, owner, &owner_len)) {
+        return -1;
+    }
+
+    uint8_t target[DNS_MAX_NAME_LEN];
+    size_t target_len;
+    if (dns_name_from_str(value, target, &target_len)) {
+        return -1;
+    }
+
+    return add_record(records, owner, owner_len, rr_type, ttl, target, target_len);
+}
+
+int local_records_load_hosts(local_records_t *records, const char *path, uint32_t ttl) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[1024];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_number++;
+        line[strcspn(line, "#\r\n")] = 0;
+
+        char *save;
+        char *address = strtok_r(line, " \t", &save);
+        if (!address) {
+            continue;
+        }
+
+        char first = 1;
+        for (char *name = strtok_r(0, " \t", &save); name; name = strtok_r(0, " \t", &save)) {
+            // the first name is canonical and gets the reverse mapping
+            if (add_address(records, name, address, ttl, first)) {
+                fprintf(stderr, "%s:%d: invalid entry %s %s\n", path, line_number, address, name);
+                break;
+            }
+            first = 0;
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+int local_records_compile(local_records_t *records) {
+    if (records->pending_len == 0) {
+        return 0;
+    }
+
+    qsort(records->pending, records->pending_len, sizeof(local_record_t), compare_records);
+
+    // drop duplicates, then group the records by owner name
+    int unique = 0;
+    for (int i = 0; i < records->pending_len; i++) {
+        if (unique && compare_records(&records->pending[unique - 1], &records->pending[i]) == 0) {
+            continue;
+        }
+        records->pending[unique++] = records->pending[i];
+    }
+    records->pending_len = unique;
+
+    record_group_t *groups = malloc(sizeof(record_group_t) * unique);
+    uint64_t *hashes = malloc(sizeof(uint64_t) * unique);
+    if (!groups || !hashes) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    int groups_count = 0;
+    for (int i = 0; i < unique; i++) {
+        const local_record_t *record = &records->pending[i];
+        const local_record_t *previous = groups_count ? &records->pending[i - 1] : 0;
+        if (previous && previous->name_len == record->name_len &&
+            memcmp(previous->name, record->name, record->name_len) == 0) {
+            groups[groups_count - 1].len++;
+            continue;
+        }
+
+        groups[groups_count].start = i;
+        groups[groups_count].len = 1;
+        hashes[groups_count] = hash_bytes(record->name, record->name_len, 0);
+        groups_count++;
+    }
+
+    records->names_count = groups_count;
+    records->names = calloc(groups_count, sizeof(local_name_t));
+    records->displacements = calloc(groups_count, sizeof(int32_t));
+    uint32_t *slot_of_group = malloc(sizeof(uint32_t) * groups_count);
+    uint32_t *group_of_slot = malloc(sizeof(uint32_t) * groups_count);
+    if (!records->names || !records->displacements || !slot_of_group || !group_of_slot) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    if (build_perfect_hash(records, hashes, slot_of_group)) {
+        fprintf(stderr, "failed to build perfect hash of local records\n");
+        free(groups);
+        free(hashes);
+        free(slot_of_group);
+        free(group_of_slot);
+        return -1;
+    }
+
+    for (int g = 0; g < groups_count; g++) {
+        const local_record_t *record = &records->pending[groups[g].start];
+        local_name_t *name = &records->names[slot_of_group[g]];
+        name->name_offset = records->data_len;
+        name->name_len = record->name_len;
+        append_data(records, record->name, record->name_len);
+        group_of_slot[slot_of_group[g]] = g;
+    }
+
+    for (int slot = 0; slot < groups_count; slot++) {
+        for (int kind = 0; kind < LOCAL_ANSWER_COUNT; kind++) {
+            build_answer(records, groups, group_of_slot, slot, kind);
+        }
+    }
+
+    printf("compiled %d local records for %d names\n", unique, groups_count);
+
+    free(groups);
+    free(hashes);
+    free(slot_of_group);
+    free(group_of_slot);
+
+    free(records->pending);
+    records->pending = 0;
+    records->pending_len = 0;
+    records->pending_capacity = 0;
+
+    return 0;
+}
+
+const local_answer_t *local_records_lookup(const local_records_t *records,
+                                           const uint8_t *name,
+                                           size_t name_len,
+                                           uint16_t qtype) {
+    if (records->names_count == 0) {
+        return 0;
+    }
+
+    uint32_t slot = slot_for(records, hash_bytes(name, name_len, 0));
+    const local_name_t *entry = &records->names[slot];
+    if (entry->name_len != name_len ||
+        memcmp(records->data + entry->name_offset, name, name_len) != 0) {
+        return 0;
+    }
+
+    switch (qtype) {
+    case DNS_TYPE_A:
+        return &entry->answers[LOCAL_ANSWER_A];
+    case DNS_TYPE_AAAA:
+        return &entry->answers[LOCAL_ANSWER_AAAA];
+    case DNS_TYPE_PTR:
+        return &entry->answers[LOCAL_ANSWER_PTR];
+    case DNS_TYPE_CNAME:
+        return &entry->answers[LOCAL_ANSWER_CNAME];
+    default:
+        return &entry->answers[LOCAL_ANSWER_OTHER];
+    }
+}
+
+static int add_record(local_records_t *records,
+                      const uint8_t *name,
+                      size_t name_len,
+                      uint16_t type,
+                      uint32_t ttl,
+                      const void *rdata,
+                      size_t rdlength) {
+    if (records->pending_len == records->pending_capacity) {
+        records->pending_capacity = records->pending_capacity ? records->pending_capacity * 2 : 64;
+        records->pending =
+            realloc(records->pending, sizeof(local_record_t) * records->pending_capacity);
+        if (!records->pending) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    local_record_t *record = &records->pending[records->pending_len++];
+    memset(record, 0, sizeof(*record));
+    memcpy(record->name, name, name_len);
+    record->name_len = name_len;
+    record->type = type;
+    record->ttl = ttl;
+    memcpy(record->rdata, rdata, rdlength);
+    record->rdlength = rdlength;
+
+    return 0;
+}
+
+static int add_address(local_records_t *records,
+                       const char *name,
+                       const char *address,
+                       uint32_t ttl,
+                       char with_ptr) {
+    uint8_t owner[DNS_MAX_NAME_LEN];
+    size_t owner_len;
+    if (dns_name_from_str(name, owner, &owner_len)) {
+        return -1;
+    }
+
+    int family = strchr(address, ':') ? AF_INET6 : AF_INET;
+    uint8_t rdata[16];
+    if (inet_pton(family, address, rdata) != 1) {
+        return -1;
+    }
+
+    uint16_t type = family == AF_INET ? DNS_TYPE_A : DNS_TYPE_AAAA;
+    add_record(records, owner, owner_len, type, ttl, rdata, family == AF_INET ? 4 : 16);
+
+    if (with_ptr) {
+        uint8_t reverse[DNS_MAX_NAME_LEN];
+        size_t reverse_len;
+        reverse_name(family, rdata, reverse, &reverse_len);
+        add_record(records, reverse, reverse_len, DNS_TYPE_PTR, ttl, owner, owner_len);
+    }
+
+    return 0;
+}
+
+static int reverse_name(int family, const uint8_t *address, uint8_t *name, size_t *name_len) {
+    char str[80];
+    size_t len = 0;
+
+    if (family == AF_INET) {
+        len = snprintf(str,
+                       sizeof(str),
+                       "%d.%d.%d.%d.in-addr.arpa",
+                       address[3],
+                       address[2],
+                       address[1],
+                       address[0]);
+    } else {
+        static const char digits[] = "0123456789abcdef";
+        for (int i = 15; i >= 0; i--) {
+            str[len++] = digits[address[i] & 0x0f];
+            str[len++] = '.';
+            str[len++] = digits[address[i] >> 4];
+            str[len++] = '.';
+        }
+        memcpy(str + len, "ip6.arpa", sizeof("ip6.arpa"));
+    }
+
+    return dns_name_from_str(str, name, name_len);
+}
+
+static int compare_records(const void *a, const void *b) {
+    const local_record_t *left = a;
+    const local_record_t *right = b;
+
+    if (left->name_len != right->name_len) {
+        return left->name_len - right->name_len;
+    }
+
+    int ret = memcmp(left->name, right->name, left->name_len);
+    if (ret) {
+        return ret;
+    }
+
+    if (left->type != right->type) {
+        return left->type - right->type;
+    }
+
+    if (left->rdlength != right->rdlength) {
+        return left->rdlength - right->rdlength;
+    }
+
+    return memcmp(left->rdata, right->rdata, left->rdlength);
+}
+
+// hash and displace: a bucket either stores the seed that sends all of its keys to free slots,
+// or, for single key buckets, the slot itself as -(slot + 1)
+static uint32_t slot_for(const local_records_t *records, uint64_t hash) {
+    int32_t displacement = records->displacements[hash % records->names_count];
+    if (displacement < 0) {
+        return -displacement - 1;
+    }
+
+    return hash_mix(hash + displacement * DISPLACEMENT_MULTIPLIER) % records->names_count;
+}
+
+static int build_perfect_hash(local_records_t *records,
+                              const uint64_t *hashes,
+                              uint32_t *slot_of_group) {
+    uint32_t n = records->names_count;
+
+    // keys of every bucket, as a linked list through next
+    int32_t *heads = malloc(sizeof(int32_t) * n);
+    int32_t *next = malloc(sizeof(int32_t) * n);
+    uint32_t *sizes = calloc(n, sizeof(uint32_t));
+    uint32_t *order = malloc(sizeof(uint32_t) * n);
+    char *used = calloc(n, 1);
+    uint32_t *candidate = malloc(sizeof(uint32_t) * n);
+    if (!heads || !next || !sizes || !order || !used || !candidate) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        heads[i] = -1;
+    }
+
+    for (uint32_t g = 0; g < n; g++) {
+        uint32_t bucket = hashes[g] % n;
+        next[g] = heads[bucket];
+        heads[bucket] = g;
+        sizes[bucket]++;
+    }
+
+    // counting sort of the buckets by size, largest first
+    uint32_t max_size = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (sizes[i] > max_size) {
+            max_size = sizes[i];
+        }
+    }
+
+    uint32_t ordered = 0;
+    for (uint32_t size = max_size; size > 0; size--) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (sizes[i] == size) {
+                order[ordered++] = i;
+            }
+        }
+    }
+
+    int ret = 0;
+    uint32_t free_slot = 0;
+    for (uint32_t i = 0; i < ordered && ret == 0; i++) {
+        uint32_t bucket = order[i];
+
+        if (sizes[bucket] == 1) {
+            while (used[free_slot]) {
+                free_slot++;
+            }
+            used[free_slot] = 1;
+            slot_of_group[heads[bucket]] = free_slot;
+            records->displacements[bucket] = -(int32_t)free_slot - 1;
+            continue;
+        }
+
+        int32_t displacement = 1;
+        while (1) {
+            uint32_t placed = 0;
+            for (int32_t g = heads[bucket]; g != -1; g = next[g]) {
+                uint32_t slot = hash_mix(hashes[g] + displacement * DISPLACEMENT_MULTIPLIER) % n;
+                char taken = used[slot];
+                for (uint32_t j = 0; j < placed && !taken; j++) {
+                    taken = candidate[j] == slot;
+                }
+                if (taken) {
+                    break;
+                }
+                candidate[placed++] = slot;
+            }
+
+            if (placed == sizes[bucket]) {
+                break;
+            }
+
+            if (++displacement == INT32_MAX) {
+                ret = -1;
+                break;
+            }
+        }
+
+        uint32_t j = 0;
+        for (int32_t g = heads[bucket]; g != -1 && ret == 0; g = next[g]) {
+            used[candidate[j]] = 1;
+            slot_of_group[g] = candidate[j++];
+        }
+        records->displacements[bucket] = displacement;
+    }
+
+    free(heads);
+    free(next);
+    free(sizes);
+    free(order);
+    free(used);
+    free(candidate);
+
+    return ret;
+}
+
+static int find_group(const local_records_t *records,
+                      const uint32_t *group_of_slot,
+                      const uint8_t *name,
+                      size_t name_len) {
+    uint32_t slot = slot_for(records, hash_bytes(name, name_len, 0));
+    const local_name_t *entry = &records->names[slot];
+    if (entry->name_len != name_len ||
+        memcmp(records->data + entry->name_offset, name, name_len) != 0) {
+        return -1;
+    }
+
+    return group_of_slot[slot];
+}
+
+// Answer records follow a question for this very name, so the first owner is a pointer to the
+// question and the owner after a CNAME is a pointer to the CNAME's target.
+static void build_answer(local_records_t *records,
+                         const record_group_t *groups,
+                         const uint32_t *group_of_slot,
+                         uint32_t slot,
+                         local_answer_kind_t kind) {
+    static const uint16_t kind_types[LOCAL_ANSWER_COUNT] = {
+        DNS_TYPE_A, DNS_TYPE_AAAA, DNS_TYPE_PTR, DNS_TYPE_CNAME, 0};
+    uint16_t type = kind_types[kind];
+
+    int group = group_of_slot[slot];
+    const local_record_t *first = &records->pending[groups[group].start];
+    size_t base = sizeof(dns_header_t) + first->name_len + 4;
+
+    char answer[MAX_MESSAGE_SIZE];
+    size_t len = 0;
+    uint16_t an_count = 0;
+    uint16_t owner = 0xc000 | sizeof(dns_header_t);
+
+    for (int hop = 0; hop <= MAX_CNAME_HOPS; hop++) {
+        const local_record_t *group_records = &records->pending[groups[group].start];
+        const local_record_t *cname = 0;
+        char matched = 0;
+
+        for (int i = 0; i < groups[group].len; i++) {
+            const local_record_t *record = &group_records[i];
+            if (record->type == DNS_TYPE_CNAME && !cname) {
+                cname = record;
+            }
+            if (record->type != type) {
+                continue;
+            }
+
+            matched = 1;
+            if (base + len + 12 + record->rdlength > MAX_MESSAGE_SIZE) {
+                break;
+            }
+
+            dns_write_u16(answer, len, owner);
+            dns_write_u16(answer, len + 2, record->type);
+            dns_write_u16(answer, len + 4, DNS_CLASS_IN);
+            dns_write_u32(answer, len + 6, record->ttl);
+            dns_write_u16(answer, len + 10, record->rdlength);
+            memcpy(answer + len + 12, record->rdata, record->rdlength);
+            len += 12 + record->rdlength;
+            an_count++;
+        }
+
+        if (matched || !cname || base + len + 12 + cname->rdlength > MAX_MESSAGE_SIZE) {
+            break;
+        }
+
+        dns_write_u16(answer, len, owner);
+        dns_write_u16(answer, len + 2, DNS_TYPE_CNAME);
+        dns_write_u16(answer, len + 4, DNS_CLASS_IN);
+        dns_write_u32(answer, len + 6, cname->ttl);
+        dns_write_u16(answer, len + 10, cname->rdlength);
+        memcpy(answer + len + 12, cname->rdata, cname->rdlength);
+        owner = 0xc000 | (base + len + 12);
+        len += 12 + cname->rdlength;
+        an_count++;
+
+        group = find_group(records, group_of_slot, cname->rdata, cname->rdlength);
+        if (group < 0) {
+            break;
+        }
+    }
+
+    local_answer_t *entry = &records->names[slot].answers[kind];
+    entry->offset = records->data_len;
+    entry->len = len;
+    entry->an_count = an_count;
+    append_data(records, answer, len);
+}
+
+static void append_data(local_records_t *records, const void *data, size_t len) {
+    if (records->data_len + len > records->data_capacity) {
+        while (records->data_len + len > records->data_capacity) {
+            records->data_capacity = records->data_capacity ? records->data_capacity * 2 : 4096;
+        }
+        records->data = realloc(records->data, records->data_capacity);
+        if (!records->data) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    memcpy(records->data + records->data_len, data, len);
+    records->data_len += len;
+}
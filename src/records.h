@@ -0,0 +1,72 @@
+#ifndef DNSPROXY_RECORDS_H
+#define DNSPROXY_RECORDS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dns.h"
+
+// answer sections are precomputed for these qtypes, everything else gets LOCAL_ANSWER_OTHER
+typedef enum {
+    LOCAL_ANSWER_A,
+    LOCAL_ANSWER_AAAA,
+    LOCAL_ANSWER_PTR,
+    LOCAL_ANSWER_CNAME,
+    LOCAL_ANSWER_OTHER,
+    LOCAL_ANSWER_COUNT,
+} local_answer_kind_t;
+
+typedef struct {
+    uint32_t offset; // into local_records_t.data
+    uint16_t len;
+    uint16_t an_count;
+} local_answer_t;
+
+typedef struct {
+    uint32_t name_offset; // into local_records_t.data
+    uint8_t name_len;
+    local_answer_t answers[LOCAL_ANSWER_COUNT];
+} local_name_t;
+
+typedef struct {
+    uint8_t name[DNS_MAX_NAME_LEN];
+    uint8_t name_len;
+    uint16_t type;
+    uint32_t ttl;
+    uint8_t rdata[DNS_MAX_NAME_LEN];
+    uint8_t rdlength;
+} local_record_t;
+
+// records are collected with local_records_add and local_records_load_hosts, then
+// local_records_compile turns them into a minimal perfect hash over the owner names
+typedef struct {
+    local_record_t *pending;
+    int pending_len;
+    int pending_capacity;
+
+    local_name_t *names; // slot i of the perfect hash
+    int32_t *displacements;
+    uint32_t names_count;
+    char *data;
+    size_t data_len;
+    size_t data_capacity;
+} local_records_t;
+
+void local_records_init(local_records_t *records);
+void local_records_free(local_records_t *records);
+
+int local_records_add(local_records_t *records,
+                      const char *name,
+                      const char *type,
+                      const char *value,
+                      uint32_t ttl);
+int local_records_load_hosts(local_records_t *records, const char *path, uint32_t ttl);
+int local_records_compile(local_records_t *records);
+
+// returns the precomputed answer section for a question, or 0 if the name is not local
+const local_answer_t *local_records_lookup(const local_records_t *records,
+                                           const uint8_t *name,
+                                           size_t name_len,
+                                           uint16_t qtype);
+
+#endif
@@ -0,0 +1,201 @@
+#include "reply.h"
+
+#include <string.h>
+
+#define NAME_POINTER (0xc000 | sizeof(dns_header_t))
+
+static int send_scratch(int sock_fd,
+                        reply_scratch_t *scratch,
+                        const char *query,
+                        size_t question_len,
+                        const char *tail,
+                        size_t tail_len,
+                        const struct sockaddr *addr,
+                        socklen_t addr_len);
+static void init_template(reply_template_t *template, uint8_t rcode, char echo_question);
+static void add_address_record(reply_template_t *template, uint16_t type, uint32_t ttl);
+static void add_soa_record(reply_template_t *template, uint32_t ttl);
+
+void reply_templates_init(reply_templates_t *templates,
+                          block_mode_t mode,
+                          uint8_t refuse_rcode,
+                          uint32_t ttl) {
+    reply_template_t *block = &templates->templates[REPLY_BLOCK];
+    switch (mode) {
+    case BLOCK_MODE_REFUSE:
+        init_template(block, refuse_rcode, 1);
+        break;
+    case BLOCK_MODE_NXDOMAIN:
+        init_template(block, DNS_RCODE_NXDOMAIN, 1);
+        add_soa_record(block, ttl);
+        break;
+    case BLOCK_MODE_NODATA:
+    case BLOCK_MODE_NULL:
+        init_template(block, DNS_RCODE_NOERROR, 1);
+        add_soa_record(block, ttl);
+        break;
+    }
+
+    templates->templates[REPLY_BLOCK_A] = *block;
+    templates->templates[REPLY_BLOCK_AAAA] = *block;
+    if (mode == BLOCK_MODE_NULL) {
+        init_template(&templates->templates[REPLY_BLOCK_A], DNS_RCODE_NOERROR, 1);
+        add_address_record(&templates->templates[REPLY_BLOCK_A], DNS_TYPE_A, ttl);
+        init_template(&templates->templates[REPLY_BLOCK_AAAA], DNS_RCODE_NOERROR, 1);
+        add_address_record(&templates->templates[REPLY_BLOCK_AAAA], DNS_TYPE_AAAA, ttl);
+    }
+
+    init_template(&templates->templates[REPLY_SERVFAIL], DNS_RCODE_SERVFAIL, 1);
+    init_template(&templates->templates[REPLY_FORMERR], DNS_RCODE_FORMERR, 0);
+}
+
+reply_kind_t reply_block_kind(uint16_t qtype) {
+    if (qtype == DNS_TYPE_A) {
+        return REPLY_BLOCK_A;
+    } else if (qtype == DNS_TYPE_AAAA) {
+        return REPLY_BLOCK_AAAA;
+    }
+
+    return REPLY_BLOCK;
+}
+
+int reply_send(int sock_fd,
+               const reply_template_t *template,
+               reply_scratch_t *scratch,
+               const char *query,
+               size_t question_len,
+               const struct sockaddr *addr,
+               socklen_t addr_len) {
+    const dns_header_t *query_header = (const dns_header_t *)query;
+
+    scratch->header = template->counts;
+    scratch->header.id = query_header->id;
+    scratch->header.flags = template->flags | (query_header->flags & htons(0x7900));
+
+    if (!template->echo_question || !question_len) {
+        // without a question the tail's name pointers would dangle
+        scratch->header.an_count = 0;
+        scratch->header.ns_count = 0;
+        return send_scratch(sock_fd, scratch, query, 0, 0, 0, addr, addr_len);
+    }
+
+    return send_scratch(
+        sock_fd, scratch, query, question_len, template->tail, template->tail_len, addr, addr_len);
+}
+
+int reply_send_answer(int sock_fd,
+                      reply_scratch_t *scratch,
+                      const char *query,
+                      size_t question_len,
+                      uint16_t an_count,
+                      const char *answer,
+                      size_t answer_len,
+                      const struct sockaddr *addr,
+                      socklen_t addr_len) {
+    const dns_header_t *query_header = (const dns_header_t *)query;
+
+    uint16_t flags = 0;
+    flags |= (1 << 15);
+    flags |= (1 << 10); // AA
+    flags |= (1 << 7);  // RA
+
+    memset(&scratch->header, 0, sizeof(scratch->header));
+    scratch->header.id = query_header->id;
+    scratch->header.flags = htons(flags) | (query_header->flags & htons(0x7900));
+    scratch->header.an_count = htons(an_count);
+
+    return send_scratch(sock_fd, scratch, query, question_len, answer, answer_len, addr, addr_len);
+}
+
+static int send_scratch(int sock_fd,
+                        reply_scratch_t *scratch,
+                        const char *query,
+                        size_t question_len,
+                        const char *tail,
+                        size_t tail_len,
+                        const struct sockaddr *addr,
+                        socklen_t addr_len) {
+    int iov_count = 1;
+    scratch->iov[0].iov_base = &scratch->header;
+    scratch->iov[0].iov_len = sizeof(dns_header_t);
+
+    if (question_len) {
+        scratch->header.qd_count = htons(1);
+        scratch->iov[iov_count].iov_base = (void *)(query + sizeof(dns_header_t));
+        scratch->iov[iov_count].iov_len = question_len;
+        iov_count++;
+    }
+
+    if (tail_len) {
+        scratch->iov[iov_count].iov_base = (void *)tail;
+        scratch->iov[iov_count].iov_len = tail_len;
+        iov_count++;
+    }
+
+    scratch->msg.msg_name = (void *)addr;
+    scratch->msg.msg_namelen = addr_len;
+    scratch->msg.msg_iov = scratch->iov;
+    scratch->msg.msg_iovlen = iov_count;
+    scratch->msg.msg_control = 0;
+    scratch->msg.msg_controllen = 0;
+    scratch->msg.msg_flags = 0;
+
+    return sendmsg(sock_fd, &scratch->msg, 0);
+}
+
+static void init_template(reply_template_t *template, uint8_t rcode, char echo_question) {
+    memset(template, 0, sizeof(*template));
+
+    uint16_t flags = 0;
+    flags |= (1 << 15);
+    flags |= (1 << 7); // RA
+    flags |= rcode;
+    template->flags = htons(flags);
+    template->echo_question = echo_question;
+}
+
+static void add_address_record(reply_template_t *template, uint16_t type, uint32_t ttl) {
+    char *record = template->tail + template->tail_len;
+    size_t rdlength = type == DNS_TYPE_A ? 4 : 16;
+
+    dns_write_u16(record, 0, NAME_POINTER);
+    dns_write_u16(record, 2, type);
+    dns_write_u16(record, 4, DNS_CLASS_IN);
+    dns_write_u32(record, 6, ttl);
+    dns_write_u16(record, 10, rdlength);
+    memset(record + 12, 0, rdlength);
+
+    template->tail_len += 12 + rdlength;
+    template->counts.an_count = htons(ntohs(template->counts.an_count) + 1);
+}
+
+// SOA owned by the blocked name itself, so negative caching covers exactly that name
+static void add_soa_record(reply_template_t *template, uint32_t ttl) {
+    static const char rname[] = "\x0ahostmaster";
+
+    char *record = template->tail + template->tail_len;
+    size_t rdlength = 2 + sizeof(rname) - 1 + 2 + 20;
+
+    dns_write_u16(record, 0, NAME_POINTER);
+    dns_write_u16(record, 2, DNS_TYPE_SOA);
+    dns_write_u16(record, 4, DNS_CLASS_IN);
+    dns_write_u32(record, 6, ttl);
+    dns_write_u16(record, 10, rdlength);
+
+    size_t offset = 12;
+    dns_write_u16(record, offset, NAME_POINTER); // mname
+    offset += 2;
+    memcpy(record + offset, rname, sizeof(rname) - 1);
+    offset += sizeof(rname) - 1;
+    dns_write_u16(record, offset, NAME_POINTER);
+    offset += 2;
+
+    dns_write_u32(record, offset, 1);          // serial
+    dns_write_u32(record, offset + 4, 3600);   // refresh
+    dns_write_u32(record, offset + 8, 600);    // retry
+    dns_write_u32(record, offset + 12, 86400); // expire
+    dns_write_u32(record, offset + 16, ttl);   // minimum
+
+    template->tail_len += 12 + rdlength;
+    template->counts.ns_count = htons(ntohs(template->counts.ns_count) + 1);
+}
@@ -0,0 +1,76 @@
+#ifndef DNSPROXY_REPLY_H
+#define DNSPROXY_REPLY_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "dns.h"
+
+#define REPLY_MAX_TAIL 64
+
+typedef enum {
+    BLOCK_MODE_REFUSE,   // header and question with the configured rcode
+    BLOCK_MODE_NXDOMAIN, // NXDOMAIN with a synthesized SOA
+    BLOCK_MODE_NODATA,   // NOERROR, no answers, synthesized SOA
+    BLOCK_MODE_NULL,     // 0.0.0.0 for A, :: for AAAA, NODATA for everything else
+} block_mode_t;
+
+typedef enum {
+    REPLY_BLOCK,
+    REPLY_BLOCK_A,
+    REPLY_BLOCK_AAAA,
+    REPLY_SERVFAIL,
+    REPLY_FORMERR,
+    REPLY_KIND_COUNT,
+} reply_kind_t;
+
+// a locally generated reply without its id and question; records after the question refer
+// to the question name by a pointer, so the tail is the same for every query
+typedef struct {
+    uint16_t flags; // network order, opcode and RD are taken from the query
+    dns_header_t counts;
+    char echo_question;
+    uint8_t tail_len;
+    char tail[REPLY_MAX_TAIL];
+} reply_template_t;
+
+typedef struct {
+    reply_template_t templates[REPLY_KIND_COUNT];
+} reply_templates_t;
+
+// per worker, holds the only bytes that differ between two replies of the same kind
+typedef struct {
+    dns_header_t header;
+    struct iovec iov[3];
+    struct msghdr msg;
+} reply_scratch_t;
+
+void reply_templates_init(reply_templates_t *templates,
+                          block_mode_t mode,
+                          uint8_t refuse_rcode,
+                          uint32_t ttl);
+
+reply_kind_t reply_block_kind(uint16_t qtype);
+
+// question_len is the length of the first question of query, 0 for replies without it
+int reply_send(int sock_fd,
+               const reply_template_t *template,
+               reply_scratch_t *scratch,
+               const char *query,
+               size_t question_len,
+               const struct sockaddr *addr,
+               socklen_t addr_len);
+
+// authoritative NOERROR reply carrying precomputed answer records after the question
+int reply_send_answer(int sock_fd,
+                      reply_scratch_t *scratch,
+                      const char *query,
+                      size_t question_len,
+                      uint16_t an_count,
+                      const char *answer,
+                      size_t answer_len,
+                      const struct sockaddr *addr,
+                      socklen_t addr_len);
+
+#endif
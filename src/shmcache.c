@@ -0,0 +1,239 @@
+#include "shmcache.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHMCACHE_OPEN_WAIT 1000 // ms another process may take to create the segment
+
+static size_t buckets_offset();
+static int wait_for_creator(int fd, shmcache_header_t **header, size_t size);
+static char lock_stripe(_Atomic uint32_t *lock);
+
+int shmcache_open(shmcache_t *shm, const char *name, size_t size, uint32_t max_stale) {
+    memset(shm, 0, sizeof(*shm));
+
+    if (size < buckets_offset() + sizeof(shmcache_bucket_t)) {
+        fprintf(stderr, "shared cache %s is too small\n", name);
+        return -1;
+    }
+
+    char created = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "failed to open shared cache %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    shmcache_header_t *header = 0;
+    if (created) {
+        if (ftruncate(fd, size)) {
+            fprintf(stderr, "failed to resize shared cache %s: %s\n", name, strerror(errno));
+            shm_unlink(name);
+            close(fd);
+            return -1;
+        }
+
+        header = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (header == MAP_FAILED) {
+            fprintf(stderr, "failed to map shared cache %s: %s\n", name, strerror(errno));
+            shm_unlink(name);
+            close(fd);
+            return -1;
+        }
+
+        // the segment comes zeroed, so every bucket starts empty and unlocked
+        header->version = SHMCACHE_VERSION;
+        header->size = size;
+        header->buckets_count = (size - buckets_offset()) / sizeof(shmcache_bucket_t);
+        atomic_store_explicit(&header->ready, 1, memory_order_release);
+    } else if (wait_for_creator(fd, &header, size)) {
+        fprintf(stderr, "shared cache %s exists with another size or version\n", name);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    shm->header = header;
+    shm->buckets = (shmcache_bucket_t *)((char *)header + buckets_offset());
+    shm->buckets_count = header->buckets_count;
+    shm->size = size;
+    shm->max_stale = (uint64_t)max_stale * 1000;
+
+    return 0;
+}
+
+void shmcache_close(shmcache_t *shm) {
+    // the segment outlives the process, so the next one to start finds it warm
+    if (shm->header) {
+        munmap(shm->header, shm->size);
+        shm->header = 0;
+    }
+}
+
+char shmcache_lookup(const shmcache_t *shm,
+                     const uint8_t *key,
+                     size_t key_len,
+                     uint64_t now,
+                     char *message,
+                     size_t *len,
+                     uint64_t *stored_at,
+                     uint64_t *expires_at) {
+    uint64_t hash = hash_bytes(key, key_len, 0);
+    shmcache_bucket_t *bucket = &shm->buckets[hash % shm->buckets_count];
+
+    for (int attempt = 0; attempt < SHMCACHE_READ_RETRIES; attempt++) {
+        uint32_t seq = atomic_load_explicit(&bucket->seq, memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+
+        // fields may be torn by a concurrent writer, they are only trusted once seq is
+        // confirmed unchanged, and lengths are bounded before they are used
+        char found = 0;
+        for (int i = 0; i < SHMCACHE_WAYS; i++) {
+            const shmcache_slot_t *slot = &bucket->slots[i];
+            if (slot->hash != hash || slot->key_len != key_len ||
+                slot->expires_at + shm->max_stale <= now) {
+                continue;
+            }
+
+            size_t message_len = slot->message_len;
+            if (message_len > SHMCACHE_MAX_MESSAGE_LEN || memcmp(slot->data, key, key_len)) {
+                continue;
+            }
+
+            memcpy(message, slot->data + key_len, message_len);
+            *len = message_len;
+            *stored_at = slot->stored_at;
+            *expires_at = slot->expires_at;
+            found = 1;
+            break;
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&bucket->seq, memory_order_relaxed) == seq) {
+            return found;
+        }
+    }
+
+    return 0;
+}
+
+void shmcache_store(shmcache_t *shm,
+                    const uint8_t *key,
+                    size_t key_len,
+                    const char *message,
+                    size_t len,
+                    uint64_t now) {
+    uint32_t ttl;
+    if (len > SHMCACHE_MAX_MESSAGE_LEN || key_len > CACHE_MAX_KEY_LEN ||
+        cache_message_ttl(message, len, &ttl)) {
+        return;
+    }
+
+    uint64_t hash = hash_bytes(key, key_len, 0);
+    uint64_t index = hash % shm->buckets_count;
+    shmcache_bucket_t *bucket = &shm->buckets[index];
+
+    // a stripe left locked by a crashed process only stops caching in its buckets
+    _Atomic uint32_t *lock = &shm->header->locks[index % SHMCACHE_STRIPES];
+    if (!lock_stripe(lock)) {
+        return;
+    }
+
+    // the same key is overwritten, otherwise the slot that expires first
+    shmcache_slot_t *victim = &bucket->slots[0];
+    for (int i = 0; i < SHMCACHE_WAYS; i++) {
+        shmcache_slot_t *slot = &bucket->slots[i];
+        if (slot->hash == hash && slot->key_len == key_len &&
+            memcmp(slot->data, key, key_len) == 0) {
+            victim = slot;
+            break;
+        }
+
+        if (slot->expires_at < victim->expires_at) {
+            victim = slot;
+        }
+    }
+
+    uint32_t seq = atomic_load_explicit(&bucket->seq, memory_order_relaxed);
+    atomic_store_explicit(&bucket->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    victim->hash = hash;
+    victim->stored_at = now;
+    victim->expires_at = now + (uint64_t)ttl * 1000;
+    victim->key_len = key_len;
+    victim->message_len = len;
+    memcpy(victim->data, key, key_len);
+    memcpy(victim->data + key_len, message, len);
+
+    atomic_store_explicit(&bucket->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(lock, 0, memory_order_release);
+}
+
+static size_t buckets_offset() {
+    return (sizeof(shmcache_header_t) + 63) & ~(size_t)63;
+}
+
+// the creator sizes the segment and then sets ready, both are waited for
+static int wait_for_creator(int fd, shmcache_header_t **header, size_t size) {
+    struct stat st;
+    for (int waited = 0; waited < SHMCACHE_OPEN_WAIT; waited++) {
+        if (fstat(fd, &st)) {
+            return -1;
+        }
+        if (st.st_size) {
+            break;
+        }
+        usleep(1000);
+    }
+
+    if ((size_t)st.st_size != size) {
+        return -1;
+    }
+
+    *header = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*header == MAP_FAILED) {
+        return -1;
+    }
+
+    for (int waited = 0; waited < SHMCACHE_OPEN_WAIT; waited++) {
+        if (atomic_load_explicit(&(*header)->ready, memory_order_acquire)) {
+            break;
+        }
+        usleep(1000);
+    }
+
+    if (!atomic_load_explicit(&(*header)->ready, memory_order_acquire) ||
+        (*header)->version != SHMCACHE_VERSION || (*header)->size != size) {
+        munmap(*header, size);
+        return -1;
+    }
+
+    return 0;
+}
+
+static char lock_stripe(_Atomic uint32_t *lock) {
+    for (int i = 0; i < SHMCACHE_LOCK_SPINS; i++) {
+        uint32_t expected = 0;
+        if (atomic_load_explicit(lock, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak_explicit(
+                lock, &expected, 1, memory_order_acquire, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
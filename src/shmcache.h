@@ -0,0 +1,71 @@
+#ifndef DNSPROXY_SHMCACHE_H
+#define DNSPROXY_SHMCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "cache.h"
+
+#define SHMCACHE_VERSION 1
+#define SHMCACHE_MAX_MESSAGE_LEN 512 // udp answers
+#define SHMCACHE_WAYS 4              // slots per bucket
+#define SHMCACHE_STRIPES 1024        // writer locks, bucket i takes lock i % SHMCACHE_STRIPES
+#define SHMCACHE_READ_RETRIES 16     // a read racing with this many writes counts as a miss
+#define SHMCACHE_LOCK_SPINS 4096     // spins before a store gives up on a locked stripe
+
+// second level cache in a named posix shared memory segment, shared by every proxy process on
+// the host. readers copy a bucket under its seqlock and retry if a writer got in between,
+// writers take a striped spinlock and make the sequence odd while they change the bucket
+typedef struct {
+    uint64_t hash;
+    uint64_t stored_at;  // ms since epoch
+    uint64_t expires_at; // ms since epoch, 0 for an empty slot
+    uint16_t key_len;
+    uint16_t message_len;
+    char data[CACHE_MAX_KEY_LEN + SHMCACHE_MAX_MESSAGE_LEN];
+} shmcache_slot_t;
+
+typedef struct {
+    _Atomic uint32_t seq; // odd while a writer is changing the bucket
+    shmcache_slot_t slots[SHMCACHE_WAYS];
+} shmcache_bucket_t;
+
+typedef struct {
+    _Atomic uint32_t ready; // set by the creator once the header is filled in
+    uint32_t version;
+    uint64_t size;
+    uint64_t buckets_count;
+    _Atomic uint32_t locks[SHMCACHE_STRIPES];
+} shmcache_header_t;
+
+typedef struct {
+    shmcache_header_t *header; // 0 if the shared cache is disabled
+    shmcache_bucket_t *buckets;
+    uint64_t buckets_count;
+    size_t size;
+    uint64_t max_stale; // ms expired entries are still returned for
+} shmcache_t;
+
+// opens the segment, or creates it with size bytes. every process has to use the same size
+int shmcache_open(shmcache_t *shm, const char *name, size_t size, uint32_t max_stale);
+void shmcache_close(shmcache_t *shm);
+
+// copies a matching entry that expired less than max_stale ago into message, which holds
+// SHMCACHE_MAX_MESSAGE_LEN bytes
+char shmcache_lookup(const shmcache_t *shm,
+                     const uint8_t *key,
+                     size_t key_len,
+                     uint64_t now,
+                     char *message,
+                     size_t *len,
+                     uint64_t *stored_at,
+                     uint64_t *expires_at);
+void shmcache_store(shmcache_t *shm,
+                    const uint8_t *key,
+                    size_t key_len,
+                    const char *message,
+                    size_t len,
+                    uint64_t now);
+
+#endif
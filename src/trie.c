@@ -0,0 +1,487 @@
+#include "trie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+static int entry_cmp(const void *a, const void *b);
+static int label_cmp(const uint8_t *a, const uint8_t *b);
+static char is_covered(const trie_entry_t *blocker, const trie_entry_t *entry);
+static void compact_entries(trie_t *trie);
+static void move_to_image(trie_t *trie);
+static uint32_t add_node(trie_t *trie, const uint8_t *label);
+static void build_children(trie_t *trie,
+                           uint32_t node_i,
+                           uint64_t hash,
+                           uint8_t *positions,
+                           int lo,
+                           int hi);
+static void bloom_init(trie_t *trie, int entries);
+static void bloom_add(trie_t *trie, uint64_t hash);
+static char bloom_contains(const trie_bloom_block_t *block, uint64_t hash);
+static char bloom_may_match(const trie_t *trie,
+                            const uint8_t *name,
+                            const uint8_t *offsets,
+                            int count);
+static const trie_node_t *find_child(const trie_t *trie,
+                                     const trie_node_t *node,
+                                     const uint8_t *label);
+
+void trie_init(trie_t *trie) {
+    memset(trie, 0, sizeof(*trie));
+}
+
+void trie_free(trie_t *trie) {
+    for (int i = 0; i < trie->entries_len; i++) {
+        free(trie->entries[i].rname);
+    }
+
+    free(trie->entries);
+    if (trie->image) {
+        hugepage_free(trie->image, trie->image_len);
+    } else {
+        free(trie->nodes);
+        free(trie->labels);
+        free(trie->bloom);
+    }
+    trie_init(trie);
+}
+
+int trie_add(trie_t *trie, const char *name, uint8_t flags, int forward) {
+    char below = 0;
+    if (name[0] == '*' && name[1] == '.') {
+        below = 1;
+        name += 2;
+    }
+
+    uint8_t wire[DNS_MAX_NAME_LEN];
+    size_t wire_len;
+    if (dns_name_from_str(name, wire, &wire_len)) {
+        return -1;
+    }
+
+    uint8_t offsets[DNS_MAX_NAME_LEN / 2];
+    int count = 0;
+    for (size_t offset = 0; wire[offset]; offset += wire[offset] + 1) {
+        offsets[count++] = offset;
+    }
+
+    trie_entry_t entry;
+    entry.len = wire_len - 1;
+    entry.rname = malloc(entry.len ? entry.len : 1);
+    if (!entry.rname) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    size_t out = 0;
+    for (int i = count - 1; i >= 0; i--) {
+        memcpy(entry.rname + out, wire + offsets[i], wire[offsets[i]] + 1);
+        out += wire[offsets[i]] + 1;
+    }
+
+    entry.flags = flags;
+    entry.forward = forward;
+    entry.below = below;
+
+    if (trie->entries_len == trie->entries_capacity) {
+        trie->entries_capacity = trie->entries_capacity ? trie->entries_capacity * 2 : 16;
+        trie->entries = realloc(trie->entries, sizeof(trie_entry_t) * trie->entries_capacity);
+        if (!trie->entries) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    trie->entries[trie->entries_len++] = entry;
+
+    return 0;
+}
+
+int trie_compile(trie_t *trie) {
+    qsort(trie->entries, trie->entries_len, sizeof(trie_entry_t), entry_cmp);
+    compact_entries(trie);
+
+    uint8_t *positions = calloc(trie->entries_len ? trie->entries_len : 1, 1);
+    if (!positions) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    if (trie->entries_len >= TRIE_BLOOM_MIN_ENTRIES) {
+        bloom_init(trie, trie->entries_len);
+    }
+
+    static const uint8_t root_label = 0;
+    uint32_t root = add_node(trie, &root_label);
+    build_children(trie, root, 0, positions, 0, trie->entries_len);
+
+    // a rule on the root matches every name, the filter would only be in the way
+    const trie_node_t *root_node = &trie->nodes[root];
+    if (root_node->flags || root_node->forward != TRIE_NO_FORWARD ||
+        root_node->forward_below != TRIE_NO_FORWARD) {
+        free(trie->bloom);
+        trie->bloom = 0;
+    }
+
+    free(positions);
+    for (int i = 0; i < trie->entries_len; i++) {
+        free(trie->entries[i].rname);
+    }
+    free(trie->entries);
+    trie->entries = 0;
+    trie->entries_len = 0;
+    trie->entries_capacity = 0;
+
+    move_to_image(trie);
+
+    return 0;
+}
+
+void trie_match(const trie_t *trie, const uint8_t *name, size_t name_len, trie_match_t *match) {
+    match->blocked = 0;
+    match->forward = TRIE_NO_FORWARD;
+
+    if (!trie->nodes_count) {
+        return;
+    }
+
+    uint8_t offsets[DNS_MAX_NAME_LEN / 2];
+    int count = 0;
+    for (size_t offset = 0; offset < name_len && name[offset]; offset += name[offset] + 1) {
+        offsets[count++] = offset;
+    }
+
+    if (trie->bloom && !bloom_may_match(trie, name, offsets, count)) {
+        return;
+    }
+
+    // node matches labels i..count-1 of the name. a blocked name is still walked down to its
+    // longest forward zone, which applies if the name is allowlisted
+    const trie_node_t *node = &trie->nodes[0];
+    for (int i = count;; i--) {
+        if (node->flags & TRIE_BLOCK) {
+            match->blocked = 1;
+        }
+        if (node->forward != TRIE_NO_FORWARD) {
+            match->forward = node->forward;
+        }
+
+        if (i == 0) {
+            break;
+        }
+
+        if (node->flags & TRIE_BLOCK_BELOW) {
+            match->blocked = 1;
+        }
+        if (node->forward_below != TRIE_NO_FORWARD) {
+            match->forward = node->forward_below;
+        }
+
+        node = find_child(trie, node, name + offsets[i - 1]);
+        if (!node) {
+            break;
+        }
+    }
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    const trie_entry_t *entry_a = a;
+    const trie_entry_t *entry_b = b;
+
+    int ret = memcmp(entry_a->rname,
+                     entry_b->rname,
+                     entry_a->len < entry_b->len ? entry_a->len : entry_b->len);
+    if (ret) {
+        return ret;
+    }
+
+    if (entry_a->len != entry_b->len) {
+        return (int)entry_a->len - (int)entry_b->len;
+    }
+
+    // of two entries for the same name the one covering more goes first
+    if (entry_a->below != entry_b->below) {
+        return (int)entry_a->below - (int)entry_b->below;
+    }
+
+    return (int)(entry_b->flags & TRIE_BLOCK) - (int)(entry_a->flags & TRIE_BLOCK);
+}
+
+// whether entry can never match because blocker, sorted before it, blocks all its names
+static char is_covered(const trie_entry_t *blocker, const trie_entry_t *entry) {
+    if (entry->len < blocker->len || memcmp(entry->rname, blocker->rname, blocker->len)) {
+        return 0;
+    }
+
+    // "*.name" does not cover name itself, unless entry is "*.name" again
+    return !blocker->below || entry->len > blocker->len || entry->below;
+}
+
+// a name's entries sort right before the entries below it, so one pass with the last blocking
+// entry kept finds everything a blocked name covers. forward zones are kept, an allowlisted
+// name below a blocked one still goes to its zone's servers
+static void compact_entries(trie_t *trie) {
+    const trie_entry_t *blocker = 0;
+    int kept = 0;
+
+    for (int i = 0; i < trie->entries_len; i++) {
+        trie_entry_t *entry = &trie->entries[i];
+        if (blocker && entry->forward == TRIE_NO_FORWARD && is_covered(blocker, entry)) {
+            char duplicate = entry->len == blocker->len && entry->below == blocker->below &&
+                             (entry->flags & TRIE_BLOCK);
+            if (duplicate) {
+                trie->duplicates++;
+            } else {
+                trie->covered++;
+            }
+            free(entry->rname);
+            continue;
+        }
+
+        trie->entries[kept] = *entry;
+        if (entry->flags & TRIE_BLOCK) {
+            blocker = &trie->entries[kept];
+        }
+        kept++;
+    }
+
+    trie->entries_len = kept;
+}
+
+// same order as entry_cmp gives on length prefixed labels
+static int label_cmp(const uint8_t *a, const uint8_t *b) {
+    if (a[0] != b[0]) {
+        return (int)a[0] - (int)b[0];
+    }
+
+    return memcmp(a + 1, b + 1, a[0]);
+}
+
+static uint32_t add_node(trie_t *trie, const uint8_t *label) {
+    if (trie->nodes_count == trie->nodes_capacity) {
+        trie->nodes_capacity = trie->nodes_capacity ? trie->nodes_capacity * 2 : 64;
+        trie->nodes = realloc(trie->nodes, sizeof(trie_node_t) * trie->nodes_capacity);
+        if (!trie->nodes) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    if (trie->labels_len + label[0] + 1 > trie->labels_capacity) {
+        while (trie->labels_len + label[0] + 1 > trie->labels_capacity) {
+            trie->labels_capacity = trie->labels_capacity ? trie->labels_capacity * 2 : 1024;
+        }
+        trie->labels = realloc(trie->labels, trie->labels_capacity);
+        if (!trie->labels) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+    }
+
+    trie_node_t *node = &trie->nodes[trie->nodes_count];
+    node->label_offset = trie->labels_len;
+    node->first_child = 0;
+    node->children_count = 0;
+    node->flags = 0;
+    node->forward = TRIE_NO_FORWARD;
+    node->forward_below = TRIE_NO_FORWARD;
+
+    memcpy(trie->labels + trie->labels_len, label, label[0] + 1);
+    trie->labels_len += label[0] + 1;
+
+    return trie->nodes_count++;
+}
+
+// entries lo..hi are sorted and share the labels up to node_i, positions[i] is where the next
+// label of entry i starts, hash is the suffix hash of node_i as bloom_may_match computes it
+static void build_children(trie_t *trie,
+                           uint32_t node_i,
+                           uint64_t hash,
+                           uint8_t *positions,
+                           int lo,
+                           int hi) {
+    int i = lo;
+    for (; i < hi && positions[i] == trie->entries[i].len; i++) {
+        const trie_entry_t *entry = &trie->entries[i];
+        trie_node_t *node = &trie->nodes[node_i];
+        if (entry->below) {
+            node->flags |= (entry->flags & TRIE_BLOCK) ? TRIE_BLOCK_BELOW : 0;
+            if (entry->forward != TRIE_NO_FORWARD) {
+                node->forward_below = entry->forward;
+            }
+        } else {
+            node->flags |= entry->flags;
+            if (entry->forward != TRIE_NO_FORWARD) {
+                node->forward = entry->forward;
+            }
+        }
+    }
+
+    if (i > lo && trie->bloom) {
+        bloom_add(trie, hash);
+    }
+
+    uint32_t groups = 0;
+    for (int j = i; j < hi; j++) {
+        if (j == i || label_cmp(trie->entries[j].rname + positions[j],
+                                trie->entries[j - 1].rname + positions[j - 1])) {
+            groups++;
+        }
+    }
+
+    if (!groups) {
+        return;
+    }
+
+    // children are allocated together so they stay contiguous
+    uint32_t first_child = trie->nodes_count;
+    int start = i;
+    for (int j = i + 1; j <= hi; j++) {
+        if (j == hi || label_cmp(trie->entries[j].rname + positions[j],
+                                 trie->entries[start].rname + positions[start])) {
+            add_node(trie, trie->entries[start].rname + positions[start]);
+            start = j;
+        }
+    }
+
+    trie->nodes[node_i].first_child = first_child;
+    trie->nodes[node_i].children_count = groups;
+
+    uint32_t child = first_child;
+    start = i;
+    for (int j = i + 1; j <= hi; j++) {
+        if (j == hi || label_cmp(trie->entries[j].rname + positions[j],
+                                 trie->entries[start].rname + positions[start])) {
+            const uint8_t *label = trie->entries[start].rname + positions[start];
+            uint64_t child_hash = hash_bytes(label, label[0] + 1, hash);
+
+            uint8_t label_len = label[0];
+            for (int k = start; k < j; k++) {
+                positions[k] += label_len + 1;
+            }
+
+            build_children(trie, child++, child_hash, positions, start, j);
+            start = j;
+        }
+    }
+}
+
+static const trie_node_t *find_child(const trie_t *trie,
+                                     const trie_node_t *node,
+                                     const uint8_t *label) {
+    uint32_t lo = node->first_child;
+    uint32_t hi = node->first_child + node->children_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int ret = label_cmp(label, trie->labels + trie->nodes[mid].label_offset);
+        if (ret == 0) {
+            return &trie->nodes[mid];
+        } else if (ret < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return 0;
+}
+
+// big lists are walked all over, so they are copied to huge pages to save tlb misses
+static void move_to_image(trie_t *trie) {
+    size_t bloom_len = trie->bloom ? (trie->bloom_mask + 1) * sizeof(trie_bloom_block_t) : 0;
+    size_t nodes_len = trie->nodes_count * sizeof(trie_node_t);
+    size_t len = bloom_len + nodes_len + trie->labels_len;
+    if (!hugepage_enabled() || len < HUGEPAGE_SIZE) {
+        return;
+    }
+
+    size_t image_len = len;
+    hugepage_backing_t backing;
+    uint8_t *image = hugepage_alloc(&image_len, 0, &backing);
+    if (!image) {
+        return;
+    }
+
+    // the bloom filter goes first to stay cache line aligned, nodes follow at a multiple of 64
+    memcpy(image, trie->bloom, bloom_len);
+    memcpy(image + bloom_len, trie->nodes, nodes_len);
+    memcpy(image + bloom_len + nodes_len, trie->labels, trie->labels_len);
+
+    free(trie->bloom);
+    free(trie->nodes);
+    free(trie->labels);
+    trie->bloom = bloom_len ? (trie_bloom_block_t *)image : 0;
+    trie->nodes = (trie_node_t *)(image + bloom_len);
+    trie->labels = image + bloom_len + nodes_len;
+    trie->nodes_capacity = trie->nodes_count;
+    trie->labels_capacity = trie->labels_len;
+
+    trie->image = image;
+    trie->image_len = image_len;
+    trie->image_backing = backing;
+}
+
+static void bloom_init(trie_t *trie, int entries) {
+    uint64_t bits = (uint64_t)entries * TRIE_BLOOM_BITS_PER_ENTRY;
+    uint64_t blocks = 1;
+    while (blocks * sizeof(trie_bloom_block_t) * 8 < bits) {
+        blocks *= 2;
+    }
+
+    trie->bloom = aligned_alloc(sizeof(trie_bloom_block_t), blocks * sizeof(trie_bloom_block_t));
+    if (!trie->bloom) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    memset(trie->bloom, 0, blocks * sizeof(trie_bloom_block_t));
+    trie->bloom_mask = blocks - 1;
+}
+
+static void bloom_add(trie_t *trie, uint64_t hash) {
+    trie_bloom_block_t *block = &trie->bloom[hash & trie->bloom_mask];
+    uint64_t bits = hash * 0x9e3779b97f4a7c15ull; // the low bits already picked the block
+
+    for (int i = 0; i < 8; i++) {
+        block->words[i] |= 1ull << ((bits >> (i * 6)) & 63);
+    }
+}
+
+static char bloom_contains(const trie_bloom_block_t *block, uint64_t hash) {
+    uint64_t bits = hash * 0x9e3779b97f4a7c15ull;
+
+    uint64_t missing = 0;
+    for (int i = 0; i < 8; i++) {
+        missing |= ~block->words[i] & (1ull << ((bits >> (i * 6)) & 63));
+    }
+
+    return missing == 0;
+}
+
+// all blocks are prefetched before any is tested, so a clean name costs about one miss
+static char bloom_may_match(const trie_t *trie,
+                            const uint8_t *name,
+                            const uint8_t *offsets,
+                            int count) {
+    uint64_t hashes[DNS_MAX_NAME_LEN / 2];
+    uint64_t hash = 0;
+
+    for (int i = count - 1; i >= 0; i--) {
+        const uint8_t *label = name + offsets[i];
+        hash = hash_bytes(label, label[0] + 1, hash);
+        hashes[i] = hash;
+        __builtin_prefetch(&trie->bloom[hash & trie->bloom_mask]);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (bloom_contains(&trie->bloom[hashes[i] & trie->bloom_mask], hashes[i])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef DNSPROXY_TRIE_H
+#define DNSPROXY_TRIE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dns.h"
+#include "hugepage.h"
+
+#define TRIE_BLOCK 0x01       // the name and everything below it
+#define TRIE_BLOCK_BELOW 0x02 // only names below it, added as "*.name"
+
+#define TRIE_NO_FORWARD -1
+#define TRIE_BLOOM_BITS_PER_ENTRY 16
+#define TRIE_BLOOM_MIN_ENTRIES 65536 // smaller tries stay in cache and walk faster than a probe
+
+// split block Bloom filter over the suffixes that lead to a node with a rule, a block is one
+// cache line and a key sets one bit in each of its words
+typedef struct {
+    uint64_t words[8];
+} __attribute__((aligned(64))) trie_bloom_block_t;
+
+// a label trie walked from the top level label down, children of a node are contiguous and
+// sorted by length prefixed label so they can be binary searched
+typedef struct {
+    uint32_t label_offset; // length prefixed label in trie_t.labels
+    uint32_t first_child;
+    uint32_t children_count;
+    uint8_t flags;
+    int16_t forward;       // upstream pool for the name and below
+    int16_t forward_below; // upstream pool for names strictly below
+} trie_node_t;
+
+typedef struct {
+    uint8_t *rname; // wire format with the labels in reverse order
+    uint8_t len;
+    uint8_t flags;
+    int16_t forward;
+    char below;
+} trie_entry_t;
+
+typedef struct {
+    trie_entry_t *entries; // collected by trie_add until trie_compile
+    int entries_len;
+    int entries_capacity;
+
+    trie_node_t *nodes;
+    uint32_t nodes_count;
+    uint32_t nodes_capacity;
+    uint8_t *labels;
+    size_t labels_len;
+    size_t labels_capacity;
+
+    trie_bloom_block_t *bloom; // probed before the walk, null when every name must be walked
+    uint64_t bloom_mask;
+
+    int duplicates; // entries trie_compile dropped as listed twice
+    int covered;    // and as below a blocked name, where they could never match
+
+    void *image; // holds the bloom filter, nodes and labels when huge pages are enabled
+    size_t image_len;
+    hugepage_backing_t image_backing;
+} trie_t;
+
+typedef struct {
+    char blocked;
+    int forward; // longest matching forward zone, TRIE_NO_FORWARD if none
+} trie_match_t;
+
+void trie_init(trie_t *trie);
+void trie_free(trie_t *trie);
+
+// name is dotted, "*.name" applies to the names below it only
+int trie_add(trie_t *trie, const char *name, uint8_t flags, int forward);
+// drops duplicates and block entries below blocked names before building the nodes
+int trie_compile(trie_t *trie);
+
+// name is lowercase wire format as returned by dns_read_name
+void trie_match(const trie_t *trie, const uint8_t *name, size_t name_len, trie_match_t *match);
+
+#endif
@@ -0,0 +1,358 @@
+#include "upstream.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int add_upstream(upstreams_t *upstreams, const struct sockaddr_in *addr);
+static char is_healthy(const upstreams_t *upstreams, int upstream);
+static char is_full(const upstreams_t *upstreams, int upstream);
+static char is_last_healthy(const upstreams_t *upstreams, int upstream);
+static void clear_window(upstream_health_t *health);
+
+void upstreams_init(upstreams_t *upstreams) {
+    memset(upstreams, 0, sizeof(*upstreams));
+}
+
+void upstreams_free(upstreams_t *upstreams) {
+    for (int i = 0; i < upstreams->pools_count; i++) {
+        free(upstreams->pools[i].members);
+    }
+
+    free(upstreams->pools);
+    free(upstreams->upstreams);
+    upstreams_init(upstreams);
+}
+
+int upstreams_add_pool(upstreams_t *upstreams, char **servers, int count) {
+    if (count == 0) {
+        fprintf(stderr, "upstream pool is empty\n");
+        return -1;
+    }
+
+    upstream_pool_t pool;
+    pool.count = count;
+    pool.next = 0;
+    pool.members = malloc(sizeof(int) * count);
+    if (!pool.members) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct sockaddr_in addr;
+        if (upstreams_parse(servers[i], &addr)) {
+            fprintf(stderr, "invalid upstream server %s\n", servers[i]);
+            free(pool.members);
+            return -1;
+        }
+
+        pool.members[i] = add_upstream(upstreams, &addr);
+    }
+
+    upstreams->pools = realloc(upstreams->pools,
+                               sizeof(upstream_pool_t) * (upstreams->pools_count + 1));
+    if (!upstreams->pools) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    upstreams->pools[upstreams->pools_count] = pool;
+
+    return upstreams->pools_count++;
+}
+
+int upstreams_select(upstreams_t *upstreams, int pool) {
+    upstream_pool_t *selected = &upstreams->pools[pool];
+    int result = UPSTREAM_NONE;
+    for (int i = 0; i < selected->count; i++) {
+        int member = selected->members[selected->next++ % selected->count];
+        if (!is_healthy(upstreams, member)) {
+            continue;
+        }
+        if (is_full(upstreams, member)) {
+            result = UPSTREAM_FULL;
+            continue;
+        }
+
+        return member;
+    }
+
+    return result;
+}
+
+int upstreams_find(const upstreams_t *upstreams, const struct sockaddr_in *addr) {
+    for (int i = 0; i < upstreams->upstreams_count; i++) {
+        const struct sockaddr_in *upstream = &upstreams->upstreams[i].addr;
+        if (upstream->sin_addr.s_addr == addr->sin_addr.s_addr &&
+            upstream->sin_port == addr->sin_port) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// consistent hashing with bounded loads: no member takes more than UPSTREAM_LOAD_FACTOR percent
+// of its share, a name owned by a member over the bound goes to the next one in its ranking
+int upstreams_select_by_hash(const upstreams_t *upstreams, int pool, uint64_t hash) {
+    const upstream_pool_t *selected = &upstreams->pools[pool];
+    int load = 0;
+    for (int i = 0; i < selected->count; i++) {
+        load += upstreams->upstreams[selected->members[i]].in_flight;
+    }
+
+    int bound = ((load + 1) * UPSTREAM_LOAD_FACTOR + selected->count * 100 - 1) /
+                (selected->count * 100);
+    if (bound < UPSTREAM_MIN_LOAD) {
+        bound = UPSTREAM_MIN_LOAD;
+    }
+
+    int best = UPSTREAM_NONE;     // under the bound
+    int fallback = UPSTREAM_NONE; // over the bound, but under its in-flight limit
+    uint64_t best_score = 0;
+    uint64_t fallback_score = 0;
+    char healthy = 0;
+    for (int i = 0; i < selected->count; i++) {
+        int member = selected->members[i];
+        if (!is_healthy(upstreams, member)) {
+            continue;
+        }
+        healthy = 1;
+        if (is_full(upstreams, member)) {
+            continue;
+        }
+
+        const upstream_t *upstream = &upstreams->upstreams[member];
+        uint64_t score = hash_mix(hash ^ upstream->hash);
+        if (upstream->in_flight < bound && (best < 0 || score > best_score)) {
+            best = member;
+            best_score = score;
+        }
+        if (fallback < 0 || score > fallback_score) {
+            fallback = member;
+            fallback_score = score;
+        }
+    }
+
+    if (best >= 0) {
+        return best;
+    }
+    if (fallback >= 0) {
+        return fallback;
+    }
+
+    return healthy ? UPSTREAM_FULL : UPSTREAM_NONE;
+}
+
+// addresses that are not upstreams, like peers or upstreams dropped by a reload, are ignored
+void upstreams_track(upstreams_t *upstreams, const struct sockaddr_in *addr, int delta) {
+    int found = upstreams_find(upstreams, addr);
+    if (found >= 0 && upstreams->upstreams[found].in_flight + delta >= 0) {
+        upstreams->upstreams[found].in_flight += delta;
+    }
+}
+
+int upstreams_rendezvous(const upstreams_t *upstreams, int pool, uint64_t hash) {
+    const upstream_pool_t *selected = &upstreams->pools[pool];
+    int best = -1;
+    uint64_t best_score = 0;
+    for (int i = 0; i < selected->count; i++) {
+        int member = selected->members[i];
+        uint64_t score = hash_mix(hash ^ upstreams->upstreams[member].hash);
+        if (is_healthy(upstreams, member) && (best < 0 || score > best_score)) {
+            best = member;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+void upstreams_record(upstreams_t *upstreams,
+                      const struct sockaddr_in *addr,
+                      char ok,
+                      uint64_t now) {
+    int found = upstreams_find(upstreams, addr);
+    // late outcomes of queries sent before the ejection are left to the probes
+    if (found < 0 || upstreams->upstreams[found].health.state != UPSTREAM_HEALTHY) {
+        return;
+    }
+
+    upstream_t *upstream = &upstreams->upstreams[found];
+    upstream_health_t *health = &upstream->health;
+    uint64_t second = now / 1000;
+    int slot = second % UPSTREAM_WINDOW;
+    if (health->second[slot] != second) {
+        health->second[slot] = second;
+        health->ok[slot] = 0;
+        health->failed[slot] = 0;
+    }
+
+    if (ok) {
+        health->ok[slot]++;
+        return;
+    }
+    health->failed[slot]++;
+
+    uint32_t ok_count = 0;
+    uint32_t failed_count = 0;
+    for (int i = 0; i < UPSTREAM_WINDOW; i++) {
+        if (health->second[i] + UPSTREAM_WINDOW > second) {
+            ok_count += health->ok[i];
+            failed_count += health->failed[i];
+        }
+    }
+
+    if (failed_count < UPSTREAM_MIN_FAILURES ||
+        failed_count * 100 < (ok_count + failed_count) * UPSTREAM_FAILURE_PERCENT) {
+        return;
+    }
+
+    // panic mode: a pool keeps routing to its last healthy member, a failing server still
+    // answers some queries while an empty pool answers none
+    if (is_last_healthy(upstreams, found)) {
+        return;
+    }
+
+    health->state = UPSTREAM_EJECTED;
+    health->eject_ms = UPSTREAM_EJECT_MIN;
+    health->probe_at = now + health->eject_ms;
+    clear_window(health);
+    printf("upstream %s ejected, %u of %u queries failed\n",
+           upstream->name,
+           failed_count,
+           ok_count + failed_count);
+}
+
+int upstreams_next_probe(upstreams_t *upstreams, uint64_t now) {
+    for (int i = 0; i < upstreams->upstreams_count; i++) {
+        upstream_health_t *health = &upstreams->upstreams[i].health;
+        if (health->state == UPSTREAM_EJECTED && health->probe_at <= now) {
+            health->state = UPSTREAM_PROBING;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void upstreams_probed(upstreams_t *upstreams,
+                      const struct sockaddr_in *addr,
+                      char ok,
+                      uint64_t now) {
+    int found = upstreams_find(upstreams, addr);
+    if (found < 0 || upstreams->upstreams[found].health.state != UPSTREAM_PROBING) {
+        return;
+    }
+
+    upstream_t *upstream = &upstreams->upstreams[found];
+    upstream_health_t *health = &upstream->health;
+    if (ok) {
+        health->state = UPSTREAM_HEALTHY;
+        printf("upstream %s is back\n", upstream->name);
+        return;
+    }
+
+    health->state = UPSTREAM_EJECTED;
+    health->eject_ms = health->eject_ms * 2 < UPSTREAM_EJECT_MAX ? health->eject_ms * 2
+                                                                  : UPSTREAM_EJECT_MAX;
+    health->probe_at = now + health->eject_ms;
+}
+
+// "address" or "address:port"
+int upstreams_parse(const char *server, struct sockaddr_in *addr) {
+    char host[INET_ADDRSTRLEN];
+    uint16_t port = UPSTREAM_DEFAULT_PORT;
+
+    const char *colon = strchr(server, ':');
+    size_t host_len = colon ? (size_t)(colon - server) : strlen(server);
+    if (host_len >= sizeof(host)) {
+        return -1;
+    }
+
+    memcpy(host, server, host_len);
+    host[host_len] = 0;
+
+    if (colon) {
+        char *end;
+        long value = strtol(colon + 1, &end, 10);
+        if (*end != 0 || value <= 0 || value > 65535) {
+            return -1;
+        }
+        port = value;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr->sin_addr) != 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int add_upstream(upstreams_t *upstreams, const struct sockaddr_in *addr) {
+    int found = upstreams_find(upstreams, addr);
+    if (found >= 0) {
+        return found;
+    }
+
+    upstreams->upstreams = realloc(upstreams->upstreams,
+                                   sizeof(upstream_t) * (upstreams->upstreams_count + 1));
+    if (!upstreams->upstreams) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    upstream_t *upstream = &upstreams->upstreams[upstreams->upstreams_count];
+    upstream->addr = *addr;
+
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->sin_addr, host, sizeof(host));
+    snprintf(upstream->name, sizeof(upstream->name), "%s:%d", host, ntohs(addr->sin_port));
+    upstream->hash = hash_bytes(upstream->name, strlen(upstream->name), 0);
+    upstream->in_flight = 0;
+    upstream->sockets = -1;
+    memset(&upstream->health, 0, sizeof(upstream->health));
+
+    return upstreams->upstreams_count++;
+}
+
+static char is_healthy(const upstreams_t *upstreams, int upstream) {
+    return upstreams->upstreams[upstream].health.state == UPSTREAM_HEALTHY;
+}
+
+static char is_full(const upstreams_t *upstreams, int upstream) {
+    return upstreams->max_in_flight &&
+           upstreams->upstreams[upstream].in_flight >= upstreams->max_in_flight;
+}
+
+// whether a pool the upstream is in has no other healthy member
+static char is_last_healthy(const upstreams_t *upstreams, int upstream) {
+    for (int i = 0; i < upstreams->pools_count; i++) {
+        const upstream_pool_t *pool = &upstreams->pools[i];
+        char member = 0;
+        char others = 0;
+        for (int j = 0; j < pool->count; j++) {
+            if (pool->members[j] == upstream) {
+                member = 1;
+            } else if (is_healthy(upstreams, pool->members[j])) {
+                others = 1;
+            }
+        }
+        if (member && !others) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void clear_window(upstream_health_t *health) {
+    memset(health->ok, 0, sizeof(health->ok));
+    memset(health->failed, 0, sizeof(health->failed));
+    memset(health->second, 0, sizeof(health->second));
+}
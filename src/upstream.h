@@ -0,0 +1,99 @@
+#ifndef DNSPROXY_UPSTREAM_H
+#define DNSPROXY_UPSTREAM_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define UPSTREAM_DEFAULT_PORT 53
+#define UPSTREAM_LOAD_FACTOR 125 // percent of its share of the pool's load an upstream may take
+#define UPSTREAM_MIN_LOAD 16     // in-flight queries an upstream takes before spilling at all
+#define UPSTREAM_WINDOW 10       // seconds of answers and timeouts the failure rate is taken over
+#define UPSTREAM_MIN_FAILURES 5  // failures in the window before an upstream can be ejected
+#define UPSTREAM_FAILURE_PERCENT 50
+#define UPSTREAM_EJECT_MIN 1000  // ms until an ejected upstream is probed
+#define UPSTREAM_EJECT_MAX 60000 // failed probes double the wait up to this
+#define UPSTREAM_DEFAULT_MAX_IN_FLIGHT 4096
+
+// returned instead of an upstream index by the selection
+#define UPSTREAM_NONE -1 // every member of the pool is ejected
+#define UPSTREAM_FULL -2 // the healthy members all have max_in_flight queries in flight
+
+// circuit breaker: an upstream failing too often in the window is ejected and gets no queries
+// until it answers a probe
+typedef enum {
+    UPSTREAM_HEALTHY,
+    UPSTREAM_EJECTED,
+    UPSTREAM_PROBING,
+} upstream_state_t;
+
+typedef struct {
+    uint32_t ok[UPSTREAM_WINDOW]; // one slot per second
+    uint32_t failed[UPSTREAM_WINDOW];
+    uint64_t second[UPSTREAM_WINDOW]; // the second a slot counts
+    upstream_state_t state;
+    uint64_t probe_at; // ms since epoch
+    uint32_t eject_ms;
+} upstream_health_t;
+
+typedef struct {
+    struct sockaddr_in addr;
+    char name[INET_ADDRSTRLEN + 6];
+    uint64_t hash; // of the name, the same on every node
+    int in_flight; // queries sent and neither answered nor expired
+    int sockets;   // first of the sockets the event loop connected to it, -1 until then
+    upstream_health_t health;
+} upstream_t;
+
+typedef struct {
+    int *members; // into upstreams_t.upstreams
+    int count;
+    uint32_t next;
+} upstream_pool_t;
+
+// upstreams are shared between pools, so an address listed twice is one upstream
+typedef struct {
+    upstream_t *upstreams;
+    int upstreams_count;
+    upstream_pool_t *pools;
+    int pools_count;
+    char hashed;       // names go to a fixed member of the pool instead of round robin
+    int max_in_flight; // per upstream, 0 for no limit
+    char adopted;      // the event loop took over the in_flight counts and the sockets
+} upstreams_t;
+
+void upstreams_init(upstreams_t *upstreams);
+void upstreams_free(upstreams_t *upstreams);
+
+// servers are "address" or "address:port", returns the pool index
+int upstreams_add_pool(upstreams_t *upstreams, char **servers, int count);
+
+// round robin over the healthy members of a pool that have room for another query, returns the
+// upstream index, UPSTREAM_NONE or UPSTREAM_FULL
+int upstreams_select(upstreams_t *upstreams, int pool);
+int upstreams_find(const upstreams_t *upstreams, const struct sockaddr_in *addr);
+// the highest ranking member for the hash of the qname whose in-flight queries stay under the
+// bound, so every name sticks to one upstream and its cache unless that upstream falls behind.
+// UPSTREAM_NONE or UPSTREAM_FULL like upstreams_select
+int upstreams_select_by_hash(const upstreams_t *upstreams, int pool, uint64_t hash);
+void upstreams_track(upstreams_t *upstreams, const struct sockaddr_in *addr, int delta);
+// rendezvous hashing: the healthy member scoring highest for the hash, so every node that lists
+// the same members picks the same one, and only the hashes of a member that leaves move
+int upstreams_rendezvous(const upstreams_t *upstreams, int pool, uint64_t hash);
+
+// passive health tracking, addresses that are not upstreams are ignored
+void upstreams_record(upstreams_t *upstreams,
+                      const struct sockaddr_in *addr,
+                      char ok,
+                      uint64_t now);
+// returns an ejected upstream whose probe is due and marks it as probing, or -1
+int upstreams_next_probe(upstreams_t *upstreams, uint64_t now);
+// a probe that was answered brings the upstream back, otherwise the wait doubles
+void upstreams_probed(upstreams_t *upstreams,
+                      const struct sockaddr_in *addr,
+                      char ok,
+                      uint64_t now);
+
+int upstreams_parse(const char *server, struct sockaddr_in *addr);
+
+#endif
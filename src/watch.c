@@ -0,0 +1,112 @@
+#include "watch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+static void clear_files(watch_t *watch);
+
+int watch_init(watch_t *watch) {
+    watch->files = 0;
+    watch->files_count = 0;
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd == -1) {
+        fprintf(stderr, "inotify_init1 failed with: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void watch_free(watch_t *watch) {
+    clear_files(watch);
+
+    if (watch->fd != -1) {
+        close(watch->fd);
+        watch->fd = -1;
+    }
+}
+
+int watch_set_files(watch_t *watch, char **paths, int count) {
+    clear_files(watch);
+
+    watch->files = calloc(count ? count : 1, sizeof(watch_file_t));
+    if (!watch->files) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(-1);
+    }
+
+    int ret = 0;
+    for (int i = 0; i < count; i++) {
+        watch_file_t *file = &watch->files[watch->files_count];
+
+        const char *slash = strrchr(paths[i], '/');
+        if (!slash) {
+            file->dir = strdup(".");
+        } else {
+            file->dir = strndup(paths[i], slash == paths[i] ? 1 : slash - paths[i]);
+        }
+        file->name = strdup(slash ? slash + 1 : paths[i]);
+        if (!file->dir || !file->name) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(-1);
+        }
+
+        // a directory watched twice gets the same wd
+        file->wd = inotify_add_watch(watch->fd, file->dir, WATCH_EVENTS);
+        if (file->wd == -1) {
+            fprintf(stderr, "failed to watch %s: %s\n", file->dir, strerror(errno));
+            free(file->dir);
+            free(file->name);
+            ret = -1;
+            continue;
+        }
+
+        watch->files_count++;
+    }
+
+    return ret;
+}
+
+int watch_read_changes(watch_t *watch) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+
+    while (1) {
+        ssize_t len = read(watch->fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            break;
+        }
+
+        for (ssize_t offset = 0; offset < len;) {
+            const struct inotify_event *event = (const struct inotify_event *)(buffer + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+
+            for (int i = 0; event->len && i < watch->files_count; i++) {
+                const watch_file_t *file = &watch->files[i];
+                if (file->wd == event->wd && strcmp(file->name, event->name) == 0) {
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    return changed;
+}
+
+static void clear_files(watch_t *watch) {
+    for (int i = 0; i < watch->files_count; i++) {
+        inotify_rm_watch(watch->fd, watch->files[i].wd);
+        free(watch->files[i].dir);
+        free(watch->files[i].name);
+    }
+
+    free(watch->files);
+    watch->files = 0;
+    watch->files_count = 0;
+}
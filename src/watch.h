@@ -0,0 +1,25 @@
+#ifndef DNSPROXY_WATCH_H
+#define DNSPROXY_WATCH_H
+
+// watches files through their directories, so files replaced by rename are still noticed
+typedef struct {
+    int wd;
+    char *dir;
+    char *name;
+} watch_file_t;
+
+typedef struct {
+    int fd;
+    watch_file_t *files;
+    int files_count;
+} watch_t;
+
+int watch_init(watch_t *watch);
+void watch_free(watch_t *watch);
+
+// replaces the watched set
+int watch_set_files(watch_t *watch, char **paths, int count);
+// drains pending events, returns 1 if a watched file changed
+int watch_read_changes(watch_t *watch);
+
+#endif